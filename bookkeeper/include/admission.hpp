@@ -0,0 +1,118 @@
+#pragma once
+
+#include "asio.hpp"
+#include "nlohmann/json.hpp"
+
+#include <cstddef>
+
+namespace bookkeeper {
+
+/*
+ * Admission control for the sessions of one io thread. Past the limits the
+ * server stops taking work instead of queueing it: acceptors stop accepting,
+ * so new connections wait in the kernel's listen backlog, and sessions stop
+ * reading, so clients are held back by TCP flow control. Latency of the
+ * admitted work stays bounded under overload.
+ *
+ * The configured limits are process-wide and split evenly between the io
+ * threads, which the kernel's SO_REUSEPORT balancing keeps about even. A
+ * limit of 0 disables it. Everything here runs on the owning io thread, so
+ * the counters need no synchronisation; parked coroutines wait on timers
+ * that never expire and are woken by cancelling them.
+ */
+struct Admission {
+	Admission() = delete;
+	Admission(const Admission&) = delete;
+	Admission& operator=(const Admission&) = delete;
+
+	explicit Admission(asio::io_context& ctx, const nlohmann::json& config, size_t threads)
+		: mMaxConnections(share(config.value("max_connections", size_t{0}), threads))
+		, mMaxRequests(share(config.value("max_inflight_requests", size_t{0}), threads))
+		, mHighWaterMark(config.value("outbound_high_water_mark", size_t{0}))
+		, mAcceptorsResumed{ctx, asio::steady_timer::time_point::max()}
+		, mRequestFreed{ctx, asio::steady_timer::time_point::max()}
+	{}
+
+	// Session outbound queue size above which the session stops reading
+	// until the queue has drained to half of it, or 0 for no limit.
+	size_t highWaterMark() const { return mHighWaterMark; }
+	size_t lowWaterMark() const { return mHighWaterMark / 2; }
+
+	size_t connections() const { return mConnections; }
+	size_t requests() const { return mRequests; }
+
+	bool saturated() const {
+		return (mMaxConnections && mConnections >= mMaxConnections) || (mMaxRequests && mRequests >= mMaxRequests);
+	}
+
+	// Parks an acceptor until there is room for another connection.
+	asio::awaitable<void> waitUntilAccepting() {
+		while (saturated()) {
+			++mPausedAcceptors;
+			co_await mAcceptorsResumed.async_wait(asio::as_tuple(asio::use_awaitable));
+			--mPausedAcceptors;
+		}
+	}
+
+	// Counted from accept to the end of the session, handshake included.
+	void addConnection() { ++mConnections; }
+
+	void removeConnection() {
+		--mConnections;
+		resumeAcceptors();
+	}
+
+	// The fast path of acquireRequest(), for callers that want to avoid a
+	// coroutine when there is room.
+	bool tryAcquireRequest() {
+		if (mMaxRequests && mRequests >= mMaxRequests) {
+			return false;
+		}
+
+		++mRequests;
+		return true;
+	}
+
+	asio::awaitable<void> acquireRequest() {
+		while (!tryAcquireRequest()) {
+			++mWaitingRequests;
+			co_await mRequestFreed.async_wait(asio::as_tuple(asio::use_awaitable));
+			--mWaitingRequests;
+		}
+	}
+
+	void releaseRequest() {
+		--mRequests;
+
+		if (mWaitingRequests) {
+			mRequestFreed.cancel_one();
+		}
+
+		resumeAcceptors();
+	}
+
+private:
+	static size_t share(size_t limit, size_t threads) {
+		return limit ? (limit + threads - 1) / threads : 0;
+	}
+
+	void resumeAcceptors() {
+		if (mPausedAcceptors && !saturated()) {
+			mAcceptorsResumed.cancel();
+		}
+	}
+
+	size_t mMaxConnections;
+	size_t mMaxRequests;
+	size_t mHighWaterMark;
+
+	size_t mConnections = 0;
+	size_t mRequests = 0;
+
+	size_t mPausedAcceptors = 0;
+	size_t mWaitingRequests = 0;
+	asio::steady_timer mAcceptorsResumed;
+	asio::steady_timer mRequestFreed;
+};
+
+} //namespace bookkeeper
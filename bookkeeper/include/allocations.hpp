@@ -0,0 +1,109 @@
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/*
+ * Heap allocation accounting for builds configured with
+ * BOOKKEEPER_COUNT_ALLOCATIONS. The global operator new is replaced by one
+ * that counts the calls made on io threads, sessions count the requests
+ * they read, and report() logs the ratio, which should stay at zero once
+ * the server is warmed up; test/allocations.sh checks that it does. The
+ * log, index and snapshot threads work behind the requests and are not
+ * counted, and neither are allocations made with malloc directly
+ * (OpenSSL's).
+ *
+ * The replacement operators are defined here, so only one translation
+ * unit, src/main.cpp, may include this header, directly or not. That still
+ * covers the whole program, the network library included, since the linker
+ * resolves every operator new to them. In other builds everything below is
+ * a no-op.
+ */
+namespace bookkeeper::allocations {
+
+#if defined(BOOKKEEPER_COUNT_ALLOCATIONS)
+
+inline std::atomic<uint64_t> sAllocations = 0;
+inline std::atomic<uint64_t> sRequests = 0;
+inline thread_local bool tCounted = false;
+
+// Counts the calling thread's allocations from now on.
+inline void countThread() {
+	tCounted = true;
+}
+
+inline void countRequest() {
+	sRequests.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void* allocate(size_t size, size_t alignment = 0) {
+	if (tCounted) {
+		sAllocations.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	size = size ? size : 1;
+	auto* pointer = alignment ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+		: std::malloc(size);
+
+	if (!pointer) {
+		throw std::bad_alloc();
+	}
+
+	return pointer;
+}
+
+inline asio::awaitable<void> report(std::chrono::seconds interval) {
+	auto timer = asio::steady_timer{co_await asio::this_coro::executor};
+	uint64_t allocations = sAllocations.load(std::memory_order_relaxed);
+	uint64_t requests = sRequests.load(std::memory_order_relaxed);
+
+	while (true) {
+		timer.expires_after(interval);
+		co_await timer.async_wait(asio::use_awaitable);
+
+		auto currentAllocations = sAllocations.load(std::memory_order_relaxed);
+		auto currentRequests = sRequests.load(std::memory_order_relaxed);
+
+		if (currentRequests != requests) {
+			spdlog::info("[Allocations]: {} allocations for {} requests ({:.3f} per request)",
+				currentAllocations - allocations, currentRequests - requests,
+				double(currentAllocations - allocations) / double(currentRequests - requests));
+		}
+
+		allocations = currentAllocations;
+		requests = currentRequests;
+	}
+}
+
+#else
+
+inline void countRequest() {}
+inline void countThread() {}
+
+#endif
+
+} //namespace bookkeeper::allocations
+
+#if defined(BOOKKEEPER_COUNT_ALLOCATIONS)
+
+// The nothrow and array forms forward to these.
+void* operator new(size_t size) {
+	return bookkeeper::allocations::allocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+	return bookkeeper::allocations::allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept { std::free(pointer); }
+
+#endif
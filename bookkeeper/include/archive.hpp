@@ -0,0 +1,666 @@
+#pragma once
+
+#include "ledger/protocol.hpp"
+
+#include "crc32c.hpp"
+#include "files.hpp"
+#include "posting.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * The postings of closed accounting periods, in an immutable file laid out
+ * by column. Old postings are the bulk of the ledger's history but are only
+ * read in bulk, by period reports, or rarely, by history queries reaching
+ * back that far, so they are stored compactly and for scanning:
+ *
+ * - Postings are in key order, in groups of up to groupRows. Every column
+ *   of a group is stored and checksummed on its own, so a scan reads only
+ *   the columns it needs.
+ * - Accounts, times, sequences and transactions are delta-encoded as
+ *   varints: within an account consecutive postings are close in all of
+ *   them. Deltas that may be negative are zigzag-encoded.
+ * - Currencies are a per-group dictionary of at most 256 entries plus a
+ *   one-byte code per posting.
+ * - Amounts, fixed-point minor units already, are stored as offsets from
+ *   the group's minimum in the fewest bytes (1, 2, 4 or 8) that hold them.
+ * - The directory at the end has the zone maps of every group: its first
+ *   and last key, and the minimum and maximum of every ordered column. A
+ *   scan skips the groups that cannot match, and reads no times at all of a
+ *   group wholly inside its range.
+ *
+ * aggregate() sums the amount column per currency a block of kernelRows at
+ * a time, with branch-free loops over plain arrays that the compiler turns
+ * into vector instructions. Where a group's zone map shows its sums cannot
+ * overflow, it adds without checks.
+ *
+ *   file       | groups | directory: Group[groups] | footer |
+ *   group      | dictionary: u32[currencies] | codes: u8[rows] | amounts: (amount - minimum)[rows] |
+ *              | accounts | times | sequences | transactions |    (varints)
+ *   footer     | from: u64 | to: u64 | rows: u64 | groups: u64 | minTime: u64 | maxTime: u64 |
+ *              | magic: u64 | version: u32 | crc32c: u32 |
+ *
+ * Integers are in host (little-endian) order. The footer's checksum covers
+ * the directory and the footer but itself.
+ */
+struct PeriodArchive {
+	static constexpr size_t groupRows = 65536;
+	static constexpr size_t kernelRows = 1024;
+	static constexpr size_t maxCurrencies = 256;	// per group
+
+	enum Column : size_t {
+		dictionary,
+		codes,
+		amounts,
+		accounts,
+		times,
+		sequences,
+		transactions,
+		columnCount
+	};
+
+	// A directory entry.
+	struct Group {
+		uint64_t offset = 0;
+		uint32_t rows = 0;
+		uint32_t currencies = 0;
+		std::array<uint32_t, columnCount> sizes{};
+		std::array<uint32_t, columnCount> crcs{};
+		PostingKey first;	// rows are in key order, so these bound the accounts
+		PostingKey last;
+		uint64_t minTime = 0;
+		uint64_t maxTime = 0;
+		uint64_t minTransaction = 0;
+		uint64_t maxTransaction = 0;
+		ledger::Amount minAmount = 0;
+		ledger::Amount maxAmount = 0;
+
+		uint64_t offsetOf(Column column) const {
+			auto offset = this->offset;
+			for (size_t c = 0; c < column; ++c) {
+				offset += sizes[c];
+			}
+			return offset;
+		}
+	};
+
+	static_assert(sizeof(Group) == 168, "groups are stored as they are in memory");
+
+	struct Writer;
+
+	PeriodArchive(const PeriodArchive&) = delete;
+	PeriodArchive& operator=(const PeriodArchive&) = delete;
+
+	~PeriodArchive() {
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+
+	// Opens and checks the directory of an archive.
+	static std::shared_ptr<PeriodArchive> open(const std::filesystem::path& path) {
+		auto archive = std::shared_ptr<PeriodArchive>(new PeriodArchive{});
+		archive->path = path;
+		archive->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (archive->fd < 0) {
+			throw std::system_error(errno, std::system_category(), "[PeriodArchive]: cannot open " + path.string());
+		}
+
+		struct stat status;
+		uint8_t footer[footerSize];
+
+		if (::fstat(archive->fd, &status) != 0 || static_cast<size_t>(status.st_size) < footerSize ||
+			files::readAllAt(archive->fd, footer, footerSize, status.st_size - footerSize))
+		{
+			throw std::runtime_error("[PeriodArchive]: " + path.string() + " has no footer");
+		}
+
+		uint64_t groups, magic;
+		uint32_t version, crc;
+		std::memcpy(&archive->from, footer, 8);
+		std::memcpy(&archive->to, footer + 8, 8);
+		std::memcpy(&archive->rows, footer + 16, 8);
+		std::memcpy(&groups, footer + 24, 8);
+		std::memcpy(&archive->minTime, footer + 32, 8);
+		std::memcpy(&archive->maxTime, footer + 40, 8);
+		std::memcpy(&magic, footer + 48, 8);
+		std::memcpy(&version, footer + 56, 4);
+		std::memcpy(&crc, footer + 60, 4);
+
+		archive->size = static_cast<uint64_t>(status.st_size);
+
+		if (magic != archiveMagic || version != formatVersion || groups > (archive->size - footerSize) / sizeof(Group)) {
+			throw std::runtime_error("[PeriodArchive]: " + path.string() + " is not an archive of this version");
+		}
+
+		archive->groups.resize(groups);
+		auto directory = archive->size - footerSize - groups * sizeof(Group);
+
+		if (files::readAllAt(archive->fd, archive->groups.data(), groups * sizeof(Group), directory)) {
+			throw std::runtime_error("[PeriodArchive]: cannot read the directory of " + path.string());
+		}
+
+		auto expected = crc32c(archive->groups.data(), groups * sizeof(Group));
+		expected = crc32c(footer, footerSize - 4, expected);
+
+		if (crc != expected) {
+			throw std::runtime_error("[PeriodArchive]: " + path.string() + " is damaged");
+		}
+
+		for (auto& group: archive->groups) {
+			if (group.offsetOf(columnCount) > directory || group.currencies > maxCurrencies || !group.rows) {
+				throw std::runtime_error("[PeriodArchive]: " + path.string() + " has a malformed directory");
+			}
+
+			archive->fences.push_back(group.first);
+		}
+
+		return archive;
+	}
+
+	// Whether the archive can hold postings of `account`.
+	bool covers(ledger::AccountId account) const {
+		return !groups.empty() && groups.front().first.account <= account && account <= groups.back().last.account;
+	}
+
+	// Decodes the postings of a group, without their currencies.
+	void read(size_t index, std::vector<Posting>& postings) const {
+		auto& group = groups[index];
+		Buffers buffers;
+
+		postings.resize(group.rows);
+		decodeAmounts(group, buffers);
+
+		readColumn(group, accounts, buffers.column);
+		decodeDeltas(buffers.column, group.rows, [&](size_t i, uint64_t delta, uint64_t& previous) {
+			previous += delta;
+			postings[i].key.account = static_cast<ledger::AccountId>(previous);
+		}, false);
+
+		readColumn(group, times, buffers.column);
+		decodeDeltas(buffers.column, group.rows, [&](size_t i, uint64_t delta, uint64_t& previous) {
+			postings[i].key.time = previous += delta;
+		}, true);
+
+		readColumn(group, sequences, buffers.column);
+		decodeDeltas(buffers.column, group.rows, [&](size_t i, uint64_t delta, uint64_t& previous) {
+			postings[i].key.sequence = previous += delta;
+		}, true);
+
+		readColumn(group, transactions, buffers.column);
+		decodeDeltas(buffers.column, group.rows, [&](size_t i, uint64_t delta, uint64_t& previous) {
+			postings[i].transaction = previous += delta;
+		}, true);
+
+		for (size_t i = 0; i < group.rows; ++i) {
+			postings[i].amount = buffers.amounts[i];
+		}
+	}
+
+	// Adds the postings made in [from, to), of `account` or of all accounts,
+	// to `totals`, per currency. False if a total overflows.
+	bool aggregate(std::optional<ledger::AccountId> account, uint64_t from, uint64_t to,
+		std::vector<ledger::ReportRow>& totals) const
+	{
+		Buffers buffers;
+
+		for (auto& group: groups) {
+			if (group.maxTime < from || group.minTime >= to ||
+				(account && (*account < group.first.account || group.last.account < *account)))
+			{
+				continue;
+			}
+
+			decodeAmounts(group, buffers);
+
+			readColumn(group, dictionary, buffers.column);
+			buffers.dictionary.resize(group.currencies);
+			std::memcpy(buffers.dictionary.data(), buffers.column.data(), group.currencies * sizeof(ledger::Currency));
+
+			readColumn(group, codes, buffers.codes);
+
+			// The selection, 1 for every row to add.
+			buffers.selected.assign(group.rows, 1);
+
+			if (group.minTime < from || group.maxTime >= to) {
+				readColumn(group, times, buffers.column);
+				decodeDeltas(buffers.column, group.rows, [&](size_t i, uint64_t delta, uint64_t& previous) {
+					previous += delta;
+					buffers.selected[i] &= static_cast<uint8_t>(previous >= from) & static_cast<uint8_t>(previous < to);
+				}, true);
+			}
+
+			if (account && (group.first.account != *account || group.last.account != *account)) {
+				readColumn(group, accounts, buffers.column);
+				decodeDeltas(buffers.column, group.rows, [&](size_t i, uint64_t delta, uint64_t& previous) {
+					previous += delta;
+					buffers.selected[i] &= static_cast<uint8_t>(previous == *account);
+				}, false);
+			}
+
+			for (size_t code = 0; code < group.currencies; ++code) {
+				auto sums = canOverflow(group) ? sumChecked(buffers, code) : sum(buffers, code);
+
+				if (!sums || !add(totals, buffers.dictionary[code], *sums)) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	std::filesystem::path path;
+	uint64_t from = 0;	// the periods the archive closed
+	uint64_t to = 0;
+	uint64_t rows = 0;
+	uint64_t minTime = 0;	// of the postings, which may predate `from`
+	uint64_t maxTime = 0;
+	uint64_t size = 0;	// of the file
+	std::vector<Group> groups;
+	std::vector<PostingKey> fences;	// the first key of every group
+	int fd = -1;
+
+private:
+	static constexpr uint64_t archiveMagic = 0x3130435241504b42ull;	// "BKPARC01"
+	static constexpr uint32_t formatVersion = 1;
+	static constexpr size_t footerSize = 64;
+
+	struct Sums {
+		uint64_t postings = 0;
+		ledger::Amount debits = 0;
+		ledger::Amount credits = 0;	// negative
+	};
+
+	// Scratch space of a scan.
+	struct Buffers {
+		std::vector<uint8_t> column;
+		std::vector<uint8_t> codes;
+		std::vector<uint8_t> selected;
+		std::vector<ledger::Amount> amounts;
+		std::vector<ledger::Currency> dictionary;
+	};
+
+	PeriodArchive() = default;
+
+	void readColumn(const Group& group, Column column, std::vector<uint8_t>& buffer) const {
+		buffer.resize(group.sizes[column]);
+
+		if (auto error = files::readAllAt(fd, buffer.data(), buffer.size(), group.offsetOf(column))) {
+			throw std::system_error(error, "[PeriodArchive]: cannot read " + path.string());
+		}
+
+		if (crc32c(buffer.data(), buffer.size()) != group.crcs[column]) {
+			throw std::runtime_error("[PeriodArchive]: corrupt group at " + std::to_string(group.offset) + " in " +
+				path.string());
+		}
+	}
+
+	template <typename Offset>
+	static void unpack(const uint8_t* packed, size_t rows, ledger::Amount minimum, ledger::Amount* amounts) {
+		auto* offsets = reinterpret_cast<const Offset*>(packed);
+
+		for (size_t i = 0; i < rows; ++i) {
+			amounts[i] = static_cast<ledger::Amount>(static_cast<uint64_t>(minimum) + offsets[i]);
+		}
+	}
+
+	void decodeAmounts(const Group& group, Buffers& buffers) const {
+		readColumn(group, amounts, buffers.column);
+		buffers.amounts.resize(group.rows);
+
+		auto width = group.sizes[amounts] / group.rows;
+		auto* packed = buffers.column.data();
+
+		if (group.sizes[amounts] % group.rows) {
+			width = 0;
+		}
+
+		switch (width) {
+			case 1: unpack<uint8_t>(packed, group.rows, group.minAmount, buffers.amounts.data()); break;
+			case 2: unpack<uint16_t>(packed, group.rows, group.minAmount, buffers.amounts.data()); break;
+			case 4: unpack<uint32_t>(packed, group.rows, group.minAmount, buffers.amounts.data()); break;
+			case 8: unpack<uint64_t>(packed, group.rows, group.minAmount, buffers.amounts.data()); break;
+			default: throw std::runtime_error("[PeriodArchive]: malformed amounts in " + path.string());
+		}
+	}
+
+	// Calls `apply(row, delta, previous)` for the varint of every row,
+	// zigzag-decoded if `signedDeltas`, with the decoded value of the row
+	// before in `previous`.
+	template <typename Apply>
+	void decodeDeltas(const std::vector<uint8_t>& column, size_t rows, Apply&& apply, bool signedDeltas) const {
+		size_t offset = 0;
+		uint64_t previous = 0;
+
+		for (size_t i = 0; i < rows; ++i) {
+			uint64_t value = 0;
+
+			for (unsigned shift = 0;; shift += 7) {
+				if (offset == column.size() || shift > 63) {
+					throw std::runtime_error("[PeriodArchive]: malformed column in " + path.string());
+				}
+
+				auto byte = column[offset++];
+				value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+				if (!(byte & 0x80)) {
+					break;
+				}
+			}
+
+			apply(i, signedDeltas ? (value >> 1) ^ (~(value & 1) + 1) : value, previous);
+		}
+	}
+
+	// Whether the sums of a currency in a group can leave the range of an
+	// Amount: if not, they need no checks.
+	static bool canOverflow(const Group& group) {
+		auto limit = std::max(group.maxAmount, group.minAmount == std::numeric_limits<ledger::Amount>::min() ?
+			std::numeric_limits<ledger::Amount>::max() : -group.minAmount);
+		ledger::Amount bound;
+		return __builtin_mul_overflow(limit, static_cast<ledger::Amount>(group.rows), &bound);
+	}
+
+	// The kernel: branch-free over a block of rows at a time.
+	static std::optional<Sums> sum(const Buffers& buffers, size_t code) {
+		auto rows = buffers.amounts.size();
+		auto match = static_cast<uint8_t>(code);
+		Sums sums;
+
+		for (size_t begin = 0; begin < rows; begin += kernelRows) {
+			auto end = std::min(rows, begin + kernelRows);
+			ledger::Amount debits = 0;
+			ledger::Amount credits = 0;
+			uint64_t postings = 0;
+
+			for (size_t i = begin; i < end; ++i) {
+				auto taken = static_cast<ledger::Amount>((buffers.codes[i] == match) & buffers.selected[i]);
+				auto amount = buffers.amounts[i] * taken;
+				debits += amount > 0 ? amount : 0;
+				credits += amount < 0 ? amount : 0;
+				postings += static_cast<uint64_t>(taken);
+			}
+
+			sums.debits += debits;
+			sums.credits += credits;
+			sums.postings += postings;
+		}
+
+		return sums;
+	}
+
+	static std::optional<Sums> sumChecked(const Buffers& buffers, size_t code) {
+		Sums sums;
+
+		for (size_t i = 0; i < buffers.amounts.size(); ++i) {
+			if (buffers.codes[i] != code || !buffers.selected[i]) {
+				continue;
+			}
+
+			auto amount = buffers.amounts[i];
+			auto& total = amount > 0 ? sums.debits : sums.credits;
+
+			if (__builtin_add_overflow(total, amount, &total)) {
+				return std::nullopt;
+			}
+
+			++sums.postings;
+		}
+
+		return sums;
+	}
+
+	static bool add(std::vector<ledger::ReportRow>& totals, ledger::Currency currency, const Sums& sums) {
+		if (!sums.postings) {
+			return true;
+		}
+
+		auto row = std::find_if(totals.begin(), totals.end(), [&](auto& row) { return row.currency == currency; });
+
+		if (row == totals.end()) {
+			row = totals.insert(totals.end(), ledger::ReportRow{.currency = currency});
+		}
+
+		row->postings += sums.postings;
+		return sums.credits != std::numeric_limits<ledger::Amount>::min() &&
+			!__builtin_add_overflow(row->debits, sums.debits, &row->debits) &&
+			!__builtin_add_overflow(row->credits, -sums.credits, &row->credits);
+	}
+};
+
+// Writes an archive, postings in key order, to a temporary file and
+// publishes it under its name.
+struct PeriodArchive::Writer {
+	Writer(const std::filesystem::path& path, uint64_t from, uint64_t to)
+		: mPath(path)
+		, mTemporary(std::filesystem::path{path} += ".tmp")
+		, mFrom(from)
+		, mTo(to)
+	{
+		mFd = ::open(mTemporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (mFd < 0) {
+			throw std::system_error(errno, std::system_category(), "[PeriodArchive]: cannot create " + mTemporary.string());
+		}
+
+		mRows.reserve(groupRows);
+		mCodes.reserve(groupRows);
+	}
+
+	~Writer() {
+		if (mFd >= 0) {
+			::close(mFd);
+			std::error_code ignored;
+			std::filesystem::remove(mTemporary, ignored);
+		}
+	}
+
+	void add(const Posting& posting, ledger::Currency currency) {
+		auto code = std::find(mDictionary.begin(), mDictionary.end(), currency) - mDictionary.begin();
+
+		if (static_cast<size_t>(code) == mDictionary.size()) {
+			if (mDictionary.size() == maxCurrencies) {
+				writeGroup();
+				code = 0;
+			}
+
+			mDictionary.push_back(currency);
+		}
+
+		mRows.push_back(posting);
+		mCodes.push_back(static_cast<uint8_t>(code));
+
+		if (mRows.size() == groupRows) {
+			writeGroup();
+		}
+	}
+
+	// Rows added, including those of the group not written yet.
+	uint64_t rows() const { return mCount + mRows.size(); }
+
+	// The size of the file, once finished.
+	uint64_t size() const { return mOffset; }
+
+	void finish() {
+		if (!mRows.empty()) {
+			writeGroup();
+		}
+
+		uint8_t footer[footerSize];
+		uint64_t groups = mGroups.size();
+		auto minTime = mGroups.empty() ? 0 : std::numeric_limits<uint64_t>::max();
+		uint64_t maxTime = 0;
+
+		for (auto& group: mGroups) {
+			minTime = std::min(minTime, group.minTime);
+			maxTime = std::max(maxTime, group.maxTime);
+		}
+
+		std::memcpy(footer, &mFrom, 8);
+		std::memcpy(footer + 8, &mTo, 8);
+		std::memcpy(footer + 16, &mCount, 8);
+		std::memcpy(footer + 24, &groups, 8);
+		std::memcpy(footer + 32, &minTime, 8);
+		std::memcpy(footer + 40, &maxTime, 8);
+		std::memcpy(footer + 48, &archiveMagic, 8);
+		std::memcpy(footer + 56, &formatVersion, 4);
+
+		auto crc = crc32c(mGroups.data(), mGroups.size() * sizeof(Group));
+		crc = crc32c(footer, footerSize - 4, crc);
+		std::memcpy(footer + 60, &crc, 4);
+
+		write(mGroups.data(), mGroups.size() * sizeof(Group));
+		write(footer, sizeof(footer));
+
+		if (::fdatasync(mFd) != 0) {
+			throw std::system_error(errno, std::system_category(), "[PeriodArchive]: cannot sync " + mTemporary.string());
+		}
+
+		::close(mFd);
+		mFd = -1;
+
+		if (::rename(mTemporary.c_str(), mPath.c_str()) != 0) {
+			throw std::system_error(errno, std::system_category(), "[PeriodArchive]: cannot rename " + mTemporary.string());
+		}
+
+		if (auto error = files::syncDirectory(mPath.parent_path())) {
+			throw std::system_error(error, "[PeriodArchive]: cannot sync " + mPath.parent_path().string());
+		}
+	}
+
+private:
+	static void putVarint(std::vector<uint8_t>& column, uint64_t value) {
+		while (value >= 0x80) {
+			column.push_back(static_cast<uint8_t>(value) | 0x80);
+			value >>= 7;
+		}
+
+		column.push_back(static_cast<uint8_t>(value));
+	}
+
+	static uint64_t zigzag(uint64_t delta) {
+		return (delta << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+	}
+
+	// Deltas of a field from row to row, wrapping.
+	template <typename Field>
+	void putDeltas(Field&& field, bool signedDeltas) {
+		mColumn.clear();
+		uint64_t previous = 0;
+
+		for (auto& posting: mRows) {
+			uint64_t value = field(posting);
+			putVarint(mColumn, signedDeltas ? zigzag(value - previous) : value - previous);
+			previous = value;
+		}
+	}
+
+	template <typename Offset>
+	void pack(ledger::Amount minimum) {
+		mColumn.resize(mRows.size() * sizeof(Offset));
+		auto* offsets = reinterpret_cast<Offset*>(mColumn.data());
+
+		for (size_t i = 0; i < mRows.size(); ++i) {
+			offsets[i] = static_cast<Offset>(static_cast<uint64_t>(mRows[i].amount) - static_cast<uint64_t>(minimum));
+		}
+	}
+
+	void writeGroup() {
+		auto group = Group{};
+		group.offset = mOffset;
+		group.rows = static_cast<uint32_t>(mRows.size());
+		group.currencies = static_cast<uint32_t>(mDictionary.size());
+		group.first = mRows.front().key;
+		group.last = mRows.back().key;
+		group.minTime = group.minTransaction = std::numeric_limits<uint64_t>::max();
+		group.minAmount = std::numeric_limits<ledger::Amount>::max();
+		group.maxAmount = std::numeric_limits<ledger::Amount>::min();
+
+		for (auto& posting: mRows) {
+			group.minTime = std::min(group.minTime, posting.key.time);
+			group.maxTime = std::max(group.maxTime, posting.key.time);
+			group.minTransaction = std::min(group.minTransaction, posting.transaction);
+			group.maxTransaction = std::max(group.maxTransaction, posting.transaction);
+			group.minAmount = std::min(group.minAmount, posting.amount);
+			group.maxAmount = std::max(group.maxAmount, posting.amount);
+		}
+
+		auto put = [&](Column column, const void* data, size_t size) {
+			group.sizes[column] = static_cast<uint32_t>(size);
+			group.crcs[column] = crc32c(data, size);
+			write(data, size);
+		};
+
+		put(dictionary, mDictionary.data(), mDictionary.size() * sizeof(ledger::Currency));
+		put(codes, mCodes.data(), mCodes.size());
+
+		auto range = static_cast<uint64_t>(group.maxAmount) - static_cast<uint64_t>(group.minAmount);
+
+		if (range <= std::numeric_limits<uint8_t>::max()) {
+			pack<uint8_t>(group.minAmount);
+		} else if (range <= std::numeric_limits<uint16_t>::max()) {
+			pack<uint16_t>(group.minAmount);
+		} else if (range <= std::numeric_limits<uint32_t>::max()) {
+			pack<uint32_t>(group.minAmount);
+		} else {
+			pack<uint64_t>(group.minAmount);
+		}
+
+		put(amounts, mColumn.data(), mColumn.size());
+
+		putDeltas([](const Posting& posting) { return posting.key.account; }, false);
+		put(accounts, mColumn.data(), mColumn.size());
+		putDeltas([](const Posting& posting) { return posting.key.time; }, true);
+		put(times, mColumn.data(), mColumn.size());
+		putDeltas([](const Posting& posting) { return posting.key.sequence; }, true);
+		put(sequences, mColumn.data(), mColumn.size());
+		putDeltas([](const Posting& posting) { return posting.transaction; }, true);
+		put(transactions, mColumn.data(), mColumn.size());
+
+		mGroups.push_back(group);
+		mCount += mRows.size();
+		mRows.clear();
+		mCodes.clear();
+		mDictionary.clear();
+	}
+
+	void write(const void* data, size_t size) {
+		if (auto error = files::writeAll(mFd, data, size)) {
+			throw std::system_error(error, "[PeriodArchive]: cannot write " + mTemporary.string());
+		}
+
+		mOffset += size;
+	}
+
+	std::filesystem::path mPath;
+	std::filesystem::path mTemporary;
+	uint64_t mFrom;
+	uint64_t mTo;
+	int mFd = -1;
+	uint64_t mOffset = 0;
+	uint64_t mCount = 0;
+
+	std::vector<Posting> mRows;
+	std::vector<uint8_t> mCodes;
+	std::vector<ledger::Currency> mDictionary;
+	std::vector<uint8_t> mColumn;
+	std::vector<Group> mGroups;
+};
+
+} //namespace bookkeeper
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace bookkeeper {
+
+namespace detail {
+
+constexpr std::array<uint32_t, 256> makeCrc32cTable() {
+	std::array<uint32_t, 256> table{};
+
+	for (uint32_t i = 0; i < 256; ++i) {
+		auto crc = i;
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78u : 0u);
+		}
+		table[i] = crc;
+	}
+
+	return table;
+}
+
+inline constexpr auto crc32cTable = makeCrc32cTable();
+
+} //namespace detail
+
+/*
+ * CRC-32C (Castagnoli), the checksum used by everything the server writes to
+ * disk. Table driven, one byte per step; records are small and the cost is
+ * dwarfed by the fdatasync they wait for.
+ */
+inline uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0) {
+	auto* bytes = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+
+	for (size_t i = 0; i < size; ++i) {
+		crc = detail::crc32cTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+} //namespace bookkeeper
@@ -0,0 +1,422 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include "ledger/ledger.hpp"
+#include "ledger/protocol.hpp"
+
+#include "network/frame.hpp"
+
+#include "crc32c.hpp"
+#include "idempotency.hpp"
+#include "posting_index.hpp"
+#include "shard.hpp"
+#include "wal.hpp"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <span>
+
+namespace bookkeeper {
+
+/*
+ * Turns request frames into typed ledger calls on one io thread: the frame
+ * type selects the request struct, its payload is decoded into it, and the
+ * thread's Shard executes it, in place when the accounts are its own and
+ * through the shards owning them otherwise.
+ *
+ * Every mutation that succeeds is logged by the shard that applies it, so
+ * the log follows the order in which each account changed, and its reply is
+ * held back until the record is durable. Other sessions may read the new
+ * balances a little earlier than that.
+ *
+ * Writes with an idempotency key go through the IdempotencyCache. The key is
+ * claimed before the write executes, so of concurrent requests with the same
+ * key only the first runs; the others, and later retries, get its result
+ * once it is durable.
+ *
+ * History queries look the account's postings up in the PostingIndex, once
+ * it holds everything that was durable when they came, so that a client
+ * sees the postings of its own acknowledged writes; they never read the log.
+ * Posting times are not in log order, so a query that continues a history
+ * goes on by lsn: it finishes the round of postings its cursor is in, then
+ * returns those indexed since in a new one, each in key order.
+ * Their replies are streamed: every page but the last is handed to the
+ * session's sendPartial() as soon as it fills, and the next one is only read
+ * once the session had room for it, so a query holds a page and a block
+ * however long the history.
+ *
+ * Reports are added up from the period archives of the PostingIndex, on its
+ * query threads.
+ */
+struct Dispatcher {
+	static constexpr size_t historyPageRows = 256;
+
+	Dispatcher() = delete;
+	Dispatcher(const Dispatcher&) = delete;
+	Dispatcher& operator=(const Dispatcher&) = delete;
+
+	explicit Dispatcher(Shard& shard, Wal& wal, PostingIndex& index, IdempotencyCache& idempotency)
+		: mShard(shard)
+		, mWal(wal)
+		, mIndex(index)
+		, mIdempotency(idempotency)
+	{}
+
+	// `session` takes the frames of streamed replies ahead of the last one,
+	// which is left in `reply` like any other.
+	template <typename Session>
+	asio::awaitable<void> dispatch(const network::PooledFrame& request, network::FrameWriter& reply, Session& session) {
+		reply.begin(request.type, request.requestId);
+		uint64_t lsn = 0;
+
+		switch (static_cast<ledger::MessageType>(request.type)) {
+			case ledger::MessageType::echo:
+				reply.append(request.payload()).append(" yourself!");
+				break;
+			case ledger::MessageType::openAccount:
+				lsn = co_await handleWrite<ledger::OpenAccount>(request, reply);
+				break;
+			case ledger::MessageType::postTransaction:
+				lsn = co_await handleWrite<ledger::PostTransaction>(request, reply);
+				break;
+			case ledger::MessageType::getBalance:
+				co_await handleBalance(request, reply);
+				break;
+			case ledger::MessageType::getHistory:
+				co_await handleHistory(request, reply, session);
+				break;
+			case ledger::MessageType::getReport:
+				co_await handleReport(request, reply);
+				break;
+			default:
+				reply.appendLe(ledger::Status::unknownType);
+				break;
+		}
+
+		if (lsn) {
+			co_await mWal.asyncWaitDurable(lsn, asio::use_awaitable);
+		}
+	}
+
+	// Re-applies the mutation logged at `lsn` during recovery, before the io
+	// threads run. The log only holds mutations that succeeded, so anything
+	// else means it does not match the state it is replayed onto. Idempotency
+	// keys are remembered again, as of the replay: keys of writes before the
+	// snapshot are not.
+	static void replay(Shards& shards, IdempotencyCache& idempotency, uint64_t lsn, uint16_t type, std::string_view record) {
+		auto status = ledger::Status::malformed;
+		auto logged = Shards::parse(type, record);
+
+		switch (logged ? logged->type : ledger::MessageType::echo) {
+			case ledger::MessageType::openAccount:
+				if (auto request = ledger::OpenAccount{}; request.decode(logged->payload)) {
+					auto account = shards.replayOpen(lsn, logged->id, request.currency);
+					status = ledger::Status::ok;
+					remember(idempotency, request, logged->payload, {.status = status, .value = account});
+				}
+				break;
+			case ledger::MessageType::postTransaction:
+				if (auto request = ledger::PostTransaction{}; request.decode(logged->payload)) {
+					auto result = shards.replayPost(lsn, logged->id, {request.legs.data(), request.legCount});
+					status = result.status;
+					remember(idempotency, request, logged->payload, {.status = status, .value = result.transaction});
+				}
+				break;
+			default:
+				status = ledger::Status::unknownType;
+				break;
+		}
+
+		if (status != ledger::Status::ok) {
+			throw std::runtime_error("[Dispatcher]: cannot replay logged request of type " + std::to_string(type) +
+				": " + std::string(ledger::toString(status)));
+		}
+	}
+
+private:
+	using WriteResult = IdempotencyCache::Result;
+
+	// Returns the lsn the reply has to wait for, or 0 if nothing was logged.
+	template <typename Request>
+	asio::awaitable<uint64_t> handleWrite(const network::PooledFrame& frame, network::FrameWriter& reply) {
+		auto request = Request{};
+		auto payload = frame.payload();
+
+		if (!request.decode(payload)) {
+			reply.appendLe(ledger::Status::malformed);
+			co_return 0;
+		}
+
+		if (request.key.empty() || !mIdempotency.enabled()) {
+			co_return respond(request, co_await execute(request, payload), reply);
+		}
+
+		auto fingerprint = fingerprintOf(request, payload);
+
+		// A pending result means the first request with the key is still
+		// executing, here or on another io thread; its result is waited for.
+		while (auto original = mIdempotency.claim(request.key, fingerprint)) {
+			if (original->status == ledger::Status::busy) {
+				reply.appendLe(ledger::Status::busy);
+				co_return 0;
+			}
+
+			if (original->fingerprint != fingerprint) {
+				reply.appendLe(ledger::Status::keyReused);
+				co_return 0;
+			}
+
+			if (!original->pending) {
+				co_return respond(request, *original, reply);
+			}
+
+			co_await mIdempotency.asyncWaitPending(request.key, asio::use_awaitable);
+		}
+
+		WriteResult result;
+
+		try {
+			result = co_await execute(request, payload);
+		} catch (...) {
+			mIdempotency.release(request.key);
+			throw;
+		}
+
+		result.fingerprint = fingerprint;
+		mIdempotency.insert(request.key, result);
+
+		co_return respond(request, result, reply);
+	}
+
+	// The request type and payload without the key.
+	template <typename Request>
+	static uint32_t fingerprintOf(const Request& request, std::string_view payload) {
+		auto type = static_cast<uint16_t>(request.type);
+		auto body = payload.substr(0, payload.size() - (request.key.empty() ? 0 : ledger::IdempotencyKey::size));
+		return crc32c(body.data(), body.size(), crc32c(&type, sizeof(type)));
+	}
+
+	template <typename Request>
+	static void remember(IdempotencyCache& idempotency, const Request& request, std::string_view payload,
+		WriteResult result)
+	{
+		if (!request.key.empty()) {
+			result.fingerprint = fingerprintOf(request, payload);
+			idempotency.insert(request.key, result);
+		}
+	}
+
+	// Accounts are opened in this thread's own partitions.
+	asio::awaitable<WriteResult> execute(const ledger::OpenAccount& request, std::string_view payload) {
+		auto [account, lsn] = mShard.openAccount(request.currency, payload);
+		co_return WriteResult{.status = ledger::Status::ok, .value = account, .lsn = lsn};
+	}
+
+	asio::awaitable<WriteResult> execute(const ledger::PostTransaction& request, std::string_view payload) {
+		auto legs = std::span{request.legs.data(), request.legCount};
+		auto result = mShard.tryPost(legs, payload);
+
+		if (!result) {
+			result = co_await mShard.post(legs, payload);
+		}
+
+		co_return WriteResult{.status = result->status, .value = result->transaction, .lsn = result->lsn};
+	}
+
+	// Writes the reply of a write result, first or repeated, and returns the
+	// lsn it has to wait for.
+	static uint64_t respond(const ledger::OpenAccount&, const WriteResult& result, network::FrameWriter& reply) {
+		reply.appendLe(result.status);
+
+		if (result.status == ledger::Status::ok) {
+			reply.appendLe(static_cast<ledger::AccountId>(result.value));
+		}
+
+		return result.lsn;
+	}
+
+	static uint64_t respond(const ledger::PostTransaction&, const WriteResult& result, network::FrameWriter& reply) {
+		reply.appendLe(result.status);
+
+		if (result.status == ledger::Status::ok) {
+			reply.appendLe(result.value);
+		}
+
+		return result.lsn;
+	}
+
+	asio::awaitable<void> handleBalance(const network::PooledFrame& frame, network::FrameWriter& reply) {
+		auto request = ledger::GetBalance{};
+
+		if (!request.decode(frame.payload())) {
+			reply.appendLe(ledger::Status::malformed);
+			co_return;
+		}
+
+		auto balance = mShard.tryBalance(request.account);
+
+		if (!balance) {
+			balance = co_await mShard.balance(request.account);
+		}
+
+		reply.appendLe(balance->status);
+
+		if (balance->status == ledger::Status::ok) {
+			reply.appendLe(balance->amount).appendLe(balance->currency);
+		}
+	}
+
+	template <typename Session>
+	asio::awaitable<void> handleHistory(const network::PooledFrame& frame, network::FrameWriter& reply, Session& session) {
+		auto request = ledger::GetHistory{};
+
+		auto durable = mWal.durableLsn();
+
+		if (!request.decode(frame.payload()) || request.cursor.after > request.cursor.through ||
+			request.cursor.through > durable)
+		{
+			reply.appendLe(ledger::Status::malformed);
+			co_return;
+		}
+
+		auto account = mShard.tryBalance(request.account);
+
+		if (!account) {
+			account = co_await mShard.balance(request.account);
+		}
+
+		if (account->status != ledger::Status::ok) {
+			reply.appendLe(account->status);
+			co_return;
+		}
+
+		auto cursor = request.cursor;
+		auto left = request.limit ? uint64_t{request.limit} : std::numeric_limits<uint64_t>::max();
+
+		std::array<ledger::HistoryRow, historyPageRows> rows;
+		size_t count = 0;
+
+		auto flushPage = [&]() -> asio::awaitable<void> {
+			writePage(reply, {rows.data(), count}, cursor, true);
+			co_await session.sendPartial(reply);
+			reply.begin(frame.type, frame.requestId);
+			count = 0;
+		};
+
+		co_await mIndex.asyncWaitIndexed(durable, asio::use_awaitable);
+		auto target = mIndex.indexedLsn();
+
+		// Only while the index stops.
+		if (target < cursor.through) {
+			reply.appendLe(ledger::Status::busy);
+			co_return;
+		}
+
+		std::array<Posting, historyPageRows> postings;
+
+		// Finishes the cursor's round, then starts one of everything indexed
+		// since; its postings were made at the time floor or later.
+		while (left) {
+			if (cursor.after == cursor.through) {
+				if (cursor.through == target) {
+					break;
+				}
+
+				cursor = {mIndex.timeFloor(cursor.through), 0, cursor.through, target};
+			}
+
+			// Blocks are read off the io thread.
+			auto scan = mIndex.scan(request.account, PostingKey{request.account, 0, cursor.time, cursor.sequence},
+				cursor.after, cursor.through);
+
+			while (left) {
+				auto found = co_await scan.next({postings.data(), std::min<uint64_t>(left, rows.size() - count)});
+
+				if (!found) {
+					cursor = {0, 0, cursor.through, cursor.through};
+					break;
+				}
+
+				for (auto& posting: std::span{postings.data(), found}) {
+					rows[count++] = {posting.transaction, posting.key.time, posting.amount};
+					cursor.time = posting.key.time;
+					cursor.sequence = posting.key.sequence;
+				}
+
+				left -= found;
+
+				if (count == rows.size() && left) {
+					co_await flushPage();
+				}
+			}
+		}
+
+		writePage(reply, {rows.data(), count}, cursor, false);
+	}
+
+	asio::awaitable<void> handleReport(const network::PooledFrame& frame, network::FrameWriter& reply) {
+		auto request = ledger::GetReport{};
+
+		if (!request.decode(frame.payload()) || request.from > request.to) {
+			reply.appendLe(ledger::Status::malformed);
+			co_return;
+		}
+
+		std::optional<ledger::AccountId> account;
+
+		if (request.account != ledger::GetReport::allAccounts) {
+			auto balance = mShard.tryBalance(request.account);
+
+			if (!balance) {
+				balance = co_await mShard.balance(request.account);
+			}
+
+			if (balance->status != ledger::Status::ok) {
+				reply.appendLe(balance->status);
+				co_return;
+			}
+
+			account = request.account;
+		}
+
+		if (request.to > mIndex.closed()) {
+			reply.appendLe(ledger::Status::periodOpen);
+			co_return;
+		}
+
+		std::vector<ledger::ReportRow> totals;
+
+		if (!co_await mIndex.report(account, request.from, request.to, totals)) {
+			reply.appendLe(ledger::Status::overflow);
+			co_return;
+		}
+
+		std::sort(totals.begin(), totals.end(), [](auto& a, auto& b) { return a.currency < b.currency; });
+		reply.appendLe(ledger::Status::ok).appendLe(static_cast<uint16_t>(totals.size()));
+
+		for (auto& row: totals) {
+			row.encode(reply);
+		}
+	}
+
+	static void writePage(network::FrameWriter& reply, std::span<const ledger::HistoryRow> rows,
+		const ledger::HistoryCursor& cursor, bool more)
+	{
+		reply.appendLe(ledger::Status::ok).appendLe(static_cast<uint16_t>(more));
+		cursor.encode(reply);
+		reply.appendLe(static_cast<uint16_t>(rows.size()));
+
+		for (auto& row: rows) {
+			row.encode(reply);
+		}
+	}
+
+	Shard& mShard;
+	Wal& mWal;
+	PostingIndex& mIndex;
+	IdempotencyCache& mIdempotency;
+};
+
+} //namespace bookkeeper
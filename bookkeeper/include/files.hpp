@@ -0,0 +1,82 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+/*
+ * The few POSIX file operations the durable state needs, with errors
+ * reported as std::error_code so the callers on hot paths decide whether to
+ * throw.
+ */
+namespace bookkeeper::files {
+
+inline std::error_code writeAll(int fd, const void* data, size_t size) {
+	auto* bytes = static_cast<const char*>(data);
+	size_t written = 0;
+
+	while (written < size) {
+		auto result = ::write(fd, bytes + written, size - written);
+
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return {errno, std::system_category()};
+		}
+
+		written += result;
+	}
+
+	return {};
+}
+
+// Reads exactly `size` bytes at `offset`; running into the end of the file
+// is an error too.
+inline std::error_code readAllAt(int fd, void* data, size_t size, off_t offset) {
+	auto* bytes = static_cast<char*>(data);
+	size_t done = 0;
+
+	while (done < size) {
+		auto result = ::pread(fd, bytes + done, size - done, offset + done);
+
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return {errno, std::system_category()};
+		}
+
+		if (result == 0) {
+			return std::make_error_code(std::errc::io_error);
+		}
+
+		done += result;
+	}
+
+	return {};
+}
+
+// Makes creations, renames and removals of entries in `directory` durable.
+inline std::error_code syncDirectory(const std::filesystem::path& directory) {
+	auto fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return {errno, std::system_category()};
+	}
+
+	std::error_code error;
+	if (::fsync(fd) != 0) {
+		error = {errno, std::system_category()};
+	}
+
+	::close(fd);
+	return error;
+}
+
+} //namespace bookkeeper::files
@@ -0,0 +1,346 @@
+#pragma once
+
+#include "asio.hpp"
+#include "nlohmann/json.hpp"
+
+#include "ledger/protocol.hpp"
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * The results of recent ledger writes by idempotency key, so that a client
+ * retrying a write whose reply it never saw gets the original result rather
+ * than posting twice.
+ *
+ * The cache holds at most "idempotency_cache_size" keys (0 disables it), for
+ * at most "idempotency_ttl" seconds each. It is split into shards by key
+ * hash, each with its own lock and a linear-probing table allocated up front,
+ * so lookups and inserts never allocate and rarely contend. A full shard
+ * makes room with CLOCK: expired keys and keys not looked up since the hand
+ * last passed go first, the others lose their reference bit. Deletion shifts
+ * the following entries back instead of leaving tombstones, so probe
+ * sequences stay short however much the table churns.
+ *
+ * The io threads execute writes concurrently, so a key is claimed before
+ * its write runs: the first request with it inserts a pending result, and
+ * others with the same key find that until the real one replaces it. A
+ * pending claim is never evicted nor expires, since a retry would then claim
+ * the key again and execute the write a second time; a shard holding nothing
+ * but pending claims turns new ones away as busy instead. Requests that find
+ * a claim pending wait on the shard for insert() or release() to wake them.
+ */
+struct IdempotencyCache {
+	using Clock = std::chrono::steady_clock;
+	using Key = ledger::IdempotencyKey;
+
+	static constexpr size_t shardBits = 6;
+	static constexpr size_t shardCount = size_t{1} << shardBits;
+
+	struct Result {
+		uint32_t fingerprint = 0;	// of the request, to tell a retry from a reused key
+		ledger::Status status = ledger::Status::ok;
+		uint64_t value = 0;	// the account or transaction id of the reply
+		uint64_t lsn = 0;	// the log record a retry must wait for, or 0
+		bool pending = false;	// claimed, and still executing
+	};
+
+	IdempotencyCache() = delete;
+	IdempotencyCache(const IdempotencyCache&) = delete;
+	IdempotencyCache& operator=(const IdempotencyCache&) = delete;
+
+	explicit IdempotencyCache(const nlohmann::json& config)
+		: mTtl(config.value("idempotency_ttl", uint32_t{86400}))
+		, mEpoch(Clock::now())
+	{
+		auto capacity = config.value("idempotency_cache_size", size_t{0});
+
+		if (!capacity) {
+			return;
+		}
+
+		// Keep every shard at most three quarters full.
+		auto limit = (capacity + shardCount - 1) / shardCount;
+		auto slots = std::bit_ceil(std::max<size_t>(limit + limit / 3 + 1, 8));
+
+		auto seeds = std::random_device{};
+		mSeed = (static_cast<uint64_t>(seeds()) << 32) | seeds();
+
+		for (auto& shard: mShards) {
+			shard.slots.resize(slots);
+			shard.mask = slots - 1;
+			shard.limit = limit;
+		}
+	}
+
+	bool enabled() const { return mShards.front().limit != 0; }
+
+	// Returns the result the key has, pending or not. A key without one is
+	// claimed with a pending result carrying `fingerprint`, which the
+	// caller must replace with insert() or drop with release(), or gets a
+	// Status::busy result if its shard has no room for another claim.
+	std::optional<Result> claim(const Key& key, uint32_t fingerprint) {
+		if (!enabled() || key.empty()) {
+			return std::nullopt;
+		}
+
+		auto hash = hashOf(key);
+		auto& shard = shardOf(hash);
+		auto now = seconds();
+		auto lock = std::lock_guard{shard.mutex};
+
+		auto index = lookup(shard, key, hash);
+
+		if (index != notFound && expired(shard.slots[index], now)) {
+			erase(shard, index);
+			index = notFound;
+		}
+
+		if (index != notFound) {
+			auto& slot = shard.slots[index];
+			slot.referenced = true;
+			return slot.result;
+		}
+
+		if (!store(shard, key, hash, Result{.fingerprint = fingerprint, .pending = true}, now)) {
+			return Result{.fingerprint = fingerprint, .status = ledger::Status::busy};
+		}
+
+		return std::nullopt;
+	}
+
+	void insert(const Key& key, const Result& result) {
+		if (!enabled() || key.empty()) {
+			return;
+		}
+
+		auto hash = hashOf(key);
+		auto& shard = shardOf(hash);
+		auto lock = std::lock_guard{shard.mutex};
+
+		store(shard, key, hash, result, seconds());
+		wake(shard, key);
+	}
+
+	void release(const Key& key) {
+		if (!enabled() || key.empty()) {
+			return;
+		}
+
+		auto hash = hashOf(key);
+		auto& shard = shardOf(hash);
+		auto lock = std::lock_guard{shard.mutex};
+
+		if (auto index = lookup(shard, key, hash); index != notFound) {
+			erase(shard, index);
+		}
+
+		wake(shard, key);
+	}
+
+	// Completes on the caller's executor once the key's claim is no longer
+	// pending, at once if it is not anymore; the caller claims it again then.
+	template <typename CompletionToken>
+	auto asyncWaitPending(const Key& key, CompletionToken&& token) {
+		return asio::async_initiate<CompletionToken, void()>([this, key](auto handler) {
+			auto executor = asio::prefer(asio::get_associated_executor(handler),
+				asio::execution::outstanding_work.tracked);
+
+			auto hash = hashOf(key);
+			auto& shard = shardOf(hash);
+			auto lock = std::unique_lock{shard.mutex};
+
+			if (auto index = lookup(shard, key, hash); index != notFound && shard.slots[index].result.pending) {
+				shard.waiters.push_back(Waiter{key, std::move(executor), WaitHandler{std::move(handler)}});
+				return;
+			}
+
+			lock.unlock();
+			asio::post(executor, std::move(handler));
+		}, token);
+	}
+
+private:
+	static constexpr size_t notFound = ~size_t{0};
+
+	struct Slot {
+		Key key;	// empty when the slot is free
+		Result result;
+		uint32_t expires = 0;	// in seconds since the cache was created
+		bool referenced = false;
+	};
+
+	using WaitHandler = asio::any_completion_handler<void()>;
+
+	struct Waiter {
+		Waiter(const Key& key, asio::any_io_executor executor, WaitHandler handler)
+			: key(key)
+			, executor(std::move(executor))
+			, handler(std::move(handler))
+		{}
+
+		Waiter(Waiter&&) noexcept = default;
+
+		// The move assignment of asio 1.24's any_completion_handler copies
+		// through its converting constructor and recurses; reset and swap.
+		Waiter& operator=(Waiter&& other) noexcept {
+			key = other.key;
+			executor = std::move(other.executor);
+			handler = nullptr;
+			handler.swap(other.handler);
+			return *this;
+		}
+
+		Key key;
+		asio::any_io_executor executor;	// keeps the waiter's io_context running
+		WaitHandler handler;
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::vector<Slot> slots;
+		size_t mask = 0;
+		size_t size = 0;
+		size_t limit = 0;
+		size_t hand = 0;
+		std::vector<Waiter> waiters;	// for pending claims; keeps its capacity
+	};
+
+	// Keys come from clients, so they are mixed with a per-process seed
+	// before indexing. The top bits pick the shard, the bottom ones the slot.
+	uint64_t hashOf(const Key& key) const {
+		return mix(mix(key.high ^ mSeed) ^ key.low);
+	}
+
+	static uint64_t mix(uint64_t value) {
+		value ^= value >> 33;
+		value *= 0xff51afd7ed558ccdull;
+		value ^= value >> 33;
+		value *= 0xc4ceb9fe1a85ec53ull;
+		value ^= value >> 33;
+		return value;
+	}
+
+	Shard& shardOf(uint64_t hash) { return mShards[hash >> (64 - shardBits)]; }
+
+	uint32_t seconds() const {
+		return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - mEpoch).count());
+	}
+
+	// The table is never full, so every probe reaches a free slot.
+	static size_t lookup(const Shard& shard, const Key& key, uint64_t hash) {
+		for (auto index = hash & shard.mask;; index = (index + 1) & shard.mask) {
+			auto& slot = shard.slots[index];
+
+			if (slot.key.empty()) {
+				return notFound;
+			}
+
+			if (slot.key == key) {
+				return index;
+			}
+		}
+	}
+
+	static bool expired(const Slot& slot, uint32_t now) {
+		return !slot.result.pending && slot.expires <= now;
+	}
+
+	// Returns false if the shard is full of pending claims.
+	bool store(Shard& shard, const Key& key, uint64_t hash, const Result& result, uint32_t now) {
+		auto index = lookup(shard, key, hash);
+
+		if (index == notFound) {
+			if (shard.size == shard.limit && !evict(shard, now)) {
+				return false;
+			}
+
+			for (index = hash & shard.mask; !shard.slots[index].key.empty(); index = (index + 1) & shard.mask) {}
+			++shard.size;
+		}
+
+		shard.slots[index] = Slot{key, result, now + mTtl, true};
+		return true;
+	}
+
+	// Moves back every following entry that the freed slot would otherwise
+	// cut off from its home slot.
+	void erase(Shard& shard, size_t index) {
+		for (auto next = (index + 1) & shard.mask; !shard.slots[next].key.empty(); next = (next + 1) & shard.mask) {
+			auto home = hashOf(shard.slots[next].key) & shard.mask;
+
+			// Whether home lies cyclically in (index, next]: then the entry
+			// is still reachable and stays.
+			auto reachable = index <= next ? (index < home && home <= next) : (index < home || home <= next);
+
+			if (!reachable) {
+				shard.slots[index] = shard.slots[next];
+				index = next;
+			}
+		}
+
+		shard.slots[index] = Slot{};
+		--shard.size;
+	}
+
+	// Hands the waiters for the key to their executors. Posting under the
+	// lock is fine: nothing the executors run takes it first.
+	static void wake(Shard& shard, const Key& key) {
+		for (size_t i = 0; i < shard.waiters.size();) {
+			auto& waiter = shard.waiters[i];
+
+			if (waiter.key != key) {
+				++i;
+				continue;
+			}
+
+			asio::post(waiter.executor, [handler = std::move(waiter.handler)]() mutable {
+				std::move(handler)();
+			});
+
+			if (&waiter != &shard.waiters.back()) {
+				waiter = std::move(shard.waiters.back());
+			}
+
+			shard.waiters.pop_back();
+		}
+	}
+
+	// Pending claims are passed over. The first round clears the reference
+	// bits it passes, so going round twice without finding anything means
+	// every entry is pending.
+	bool evict(Shard& shard, uint32_t now) {
+		for (size_t steps = 0; steps < 2 * shard.slots.size(); ++steps) {
+			auto& slot = shard.slots[shard.hand];
+
+			if (!slot.key.empty() && !slot.result.pending) {
+				// Erasing may shift another entry under the hand, so it stays.
+				if (!slot.referenced || expired(slot, now)) {
+					erase(shard, shard.hand);
+					return true;
+				}
+
+				slot.referenced = false;
+			}
+
+			shard.hand = (shard.hand + 1) & shard.mask;
+		}
+
+		return false;
+	}
+
+	uint32_t mTtl;
+	Clock::time_point mEpoch;
+	uint64_t mSeed = 0;
+	std::array<Shard, shardCount> mShards;
+};
+
+} //namespace bookkeeper
@@ -0,0 +1,88 @@
+
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+
+#include "allocations.hpp"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * A set of single-threaded io_contexts, one per worker thread. Everything
+ * spawned on a context stays on its thread, so sessions never migrate and
+ * need no strands or locks.
+ */
+struct IoPool {
+	IoPool() = delete;
+	IoPool(const IoPool&) = delete;
+	IoPool& operator=(const IoPool&) = delete;
+
+	explicit IoPool(size_t threads) {
+		if (!threads) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		for (size_t i = 0; i < threads; ++i) {
+			mContexts.push_back(std::make_unique<asio::io_context>(1));
+		}
+	}
+
+	~IoPool() {
+		stop();
+		join();
+	}
+
+	size_t size() const { return mContexts.size(); }
+	asio::io_context& context(size_t index) { return *mContexts[index]; }
+
+	// Runs context 0 on the calling thread and the rest on worker threads.
+	// Returns once every context has run out of work or has been stopped.
+	void run() {
+		spdlog::info("[IoPool]: Running {} io threads", mContexts.size());
+
+		for (size_t i = 1; i < mContexts.size(); ++i) {
+			mThreads.emplace_back([this, i] { runContext(i); });
+		}
+
+		runContext(0);
+		join();
+	}
+
+	void stop() {
+		for (auto& context: mContexts) {
+			context->stop();
+		}
+	}
+
+private:
+	void runContext(size_t index) {
+		allocations::countThread();
+
+		try {
+			mContexts[index]->run();
+		} catch (const std::exception& error) {
+			spdlog::error("[IoPool]: io thread #{} failed: {}", index, error.what());
+			stop();
+		}
+	}
+
+	void join() {
+		for (auto& thread: mThreads) {
+			if (thread.joinable()) {
+				thread.join();
+			}
+		}
+
+		mThreads.clear();
+	}
+
+	std::vector<std::unique_ptr<asio::io_context>> mContexts;
+	std::vector<std::thread> mThreads;
+};
+
+} //namespace bookkeeper
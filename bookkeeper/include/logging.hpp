@@ -0,0 +1,58 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+#include "spdlog/async.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "nlohmann/json.hpp"
+
+#include <atomic>
+
+/*
+ * Logging on the io threads goes through an async logger: formatting stays
+ * on the calling thread, but the sink I/O happens on a dedicated logger
+ * thread and a full queue drops the oldest entries instead of blocking.
+ *
+ * Per-request statements use the SPDLOG_* macros so that everything below
+ * SPDLOG_ACTIVE_LEVEL (set from BOOKKEEPER_LOG_LEVEL at build time) compiles
+ * away, and per-message ones are additionally sampled.
+ */
+namespace bookkeeper::logging {
+
+inline std::atomic<uint32_t> sSampleRate = 0;
+
+inline void init(const nlohmann::json& config) {
+	try {
+		auto queueSize = config.value("log_queue_size", 8192u);
+		auto level = config.value("log_level", "info");
+
+		sSampleRate = config.value("log_sample_rate", 0u);
+
+		spdlog::init_thread_pool(queueSize, 1);
+
+		auto sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+		auto logger = std::make_shared<spdlog::async_logger>("bookkeeper", sink, spdlog::thread_pool(),
+			spdlog::async_overflow_policy::overrun_oldest);
+
+		spdlog::set_default_logger(logger);
+		spdlog::set_level(spdlog::level::from_str(level));
+		spdlog::flush_on(spdlog::level::err);
+	} catch (const std::exception& error) {
+		throw std::runtime_error(std::string("[Logging]: ") + error.what());
+	}
+}
+
+// True for one in every `log_sample_rate` calls on the calling thread, and
+// never when sampling is disabled.
+inline bool sampled() {
+	thread_local uint32_t counter = 0;
+	auto rate = sSampleRate.load(std::memory_order_relaxed);
+	return rate && ++counter % rate == 0;
+}
+
+} //namespace bookkeeper::logging
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define BOOKKEEPER_SAMPLED_DEBUG(...) do { if (::bookkeeper::logging::sampled()) { SPDLOG_DEBUG(__VA_ARGS__); } } while (0)
+#else
+#define BOOKKEEPER_SAMPLED_DEBUG(...) (void)0
+#endif
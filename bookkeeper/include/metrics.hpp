@@ -0,0 +1,277 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include "ledger/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * A counter written by a single thread and read by the scraper. Updates are
+ * a relaxed load and store rather than a read-modify-write, so they cost
+ * the same as a plain increment and never contend: the owning thread is the
+ * only writer of its cache line, which only moves when it is scraped.
+ */
+struct Counter {
+	void add(uint64_t count = 1) {
+		mValue.store(mValue.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+	}
+
+	uint64_t value() const { return mValue.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> mValue = 0;
+};
+
+/*
+ * A single-writer latency histogram with fixed buckets from 50 us to 10 s,
+ * exported in seconds. Observing is a short scan of the bucket bounds and
+ * two counter updates.
+ */
+struct Histogram {
+	static constexpr std::array<uint64_t, 17> bounds = {	// in ns
+		50'000, 100'000, 250'000, 500'000,
+		1'000'000, 2'500'000, 5'000'000, 10'000'000, 25'000'000, 50'000'000, 100'000'000, 250'000'000, 500'000'000,
+		1'000'000'000, 2'500'000'000, 5'000'000'000, 10'000'000'000};
+
+	// Buckets are not cumulative here; the last one is everything above the
+	// largest bound.
+	struct Snapshot {
+		std::array<uint64_t, bounds.size() + 1> buckets{};
+		uint64_t sum = 0;
+
+		void merge(const Histogram& histogram) {
+			for (size_t i = 0; i < buckets.size(); ++i) {
+				buckets[i] += histogram.mBuckets[i].value();
+			}
+			sum += histogram.mSum.value();
+		}
+	};
+
+	void observe(std::chrono::nanoseconds duration) {
+		auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+		auto bucket = std::lower_bound(bounds.begin(), bounds.end(), nanoseconds) - bounds.begin();
+
+		mBuckets[bucket].add();
+		mSum.add(nanoseconds);
+	}
+
+private:
+	std::array<Counter, bounds.size() + 1> mBuckets;
+	Counter mSum;
+};
+
+/*
+ * Everything one io thread counts. Only that thread writes to it; each
+ * instance has its own cache lines.
+ */
+struct alignas(64) ThreadMetrics {
+	enum Transport : size_t { tcp, tls, transportCount };
+	enum Timeout : size_t { handshake, idle, header, frame, write, timeoutCount };
+
+	static constexpr std::array<std::string_view, transportCount> transportNames = {"tcp", "tls"};
+	static constexpr std::array<std::string_view, timeoutCount> timeoutNames = {"handshake", "idle", "header", "frame",
+		"write"};
+
+	// Request types get a histogram each; anything else is "other".
+	static constexpr std::array<std::string_view, 7> requestTypeNames = {
+		"echo", "open_account", "post_transaction", "get_balance", "get_history", "get_report", "other"};
+
+	static size_t requestTypeIndex(uint16_t type) {
+		return std::min<size_t>(type, requestTypeNames.size() - 1);
+	}
+
+	std::array<Counter, transportCount> accepted;
+	std::array<Counter, transportCount> closed;
+	Counter acceptPauses;
+
+	Counter handshakes;
+	Counter handshakesResumed;
+	Counter handshakeFailures;
+	Histogram handshakeDuration;
+
+	Counter framesReceived;
+	Counter framesSent;
+	Counter bytesReceived;
+	Counter bytesSent;
+	Counter readThrottles;
+	std::array<Counter, timeoutCount> timeouts;
+
+	std::array<Histogram, requestTypeNames.size()> requestDuration;
+};
+
+static_assert(static_cast<size_t>(ledger::MessageType::getReport) + 1 == ThreadMetrics::requestTypeNames.size() - 1,
+	"every request type needs a name");
+
+/*
+ * The metrics of every io thread, plus process-wide gauges sampled when
+ * scraped. Thread metrics are summed on scrape, so recording them never
+ * involves another thread.
+ */
+struct Metrics {
+	Metrics() = delete;
+	Metrics(const Metrics&) = delete;
+	Metrics& operator=(const Metrics&) = delete;
+
+	explicit Metrics(size_t threads) {
+		for (size_t i = 0; i < threads; ++i) {
+			mThreads.push_back(std::make_unique<ThreadMetrics>());
+		}
+	}
+
+	ThreadMetrics& thread(size_t index) { return *mThreads[index]; }
+
+	// Must be called before the io threads start.
+	void addGauge(std::string name, std::string help, std::function<double()> sample) {
+		mGauges.push_back(Gauge{std::move(name), std::move(help), std::move(sample)});
+	}
+
+	template <typename Select>
+	uint64_t sum(Select select) const {
+		uint64_t total = 0;
+		for (auto& thread: mThreads) {
+			total += select(*thread).value();
+		}
+		return total;
+	}
+
+	template <typename Select>
+	Histogram::Snapshot merge(Select select) const {
+		Histogram::Snapshot snapshot;
+		for (auto& thread: mThreads) {
+			snapshot.merge(select(*thread));
+		}
+		return snapshot;
+	}
+
+	// The Prometheus text exposition format, version 0.0.4.
+	std::string render() const {
+		std::string out;
+		out.reserve(16 * 1024);
+
+		header(out, "bookkeeper_connections_accepted_total", "Connections accepted.", "counter");
+		for (size_t t = 0; t < ThreadMetrics::transportCount; ++t) {
+			sample(out, "bookkeeper_connections_accepted_total", label("transport", ThreadMetrics::transportNames[t]),
+				sum([t](auto& thread) -> auto& { return thread.accepted[t]; }));
+		}
+
+		header(out, "bookkeeper_connections_active", "Connections accepted and not yet closed.", "gauge");
+		for (size_t t = 0; t < ThreadMetrics::transportCount; ++t) {
+			auto accepted = sum([t](auto& thread) -> auto& { return thread.accepted[t]; });
+			auto closed = sum([t](auto& thread) -> auto& { return thread.closed[t]; });
+			sample(out, "bookkeeper_connections_active", label("transport", ThreadMetrics::transportNames[t]),
+				accepted - std::min(accepted, closed));
+		}
+
+		counter(out, "bookkeeper_accept_pauses_total", "Times an acceptor paused at the admission limits.",
+			sum([](auto& thread) -> auto& { return thread.acceptPauses; }));
+
+		counter(out, "bookkeeper_tls_handshakes_total", "Completed TLS handshakes.",
+			sum([](auto& thread) -> auto& { return thread.handshakes; }));
+		counter(out, "bookkeeper_tls_handshakes_resumed_total", "TLS handshakes resumed from a session or ticket.",
+			sum([](auto& thread) -> auto& { return thread.handshakesResumed; }));
+		counter(out, "bookkeeper_tls_handshake_failures_total", "Failed TLS handshakes.",
+			sum([](auto& thread) -> auto& { return thread.handshakeFailures; }));
+
+		header(out, "bookkeeper_tls_handshake_duration_seconds", "TLS handshake latency.", "histogram");
+		histogram(out, "bookkeeper_tls_handshake_duration_seconds", "",
+			merge([](auto& thread) -> auto& { return thread.handshakeDuration; }));
+
+		counter(out, "bookkeeper_frames_received_total", "Request frames received.",
+			sum([](auto& thread) -> auto& { return thread.framesReceived; }));
+		counter(out, "bookkeeper_frames_sent_total", "Reply frames sent.",
+			sum([](auto& thread) -> auto& { return thread.framesSent; }));
+		counter(out, "bookkeeper_bytes_received_total", "Frame bytes received, headers included.",
+			sum([](auto& thread) -> auto& { return thread.bytesReceived; }));
+		counter(out, "bookkeeper_bytes_sent_total", "Frame bytes sent, headers included.",
+			sum([](auto& thread) -> auto& { return thread.bytesSent; }));
+		counter(out, "bookkeeper_read_throttles_total", "Times a session stopped reading on a full outbound queue.",
+			sum([](auto& thread) -> auto& { return thread.readThrottles; }));
+
+		header(out, "bookkeeper_session_timeouts_total", "Connections closed by a deadline.", "counter");
+		for (size_t k = 0; k < ThreadMetrics::timeoutCount; ++k) {
+			sample(out, "bookkeeper_session_timeouts_total", label("timeout", ThreadMetrics::timeoutNames[k]),
+				sum([k](auto& thread) -> auto& { return thread.timeouts[k]; }));
+		}
+
+		header(out, "bookkeeper_request_duration_seconds", "Time from reading a request to writing its reply.", "histogram");
+		for (size_t r = 0; r < ThreadMetrics::requestTypeNames.size(); ++r) {
+			histogram(out, "bookkeeper_request_duration_seconds", label("type", ThreadMetrics::requestTypeNames[r]),
+				merge([r](auto& thread) -> auto& { return thread.requestDuration[r]; }));
+		}
+
+		for (auto& gauge: mGauges) {
+			header(out, gauge.name, gauge.help, "gauge");
+			fmt::format_to(std::back_inserter(out), "{} {}\n", gauge.name, gauge.sample());
+		}
+
+		return out;
+	}
+
+private:
+	struct Gauge {
+		std::string name;
+		std::string help;
+		std::function<double()> sample;
+	};
+
+	static std::string label(std::string_view name, std::string_view value) {
+		return fmt::format("{}=\"{}\"", name, value);
+	}
+
+	static void header(std::string& out, std::string_view name, std::string_view help, std::string_view type) {
+		fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+	}
+
+	static void sample(std::string& out, std::string_view name, std::string_view labels, uint64_t value) {
+		if (labels.empty()) {
+			fmt::format_to(std::back_inserter(out), "{} {}\n", name, value);
+		} else {
+			fmt::format_to(std::back_inserter(out), "{}{{{}}} {}\n", name, labels, value);
+		}
+	}
+
+	static void counter(std::string& out, std::string_view name, std::string_view help, uint64_t value) {
+		header(out, name, help, "counter");
+		sample(out, name, {}, value);
+	}
+
+	static void histogram(std::string& out, std::string_view name, std::string_view labels,
+		const Histogram::Snapshot& snapshot) {
+		auto separator = labels.empty() ? "" : ",";
+		uint64_t cumulative = 0;
+
+		for (size_t i = 0; i < Histogram::bounds.size(); ++i) {
+			cumulative += snapshot.buckets[i];
+			fmt::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, separator,
+				Histogram::bounds[i] / 1e9, cumulative);
+		}
+
+		cumulative += snapshot.buckets.back();
+		fmt::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, separator, cumulative);
+
+		if (labels.empty()) {
+			fmt::format_to(std::back_inserter(out), "{}_sum {}\n{}_count {}\n", name, snapshot.sum / 1e9, name, cumulative);
+		} else {
+			fmt::format_to(std::back_inserter(out), "{}_sum{{{}}} {}\n{}_count{{{}}} {}\n",
+				name, labels, snapshot.sum / 1e9, name, labels, cumulative);
+		}
+	}
+
+	std::vector<std::unique_ptr<ThreadMetrics>> mThreads;
+	std::vector<Gauge> mGauges;
+};
+
+} //namespace bookkeeper
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+#include "nlohmann/json.hpp"
+
+#include "metrics.hpp"
+
+#include "network/stream.hpp"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace bookkeeper {
+
+/*
+ * Serves the metrics over plain HTTP on "metrics_port", apart from the
+ * client ports, for Prometheus to scrape. It answers one request per
+ * connection and closes it: a scrape renders the metrics once, and nothing
+ * about it touches the io threads' hot paths beyond reading their counters.
+ * A metrics_port of 0 disables it.
+ */
+struct MetricsServer {
+	MetricsServer() = delete;
+	MetricsServer(const MetricsServer&) = delete;
+	MetricsServer& operator=(const MetricsServer&) = delete;
+
+	explicit MetricsServer(asio::io_context& ctx, const nlohmann::json& config, const Metrics& metrics)
+		: mAcceptor(ctx)
+		, mMetrics(metrics)
+		, mPort(config.value("metrics_port", 0))
+	{}
+
+	asio::awaitable<void> start() {
+		if (!mPort) {
+			co_return;
+		}
+
+		auto endpoint = asio::ip::tcp::endpoint(asio::ip::tcp::v4(), mPort);
+		mAcceptor.open(endpoint.protocol());
+		mAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+		mAcceptor.bind(endpoint);
+		mAcceptor.listen();
+
+		spdlog::info("[MetricsServer]: Serving metrics on {}", network::to_string(mAcceptor.local_endpoint()));
+
+		try {
+			while (true) {
+				auto socket = co_await mAcceptor.async_accept(asio::use_awaitable);
+				asio::co_spawn(mAcceptor.get_executor(), serve(std::move(socket)), asio::detached);
+			}
+		} catch (const std::exception& error) {
+			spdlog::error("[MetricsServer]: Stopped accepting on port {}: {}", mPort, error.what());
+		}
+	}
+
+private:
+	static constexpr size_t maxRequestSize = 8 * 1024;
+	static constexpr auto requestTimeout = std::chrono::seconds{5};
+
+	asio::awaitable<void> serve(asio::ip::tcp::socket connection) {
+		// A scraper that stalls is cut off rather than holding a connection.
+		// The deadline handler may already be queued when the scrape ends,
+		// so it shares the socket.
+		auto socket = std::make_shared<asio::ip::tcp::socket>(std::move(connection));
+		auto deadline = asio::steady_timer{socket->get_executor(), requestTimeout};
+		deadline.async_wait([socket](std::error_code error) {
+			if (!error) {
+				socket->close();
+			}
+		});
+
+		try {
+			std::string request;
+			co_await asio::async_read_until(*socket, asio::dynamic_buffer(request, maxRequestSize), "\r\n\r\n",
+				asio::use_awaitable);
+
+			auto line = std::string_view{request}.substr(0, request.find("\r\n"));
+			std::string response;
+
+			if (!line.starts_with("GET ")) {
+				response = reply("405 Method Not Allowed", "text/plain", "Method not allowed\n");
+			} else if (line.starts_with("GET /metrics ") || line.starts_with("GET /metrics?")) {
+				response = reply("200 OK", "text/plain; version=0.0.4; charset=utf-8", mMetrics.render());
+			} else {
+				response = reply("404 Not Found", "text/plain", "Not found\n");
+			}
+
+			co_await asio::async_write(*socket, asio::buffer(response), asio::use_awaitable);
+
+			std::error_code ignored;
+			socket->shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+		} catch (const std::exception& error) {
+			SPDLOG_DEBUG("[MetricsServer]: Scrape failed: {}", error.what());
+		}
+
+		deadline.cancel();
+	}
+
+	static std::string reply(std::string_view status, std::string_view contentType, std::string_view body) {
+		return fmt::format("HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+			status, contentType, body.size(), body);
+	}
+
+	asio::ip::tcp::acceptor mAcceptor;
+	const Metrics& mMetrics;
+	uint16_t mPort;
+};
+
+} //namespace bookkeeper
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ledger/protocol.hpp"
+
+#include <compare>
+#include <cstdint>
+
+namespace bookkeeper {
+
+// Postings are indexed by account, then time, ties broken by the log record
+// of their transaction. Compares field by field.
+struct PostingKey {
+	ledger::AccountId account = 0;
+	uint32_t reserved = 0;
+	uint64_t time = 0;	// microseconds since the Unix epoch, 0 if not logged
+	uint64_t sequence = 0;	// lsn of the transaction's log record
+
+	auto operator<=>(const PostingKey&) const = default;
+};
+
+// One leg of a logged transaction.
+struct Posting {
+	PostingKey key;
+	uint64_t transaction = 0;	// 0 if not logged
+	ledger::Amount amount = 0;
+};
+
+static_assert(sizeof(PostingKey) == 24 && sizeof(Posting) == 40, "postings are stored as they are in memory");
+
+} //namespace bookkeeper
@@ -0,0 +1,1462 @@
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+#include "spdlog/fmt/chrono.h"
+#include "nlohmann/json.hpp"
+
+#include "ledger/protocol.hpp"
+
+#include "archive.hpp"
+#include "crc32c.hpp"
+#include "files.hpp"
+#include "posting.hpp"
+#include "shard.hpp"
+#include "wal.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * An on-disk index of every posting by PostingKey, so that history queries
+ * look up an account's postings instead of scanning the log. It is a
+ * log-structured merge tree fed by the log itself, off the io threads:
+ *
+ * - An indexer thread tails the durable log with a WalReader and adds the
+ *   postings of every transaction record to a sorted memtable, and the
+ *   currency of every account opened to a table by account id.
+ * - A memtable holding "index_memtable_postings" is written out as a run:
+ *   an immutable file of postings in key order, in blocks of blockPostings,
+ *   with the first key of every block (its fence) and a checksum per block
+ *   at the end.
+ * - Runs are tiered by size: once a level has "index_fanout" of them, a
+ *   compaction thread merges them into one run a level up. A lookup thus
+ *   visits O(log n) runs, with a binary search over fences held in memory
+ *   and a block read each.
+ * - A manifest, replaced atomically, lists the live runs and the lsn they
+ *   cover. Recovery indexes the log after that lsn again, and the log keeps
+ *   the segments the index does not cover yet.
+ * - Accounting periods ("archive_period": "month", "day" or "hour", in UTC)
+ *   are closed by the compaction thread "archive_close_delay" seconds after
+ *   they end, once the runs hold everything logged before that. Closing
+ *   merges all runs, moving the postings before the end into a
+ *   PeriodArchive in "archive_dir", with their accounts' currencies, and
+ *   keeping the rest in a run. Reports are answered from the archives only.
+ *
+ * A Scan sees the runs, archives and memtables of the moment it was
+ * started, and reads blocks on the index's query threads
+ * ("index_query_threads"), as do reports, so a session coroutine awaiting
+ * either never blocks its io thread. A query that must see the log up to
+ * some record waits for the indexer to apply it first, which takes a batch
+ * at most since the indexer is woken for it. The indexer also keeps the
+ * earliest posting time of every stretch of the log it applied, so that a
+ * query for the postings logged since some record can skip those made
+ * before the earliest of them. Files of runs merged away are unlinked
+ * at once; scans still holding them read on through their descriptors.
+ *
+ *   run       | postings: Posting[count] | fences: PostingKey[blocks] | crc32c: u32[blocks] |
+ *             | last: PostingKey | magic: u64 | version: u32 | crc32c: u32 | level: u32 | reserved: u32 |
+ *             | count: u64 | blocks: u64 |
+ *   manifest  | magic: u64 | version: u32 | crc32c: u32 | lsn: u64 | time: u64 | closed: u64 |
+ *             | runs: u64 | archives: u64 | ids: u64[runs] | periods: u64[archives] |
+ *
+ * Integers are in host (little-endian) order. The checksum in a run's footer
+ * covers the fences, the block checksums and the footer but itself; the
+ * manifest's covers everything after it.
+ */
+struct PostingIndex {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr size_t blockPostings = 512;	// 20 KiB blocks
+
+	enum class Period {
+		hour,
+		day,
+		month,
+	};
+
+	struct Scan;
+
+	PostingIndex() = delete;
+	PostingIndex(const PostingIndex&) = delete;
+	PostingIndex& operator=(const PostingIndex&) = delete;
+
+	// Opens the index in "index_dir". Must be constructed after the log has
+	// been recovered, and before the snapshotter may remove segments.
+	// Periods are only closed with an "archive_dir".
+	explicit PostingIndex(const nlohmann::json& config, Wal& wal, Shards& shards)
+		: mDirectory(config.value("index_dir", ""))
+		, mArchiveDirectory(config.value("archive_dir", ""))
+		, mMemtableLimit(std::max<size_t>(config.value("index_memtable_postings", size_t{262144}), blockPostings))
+		, mFanout(std::max<size_t>(config.value("index_fanout", size_t{8}), 2))
+		, mPeriod(periodOf(config.value("archive_period", "month")))
+		, mCloseDelay(config.value("archive_close_delay", uint64_t{86400}) * 1'000'000)
+		, mQueries(std::max(config.value("index_query_threads", 2u), 1u))
+		, mWal(wal)
+		, mCurrencies(shards.currencies())
+	{
+		if (mDirectory.empty()) {
+			throw std::runtime_error("[PostingIndex]: No \"index_dir\" specified in config");
+		}
+
+		std::filesystem::create_directories(mDirectory);
+
+		if (!mArchiveDirectory.empty()) {
+			std::filesystem::create_directories(mArchiveDirectory);
+		}
+
+		open();
+	}
+
+	~PostingIndex() {
+		stop();
+		mQueries.join();
+	}
+
+	void start() {
+		mIndexer = std::thread{[this] { index(); }};
+		mCompactor = std::thread{[this] { compact(); }};
+	}
+
+	// Indexes the rest of the durable log, writes the memtable out and stops
+	// the threads. Scans still work afterwards, and waits complete at once.
+	void stop() {
+		{
+			auto lock = std::lock_guard{mWakeMutex};
+			mStopping = true;
+		}
+
+		mWake.notify_all();
+
+		if (mIndexer.joinable()) {
+			mIndexer.join();
+		}
+
+		if (mCompactor.joinable()) {
+			mCompactor.join();
+		}
+
+		auto lock = std::lock_guard{mWakeMutex};
+		complete(std::numeric_limits<uint64_t>::max());
+	}
+
+	// Completes on the caller's executor once the memtable holds the log
+	// through `lsn`, which must be durable, so that scans started then see
+	// it. A waiting caller wakes the indexer instead of letting it sleep out
+	// its poll interval.
+	template <typename CompletionToken>
+	auto asyncWaitIndexed(uint64_t lsn, CompletionToken&& token) {
+		return asio::async_initiate<CompletionToken, void()>([this, lsn](auto handler) {
+			auto lock = std::unique_lock{mWakeMutex};
+
+			auto executor = asio::prefer(asio::get_associated_executor(handler),
+				asio::execution::outstanding_work.tracked);
+
+			if (lsn > mIndexed && !mStopping) {
+				mWaiters.push_back(Waiter{lsn, std::move(executor), WaitHandler{std::move(handler)}});
+				mWanted = true;
+				lock.unlock();
+				mWake.notify_all();
+				return;
+			}
+
+			lock.unlock();
+			asio::post(executor, std::move(handler));
+		}, token);
+	}
+
+	// The last log record the runs cover.
+	uint64_t lsn() const { return current()->lsn; }
+
+	// The last log record the memtable holds; scans started from now on see
+	// it.
+	uint64_t indexedLsn() const {
+		auto lock = std::lock_guard{mWakeMutex};
+		return mIndexed;
+	}
+
+	// A time no posting logged after `after`, and indexed, was made before;
+	// 0 if the indexer has not seen that part of the log since it started.
+	uint64_t timeFloor(uint64_t after) const {
+		auto lock = std::lock_guard{mWakeMutex};
+
+		if (after < mStretchesAfter) {
+			return 0;
+		}
+
+		auto stretch = std::upper_bound(mStretches.begin(), mStretches.end(), after,
+			[](uint64_t lsn, const Stretch& stretch) { return lsn < stretch.last; });
+		auto time = std::numeric_limits<uint64_t>::max();
+
+		for (; stretch != mStretches.end(); ++stretch) {
+			time = std::min(time, stretch->time);
+		}
+
+		return time;
+	}
+
+	// The end of the last closed period, in microseconds since the Unix
+	// epoch; 0 if none is.
+	uint64_t closed() const { return current()->closed; }
+
+	// The postings of `account` after `after`, in key order, of those logged
+	// by the records in (from, through].
+	Scan scan(ledger::AccountId account, const PostingKey& after, uint64_t from = 0,
+		uint64_t through = std::numeric_limits<uint64_t>::max());
+
+	// Adds up the archived postings made in [from, to) per currency, of
+	// `account` or of all accounts, on a query thread. False if a total
+	// overflows.
+	asio::awaitable<bool> report(std::optional<ledger::AccountId> account, uint64_t from, uint64_t to,
+		std::vector<ledger::ReportRow>& totals)
+	{
+		co_return co_await asio::co_spawn(mQueries, aggregate(current(), account, from, to, totals), asio::use_awaitable);
+	}
+
+	// The start of the period holding `time`, both in microseconds since
+	// the Unix epoch.
+	static uint64_t periodStart(uint64_t time, Period period) {
+		using namespace std::chrono;
+		auto point = sys_time<microseconds>{microseconds{time}};
+		sys_time<microseconds> start;
+
+		switch (period) {
+			case Period::hour:
+				start = floor<hours>(point);
+				break;
+			case Period::day:
+				start = floor<days>(point);
+				break;
+			case Period::month: {
+				auto date = year_month_day{floor<days>(point)};
+				start = sys_days{date.year() / date.month() / 1};
+				break;
+			}
+		}
+
+		return static_cast<uint64_t>(start.time_since_epoch().count());
+	}
+
+	// Calls `visit(account, currency)` if `record` logged the opening of an
+	// account.
+	template <typename Visit>
+	static void forOpenedAccount(const WalReader::Record& record, Visit&& visit) {
+		auto logged = Shards::parse(record.type, record.payload);
+		auto request = ledger::OpenAccount{};
+
+		if (logged && logged->type == ledger::MessageType::openAccount && request.decode(logged->payload)) {
+			visit(static_cast<ledger::AccountId>(logged->id), request.currency);
+		}
+	}
+
+	// Calls `visit(posting)` for every leg of a transaction logged in
+	// `record`.
+	template <typename Visit>
+	static void forEachPosting(const WalReader::Record& record, Visit&& visit) {
+		auto logged = Shards::parse(record.type, record.payload);
+		auto request = ledger::PostTransaction{};
+
+		if (!logged || logged->type != ledger::MessageType::postTransaction || !request.decode(logged->payload)) {
+			return;
+		}
+
+		for (size_t i = 0; i < request.legCount; ++i) {
+			visit(Posting{{request.legs[i].account, 0, logged->time, record.lsn}, logged->id,
+				request.legs[i].amount});
+		}
+	}
+
+private:
+	static constexpr uint64_t runMagic = 0x3130584449504b42ull;	// "BKPIDX01"
+	static constexpr uint64_t manifestMagic = 0x31304e414d504b42ull;	// "BKPMAN01"
+	static constexpr uint32_t formatVersion = 1;	// of runs
+	static constexpr uint32_t manifestVersion = 2;
+	static constexpr size_t footerSize = sizeof(PostingKey) + 40;
+
+	static constexpr size_t batchRecords = 4096;	// log records per memtable lock
+	static constexpr size_t maxStretches = 65536;	// kept for timeFloor()
+	static constexpr auto pollInterval = std::chrono::milliseconds{5};
+	static constexpr auto retryInterval = std::chrono::seconds{1};
+	static constexpr auto closeCheckInterval = std::chrono::seconds{60};
+
+	// How much later than a period's end the runs must reach before it is
+	// closed. Log times are taken before records are appended and made
+	// durable, so they may be out of order by as much as that can be delayed.
+	static constexpr uint64_t lateLogMargin = 1'000'000;
+
+	struct Run {
+		Run() = default;
+		Run(const Run&) = delete;
+		Run& operator=(const Run&) = delete;
+
+		~Run() {
+			if (fd >= 0) {
+				::close(fd);
+			}
+		}
+
+		size_t blocks() const { return fences.size(); }
+		size_t postingsIn(size_t block) const { return std::min<size_t>(blockPostings, count - block * blockPostings); }
+
+		// Whether the run can hold postings of `account`.
+		bool covers(ledger::AccountId account) const {
+			return count && fences.front().account <= account && account <= last.account;
+		}
+
+		// Reads and checks a block.
+		void read(size_t block, std::vector<Posting>& postings) const {
+			postings.resize(postingsIn(block));
+			auto size = postings.size() * sizeof(Posting);
+
+			if (auto error = files::readAllAt(fd, postings.data(), size, block * blockPostings * sizeof(Posting))) {
+				throw std::system_error(error, "[PostingIndex]: cannot read " + path.string());
+			}
+
+			if (crc32c(postings.data(), size) != crcs[block]) {
+				throw std::runtime_error("[PostingIndex]: corrupt block " + std::to_string(block) + " in " + path.string());
+			}
+		}
+
+		uint64_t id = 0;
+		uint32_t level = 0;
+		uint64_t count = 0;
+		PostingKey last;
+		std::vector<PostingKey> fences;
+		std::vector<uint32_t> crcs;
+		std::filesystem::path path;
+		int fd = -1;
+	};
+
+	struct KeyLess {
+		bool operator()(const Posting& a, const Posting& b) const { return a.key < b.key; }
+	};
+
+	using WaitHandler = asio::any_completion_handler<void()>;
+
+	struct Waiter {
+		Waiter(uint64_t lsn, asio::any_io_executor executor, WaitHandler handler)
+			: lsn(lsn)
+			, executor(std::move(executor))
+			, handler(std::move(handler))
+		{}
+
+		Waiter(Waiter&&) noexcept = default;
+
+		// The move assignment of asio 1.24's any_completion_handler copies
+		// through its converting constructor and recurses; reset and swap.
+		Waiter& operator=(Waiter&& other) noexcept {
+			lsn = other.lsn;
+			executor = std::move(other.executor);
+			handler = nullptr;
+			handler.swap(other.handler);
+			return *this;
+		}
+
+		uint64_t lsn;
+		asio::any_io_executor executor;	// keeps the waiter's io_context running
+		WaitHandler handler;
+	};
+
+	// Consecutive log records the indexer applied, through `last`, and the
+	// earliest time of their postings.
+	struct Stretch {
+		uint64_t last;
+		uint64_t records;
+		uint64_t time;
+	};
+
+	struct Memtable {
+		mutable std::mutex mutex;
+		std::set<Posting, KeyLess> postings;
+		uint64_t lsn = 0;	// the last log record applied
+		uint64_t time = 0;	// the latest posting time applied, or when it last caught up with the log
+	};
+
+	// What scans see. Flushes and compactions replace it rather than change
+	// it, under mEditMutex.
+	struct Version {
+		std::vector<std::shared_ptr<const Run>> runs;
+		std::shared_ptr<Memtable> active;
+		std::shared_ptr<const Memtable> flushing;	// being written out as a run
+		std::vector<std::shared_ptr<const PeriodArchive>> archives;
+		uint64_t lsn = 0;	// what the runs cover
+		uint64_t time = 0;	// the runs hold everything logged before
+		uint64_t closed = 0;	// the end of the last closed period
+	};
+
+	// Writes a run to a temporary file and publishes it under its name.
+	struct RunWriter {
+		RunWriter(const std::filesystem::path& path, uint32_t level)
+			: mPath(path)
+			, mTemporary(std::filesystem::path{path} += ".tmp")
+			, mLevel(level)
+		{
+			mFd = ::open(mTemporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+			if (mFd < 0) {
+				throw std::system_error(errno, std::system_category(), "[PostingIndex]: cannot create " + mTemporary.string());
+			}
+
+			mBlock.reserve(blockPostings);
+		}
+
+		~RunWriter() {
+			if (mFd >= 0) {
+				::close(mFd);
+				std::error_code ignored;
+				std::filesystem::remove(mTemporary, ignored);
+			}
+		}
+
+		void add(const Posting& posting) {
+			if (mBlock.empty()) {
+				mFences.push_back(posting.key);
+			}
+
+			mBlock.push_back(posting);
+			mLast = posting.key;
+			++mCount;
+
+			if (mBlock.size() == blockPostings) {
+				writeBlock();
+			}
+		}
+
+		uint64_t count() const { return mCount; }
+
+		void finish() {
+			if (!mBlock.empty()) {
+				writeBlock();
+			}
+
+			uint8_t footer[footerSize];
+			uint64_t blocks = mFences.size();
+			uint32_t reserved = 0;
+			std::memcpy(footer, &mLast, sizeof(mLast));
+			std::memcpy(footer + 24, &runMagic, 8);
+			std::memcpy(footer + 32, &formatVersion, 4);
+			std::memcpy(footer + 40, &mLevel, 4);
+			std::memcpy(footer + 44, &reserved, 4);
+			std::memcpy(footer + 48, &mCount, 8);
+			std::memcpy(footer + 56, &blocks, 8);
+
+			auto crc = crc32c(mFences.data(), mFences.size() * sizeof(PostingKey));
+			crc = crc32c(mCrcs.data(), mCrcs.size() * sizeof(uint32_t), crc);
+			crc = crc32c(footer, 36, crc);
+			crc = crc32c(footer + 40, footerSize - 40, crc);
+			std::memcpy(footer + 36, &crc, 4);
+
+			write(mFences.data(), mFences.size() * sizeof(PostingKey));
+			write(mCrcs.data(), mCrcs.size() * sizeof(uint32_t));
+			write(footer, sizeof(footer));
+
+			if (::fdatasync(mFd) != 0) {
+				throw std::system_error(errno, std::system_category(), "[PostingIndex]: cannot sync " + mTemporary.string());
+			}
+
+			::close(mFd);
+			mFd = -1;
+
+			if (::rename(mTemporary.c_str(), mPath.c_str()) != 0) {
+				throw std::system_error(errno, std::system_category(), "[PostingIndex]: cannot rename " + mTemporary.string());
+			}
+		}
+
+	private:
+		void writeBlock() {
+			auto size = mBlock.size() * sizeof(Posting);
+			mCrcs.push_back(crc32c(mBlock.data(), size));
+			write(mBlock.data(), size);
+			mBlock.clear();
+		}
+
+		void write(const void* data, size_t size) {
+			if (auto error = files::writeAll(mFd, data, size)) {
+				throw std::system_error(error, "[PostingIndex]: cannot write " + mTemporary.string());
+			}
+		}
+
+		std::filesystem::path mPath;
+		std::filesystem::path mTemporary;
+		uint32_t mLevel;
+		int mFd = -1;
+		std::vector<Posting> mBlock;
+		std::vector<PostingKey> mFences;
+		std::vector<uint32_t> mCrcs;
+		PostingKey mLast;
+		uint64_t mCount = 0;
+	};
+
+	std::filesystem::path runPath(uint64_t id) const {
+		return mDirectory / fmt::format("run-{:020}.idx", id);
+	}
+
+	std::filesystem::path manifestPath() const { return mDirectory / "manifest"; }
+
+	std::shared_ptr<const Version> current() const {
+		auto lock = std::lock_guard{mMutex};
+		return mVersion;
+	}
+
+	// Makes `change` of the current version current, writing the manifest
+	// first if the runs change.
+	template <typename Change>
+	void edit(Change&& change, bool persist) {
+		auto lock = std::lock_guard{mEditMutex};
+		auto next = std::make_shared<Version>(*current());
+		change(*next);
+
+		if (persist) {
+			writeManifest(*next);
+		}
+
+		auto versionLock = std::lock_guard{mMutex};
+		mVersion = std::move(next);
+	}
+
+	struct Manifest {
+		uint64_t lsn = 0;
+		uint64_t time = 0;
+		uint64_t closed = 0;
+		std::vector<uint64_t> runs;
+		std::vector<uint64_t> periods;	// the start of every archive
+	};
+
+	std::filesystem::path archivePath(uint64_t from) const {
+		return mArchiveDirectory / fmt::format("period-{:020}.arc", from);
+	}
+
+	// Loads the manifest, its runs and archives, and removes files it does
+	// not list: those of a flush, compaction or period close that did not
+	// get to update it, and runs it replaced before they could be removed.
+	void open() {
+		auto version = std::make_shared<Version>();
+		auto manifest = Manifest{};
+
+		if (std::filesystem::exists(manifestPath())) {
+			manifest = readManifest();
+		}
+
+		// Archives are kept: the log they came from is gone.
+		if (manifest.lsn > mWal.lastLsn()) {
+			spdlog::warn("[PostingIndex]: Index covers lsn {} but the log ends at {}, rebuilding it",
+				manifest.lsn, mWal.lastLsn());
+			manifest.runs.clear();
+			manifest.lsn = manifest.time = 0;
+		}
+
+		version->lsn = manifest.lsn;
+		version->time = manifest.time;
+		version->closed = manifest.closed;
+
+		for (auto id: manifest.runs) {
+			version->runs.push_back(openRun(runPath(id)));
+			mNextRunId = std::max<uint64_t>(mNextRunId.load(), id + 1);
+		}
+
+		if (!manifest.periods.empty() && mArchiveDirectory.empty()) {
+			throw std::runtime_error("[PostingIndex]: The index has archives but no \"archive_dir\" is specified in config");
+		}
+
+		for (auto from: manifest.periods) {
+			version->archives.push_back(PeriodArchive::open(archivePath(from)));
+		}
+
+		removeUnlisted(mDirectory, "run-", manifest.runs);
+
+		if (!mArchiveDirectory.empty()) {
+			removeUnlisted(mArchiveDirectory, "period-", manifest.periods);
+		}
+
+		version->active = std::make_shared<Memtable>();
+		version->active->lsn = version->lsn;
+		mActive = version->active;
+		mVersion = version;
+		mWal.retainAfter(version->lsn);
+
+		uint64_t postings = 0, archived = 0;
+		for (auto& run: version->runs) {
+			postings += run->count;
+		}
+
+		for (auto& archive: version->archives) {
+			archived += archive->rows;
+		}
+
+		spdlog::info("[PostingIndex]: {} postings in {} runs, covering the log through lsn {}; {} postings in {} archives",
+			postings, version->runs.size(), version->lsn, archived, version->archives.size());
+	}
+
+	static void removeUnlisted(const std::filesystem::path& directory, std::string_view prefix,
+		const std::vector<uint64_t>& ids)
+	{
+		for (auto& entry: std::filesystem::directory_iterator{directory}) {
+			auto name = entry.path().filename().string();
+
+			if (!name.starts_with(prefix)) {
+				continue;
+			}
+
+			auto id = std::stoull(name.substr(prefix.size()));
+
+			if (name.ends_with(".tmp") || std::find(ids.begin(), ids.end(), id) == ids.end()) {
+				std::error_code error;
+				std::filesystem::remove(entry.path(), error);
+			}
+		}
+	}
+
+	Manifest readManifest() const {
+		auto data = std::string{};
+
+		{
+			auto file = std::ifstream{manifestPath(), std::ios::binary};
+			data.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+		}
+
+		auto manifest = Manifest{};
+		auto* bytes = data.data();
+		uint64_t magic = 0, runs = 0, archives = 0;
+		uint32_t version = 0, crc = 0;
+		size_t header = 0;
+
+		if (data.size() >= 56) {
+			header = 56;
+			std::memcpy(&magic, bytes, 8);
+			std::memcpy(&version, bytes + 8, 4);
+			std::memcpy(&crc, bytes + 12, 4);
+			std::memcpy(&manifest.lsn, bytes + 16, 8);
+			std::memcpy(&manifest.time, bytes + 24, 8);
+			std::memcpy(&manifest.closed, bytes + 32, 8);
+			std::memcpy(&runs, bytes + 40, 8);
+			std::memcpy(&archives, bytes + 48, 8);
+		}
+
+		auto entries = (data.size() - header) / sizeof(uint64_t);
+
+		if (!header || magic != manifestMagic || version != manifestVersion || runs > entries ||
+			archives > entries - runs || data.size() != header + (runs + archives) * sizeof(uint64_t) ||
+			crc != crc32c(bytes + 16, data.size() - 16))
+		{
+			throw std::runtime_error("[PostingIndex]: " + manifestPath().string() + " is damaged");
+		}
+
+		manifest.runs.resize(runs);
+		manifest.periods.resize(archives);
+		std::memcpy(manifest.runs.data(), bytes + header, runs * sizeof(uint64_t));
+		std::memcpy(manifest.periods.data(), bytes + header + runs * sizeof(uint64_t), archives * sizeof(uint64_t));
+		return manifest;
+	}
+
+	void writeManifest(const Version& version) {
+		std::vector<uint64_t> entries;
+
+		for (auto& run: version.runs) {
+			entries.push_back(run->id);
+		}
+
+		for (auto& archive: version.archives) {
+			entries.push_back(archive->from);
+		}
+
+		std::vector<uint8_t> data(56 + entries.size() * sizeof(uint64_t));
+		uint64_t runs = version.runs.size();
+		uint64_t archives = version.archives.size();
+		std::memcpy(data.data(), &manifestMagic, 8);
+		std::memcpy(data.data() + 8, &manifestVersion, 4);
+		std::memcpy(data.data() + 16, &version.lsn, 8);
+		std::memcpy(data.data() + 24, &version.time, 8);
+		std::memcpy(data.data() + 32, &version.closed, 8);
+		std::memcpy(data.data() + 40, &runs, 8);
+		std::memcpy(data.data() + 48, &archives, 8);
+		std::memcpy(data.data() + 56, entries.data(), entries.size() * sizeof(uint64_t));
+
+		auto crc = crc32c(data.data() + 16, data.size() - 16);
+		std::memcpy(data.data() + 12, &crc, 4);
+
+		auto path = manifestPath();
+		auto temporary = std::filesystem::path{path} += ".tmp";
+		auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category(), "[PostingIndex]: cannot create " + temporary.string());
+		}
+
+		auto error = files::writeAll(fd, data.data(), data.size());
+
+		if (!error && ::fdatasync(fd) != 0) {
+			error = {errno, std::system_category()};
+		}
+
+		::close(fd);
+
+		if (!error && ::rename(temporary.c_str(), path.c_str()) != 0) {
+			error = {errno, std::system_category()};
+		}
+
+		if (!error) {
+			error = files::syncDirectory(mDirectory);
+		}
+
+		if (error) {
+			throw std::system_error(error, "[PostingIndex]: cannot write " + path.string());
+		}
+	}
+
+	static std::shared_ptr<Run> openRun(const std::filesystem::path& path) {
+		auto run = std::make_shared<Run>();
+		run->path = path;
+		run->id = std::stoull(path.filename().string().substr(4));
+		run->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (run->fd < 0) {
+			throw std::system_error(errno, std::system_category(), "[PostingIndex]: cannot open " + path.string());
+		}
+
+		struct stat status;
+		uint8_t footer[footerSize];
+
+		if (::fstat(run->fd, &status) != 0 || static_cast<size_t>(status.st_size) < footerSize ||
+			files::readAllAt(run->fd, footer, footerSize, status.st_size - footerSize))
+		{
+			throw std::runtime_error("[PostingIndex]: " + path.string() + " has no footer");
+		}
+
+		uint64_t magic, blocks;
+		uint32_t version, crc;
+		std::memcpy(&run->last, footer, sizeof(run->last));
+		std::memcpy(&magic, footer + 24, 8);
+		std::memcpy(&version, footer + 32, 4);
+		std::memcpy(&crc, footer + 36, 4);
+		std::memcpy(&run->level, footer + 40, 4);
+		std::memcpy(&run->count, footer + 48, 8);
+		std::memcpy(&blocks, footer + 56, 8);
+
+		auto size = static_cast<uint64_t>(status.st_size);
+
+		if (magic != runMagic || version != formatVersion || blocks != (run->count + blockPostings - 1) / blockPostings ||
+			size != run->count * sizeof(Posting) + blocks * (sizeof(PostingKey) + sizeof(uint32_t)) + footerSize)
+		{
+			throw std::runtime_error("[PostingIndex]: " + path.string() + " is not a run of this version");
+		}
+
+		run->fences.resize(blocks);
+		run->crcs.resize(blocks);
+		auto offset = run->count * sizeof(Posting);
+
+		if (files::readAllAt(run->fd, run->fences.data(), blocks * sizeof(PostingKey), offset) ||
+			files::readAllAt(run->fd, run->crcs.data(), blocks * sizeof(uint32_t), offset + blocks * sizeof(PostingKey)))
+		{
+			throw std::runtime_error("[PostingIndex]: cannot read the fences of " + path.string());
+		}
+
+		auto expected = crc32c(run->fences.data(), blocks * sizeof(PostingKey));
+		expected = crc32c(run->crcs.data(), blocks * sizeof(uint32_t), expected);
+		expected = crc32c(footer, 36, expected);
+		expected = crc32c(footer + 40, footerSize - 40, expected);
+
+		if (crc != expected) {
+			throw std::runtime_error("[PostingIndex]: " + path.string() + " is damaged");
+		}
+
+		return run;
+	}
+
+	// Writes `postings`, in key order, as a new run of `level`.
+	template <typename Postings>
+	std::shared_ptr<Run> writeRun(const Postings& postings, uint32_t level) {
+		auto id = mNextRunId++;
+		auto writer = RunWriter{runPath(id), level};
+
+		for (auto& posting: postings) {
+			writer.add(posting);
+		}
+
+		writer.finish();
+		return openRun(runPath(id));
+	}
+
+	void wait(Clock::duration duration) {
+		auto lock = std::unique_lock{mWakeMutex};
+		mWake.wait_for(lock, duration, [this] { return mStopping; });
+	}
+
+	// Sleeps out the poll interval unless a query waits for the indexer.
+	void poll() {
+		auto lock = std::unique_lock{mWakeMutex};
+		mWake.wait_for(lock, pollInterval, [this] { return mStopping || mWanted; });
+		mWanted = false;
+	}
+
+	// Records that the memtable holds the log through `lsn`, having just
+	// applied `records` of it with postings made at `time` or later.
+	void indexed(uint64_t lsn, size_t records = 0, uint64_t time = std::numeric_limits<uint64_t>::max()) {
+		auto lock = std::lock_guard{mWakeMutex};
+
+		if (!records) {
+			if (mStretches.empty()) {
+				mStretchesAfter = lsn;
+			}
+		} else if (!mStretches.empty() && mStretches.back().records < mStretchRecords) {
+			auto& last = mStretches.back();
+			last.last = lsn;
+			last.records += records;
+			last.time = std::min(last.time, time);
+		} else {
+			// Halves the table, and its resolution, once it is full.
+			if (mStretches.size() == maxStretches) {
+				for (size_t i = 0; i < maxStretches / 2; ++i) {
+					auto& first = mStretches[2 * i];
+					auto& second = mStretches[2 * i + 1];
+					mStretches[i] = {second.last, first.records + second.records, std::min(first.time, second.time)};
+				}
+
+				mStretches.resize(maxStretches / 2);
+				mStretchRecords *= 2;
+			}
+
+			mStretches.push_back({lsn, records, time});
+		}
+
+		mIndexed = lsn;
+		complete(lsn);
+	}
+
+	// Must be called with mWakeMutex held.
+	void complete(uint64_t lsn) {
+		auto done = std::partition(mWaiters.begin(), mWaiters.end(),
+			[lsn](const Waiter& waiter) { return waiter.lsn > lsn; });
+
+		for (auto waiter = done; waiter != mWaiters.end(); ++waiter) {
+			asio::post(waiter->executor, [handler = std::move(waiter->handler)]() mutable {
+				std::move(handler)();
+			});
+		}
+
+		mWaiters.erase(done, mWaiters.end());
+	}
+
+	bool stopping() {
+		auto lock = std::lock_guard{mWakeMutex};
+		return mStopping;
+	}
+
+	// The indexer thread. A failure starts over from the memtable's lsn,
+	// re-reading what was not applied.
+	void index() {
+		std::optional<WalReader> reader;
+
+		while (true) {
+			auto stop = stopping();
+
+			try {
+				if (!reader) {
+					reader.emplace(mWal, mActive->lsn);
+					indexed(mActive->lsn);
+				}
+
+				auto applied = apply(*reader);
+				auto requested = mFlushRequested.exchange(false);
+
+				if (mActive->postings.size() >= mMemtableLimit || requested || (stop && !applied)) {
+					flush();
+				}
+
+				if (stop && !applied) {
+					return;
+				}
+
+				if (!applied) {
+					poll();
+				}
+			} catch (const std::exception& error) {
+				spdlog::error("[PostingIndex]: Indexing failed: {}", error.what());
+				reader.reset();
+
+				if (stop) {
+					return;
+				}
+
+				wait(retryInterval);
+			}
+		}
+	}
+
+	// Applies a batch of log records to the memtable; returns how many.
+	size_t apply(WalReader& reader) {
+		mBatch.clear();
+		mOpened.clear();
+		size_t records = 0;
+		uint64_t lsn = 0;
+		uint64_t time = 0;
+		auto earliest = std::numeric_limits<uint64_t>::max();
+
+		for (; records < batchRecords; ++records) {
+			auto record = reader.next();
+
+			if (!record) {
+				break;
+			}
+
+			lsn = record->lsn;
+			forOpenedAccount(*record, [&](ledger::AccountId account, ledger::Currency currency) {
+				mOpened.emplace_back(account, currency);
+			});
+			forEachPosting(*record, [&](const Posting& posting) {
+				mBatch.push_back(posting);
+				time = std::max(time, posting.key.time);
+				earliest = std::min(earliest, posting.key.time);
+			});
+		}
+
+		if (records) {
+			// Before the postings, which may be of the accounts opened.
+			if (!mOpened.empty()) {
+				auto lock = std::lock_guard{mCurrencyMutex};
+
+				for (auto [account, currency]: mOpened) {
+					if (account >= mCurrencies.size()) {
+						mCurrencies.resize(account + size_t{1}, 0);
+					}
+
+					mCurrencies[account] = currency;
+				}
+			}
+
+			{
+				auto lock = std::lock_guard{mActive->mutex};
+				mActive->postings.insert(mBatch.begin(), mBatch.end());
+				mActive->lsn = lsn;
+				mActive->time = std::max(mActive->time, time);
+			}
+
+			indexed(lsn, records, earliest);
+		} else {
+			// Anything logged from now on is timed later.
+			mActive->time = std::max(mActive->time, Shards::now());
+		}
+
+		return records;
+	}
+
+	// Swaps in a fresh memtable and writes the full one out as a level 0 run.
+	void flush() {
+		auto full = mActive;
+
+		// The runs already hold everything the memtable has seen.
+		if (full->postings.empty()) {
+			if (full->time > current()->time) {
+				edit([&](Version& version) { version.time = full->time; }, false);
+			}
+
+			return;
+		}
+
+		auto started = Clock::now();
+		mActive = std::make_shared<Memtable>();
+		mActive->lsn = full->lsn;
+
+		edit([&](Version& version) {
+			version.active = mActive;
+			version.flushing = full;
+		}, false);
+
+		std::shared_ptr<const Run> run;
+
+		try {
+			run = writeRun(full->postings, 0);
+		} catch (...) {
+			// Back to indexing into the full memtable, to retry later.
+			mActive = std::const_pointer_cast<Memtable>(full);
+
+			edit([&](Version& version) {
+				version.active = mActive;
+				version.flushing = nullptr;
+			}, false);
+
+			throw;
+		}
+
+		edit([&](Version& version) {
+			version.runs.push_back(run);
+			version.flushing = nullptr;
+			version.lsn = full->lsn;
+			version.time = std::max(version.time, full->time);
+		}, true);
+
+		mWal.retainAfter(full->lsn);
+
+		// Under the lock, so that the compactor is either still to check for
+		// work or already waiting.
+		{
+			auto lock = std::lock_guard{mWakeMutex};
+			mWake.notify_all();
+		}
+
+		spdlog::info("[PostingIndex]: Wrote run {} ({} postings through lsn {}) in {:.1f} ms", run->id, run->count,
+			full->lsn, std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+	}
+
+	// The oldest mFanout runs of the lowest level that has that many.
+	std::vector<std::shared_ptr<const Run>> pick() const {
+		auto version = current();
+		std::vector<std::shared_ptr<const Run>> runs;
+
+		for (uint32_t level = 0; runs.empty(); ++level) {
+			size_t above = 0;
+
+			for (auto& run: version->runs) {
+				if (run->level == level) {
+					runs.push_back(run);
+				} else if (run->level > level) {
+					++above;
+				}
+			}
+
+			if (runs.size() < mFanout) {
+				runs.clear();
+
+				if (!above) {
+					break;
+				}
+			}
+		}
+
+		std::sort(runs.begin(), runs.end(), [](auto& a, auto& b) { return a->id < b->id; });
+		runs.resize(std::min(runs.size(), mFanout));
+		return runs;
+	}
+
+	// The compaction thread, which also closes periods.
+	void compact() {
+		auto nextClose = Clock::now();
+
+		while (true) {
+			std::vector<std::shared_ptr<const Run>> inputs;
+			bool closing = false;
+
+			{
+				auto lock = std::unique_lock{mWakeMutex};
+				mWake.wait_until(lock, nextClose, [&] { return mStopping || !(inputs = pick()).empty(); });
+
+				if (mStopping) {
+					return;
+				}
+
+				closing = inputs.empty();
+			}
+
+			try {
+				if (closing) {
+					nextClose = Clock::now() + closeCheckInterval;
+					closePeriods();
+				} else {
+					merge(inputs);
+				}
+			} catch (const std::exception& error) {
+				if (stopping()) {
+					return;
+				}
+
+				spdlog::error("[PostingIndex]: {} failed: {}", closing ? "Closing periods" : "Compaction", error.what());
+				wait(retryInterval);
+			}
+		}
+	}
+
+	// Calls `sink(posting)` for the postings of `inputs` in key order.
+	// Stopping abandons the merge, between blocks.
+	template <typename Sink>
+	void mergeRuns(const std::vector<std::shared_ptr<const Run>>& inputs, Sink&& sink) {
+		struct Source {
+			const Run* run;
+			size_t block = 0;
+			size_t index = 0;
+			std::vector<Posting> postings;
+		};
+
+		std::vector<Source> sources;
+
+		for (auto& input: inputs) {
+			if (input->count) {
+				sources.push_back({.run = input.get(), .postings = {}});
+				input->read(0, sources.back().postings);
+			}
+		}
+
+		while (!sources.empty()) {
+			auto next = std::min_element(sources.begin(), sources.end(), [](auto& a, auto& b) {
+				return a.postings[a.index].key < b.postings[b.index].key;
+			});
+
+			sink(next->postings[next->index]);
+
+			if (++next->index < next->postings.size()) {
+				continue;
+			}
+
+			if (++next->block < next->run->blocks()) {
+				if (stopping()) {
+					throw std::runtime_error("stopped");
+				}
+
+				next->run->read(next->block, next->postings);
+				next->index = 0;
+			} else {
+				sources.erase(next);
+			}
+		}
+	}
+
+	// Makes `inputs` one run, and archives, when closing, in place of them.
+	// Unlinks the inputs once the manifest no longer lists them.
+	void replace(const std::vector<std::shared_ptr<const Run>>& inputs, std::shared_ptr<const Run> run,
+		std::shared_ptr<const PeriodArchive> archive, uint64_t closed)
+	{
+		edit([&](Version& version) {
+			std::erase_if(version.runs, [&](auto& live) {
+				return std::find(inputs.begin(), inputs.end(), live) != inputs.end();
+			});
+
+			if (run) {
+				version.runs.push_back(run);
+			}
+
+			if (archive) {
+				version.archives.push_back(archive);
+			}
+
+			version.closed = std::max(version.closed, closed);
+		}, true);
+
+		for (auto& input: inputs) {
+			std::error_code error;
+			std::filesystem::remove(input->path, error);
+		}
+	}
+
+	// Merges runs of one level into a run of the next.
+	void merge(const std::vector<std::shared_ptr<const Run>>& inputs) {
+		auto started = Clock::now();
+		auto level = inputs.front()->level + 1;
+		auto id = mNextRunId++;
+		auto writer = RunWriter{runPath(id), level};
+
+		mergeRuns(inputs, [&](const Posting& posting) { writer.add(posting); });
+
+		auto count = writer.count();
+		writer.finish();
+		replace(inputs, openRun(runPath(id)), nullptr, 0);
+
+		spdlog::info("[PostingIndex]: Merged {} runs of level {} into run {} ({} postings) in {:.1f} ms",
+			inputs.size(), level - 1, id, count, std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+	}
+
+	static Period periodOf(const std::string& name) {
+		if (name == "hour") {
+			return Period::hour;
+		} else if (name == "day") {
+			return Period::day;
+		} else if (name == "month") {
+			return Period::month;
+		}
+
+		throw std::runtime_error("[PostingIndex]: \"archive_period\" must be \"month\", \"day\" or \"hour\", not \"" +
+			name + "\"");
+	}
+
+	std::vector<ledger::Currency> copyCurrencies() {
+		auto lock = std::lock_guard{mCurrencyMutex};
+		return mCurrencies;
+	}
+
+	// Closes every period that ended mCloseDelay ago, as one archive, once
+	// the runs hold the log past its end: all runs are merged, the postings
+	// before the end go to the archive and the others to a run. Postings of
+	// closed periods indexed late go into the next archive; reports select
+	// archives by the times they hold, so they still count them.
+	void closePeriods() {
+		auto version = current();
+		auto now = Shards::now();
+
+		if (mArchiveDirectory.empty() || now < mCloseDelay) {
+			return;
+		}
+
+		auto end = periodStart(now - mCloseDelay, mPeriod);
+
+		if (end <= version->closed) {
+			return;
+		}
+
+		if (version->time < end + lateLogMargin) {
+			// Postings may still be in the memtable.
+			mFlushRequested = true;
+			return;
+		}
+
+		auto started = Clock::now();
+		auto currencies = copyCurrencies();
+		auto inputs = version->runs;
+		auto level = uint32_t{0};
+
+		for (auto& input: inputs) {
+			level = std::max(level, input->level);
+		}
+
+		auto from = version->closed;
+		auto id = mNextRunId++;
+		auto archive = PeriodArchive::Writer{archivePath(from), from, end};
+		auto rest = RunWriter{runPath(id), level};
+
+		mergeRuns(inputs, [&](const Posting& posting) {
+			if (posting.key.time < end) {
+				auto account = posting.key.account;
+				archive.add(posting, account < currencies.size() ? currencies[account] : 0);
+			} else {
+				rest.add(posting);
+			}
+		});
+
+		std::shared_ptr<const PeriodArchive> archived;
+		std::shared_ptr<const Run> run;
+
+		if (archive.rows()) {
+			archive.finish();
+			archived = PeriodArchive::open(archivePath(from));
+		}
+
+		if (rest.count()) {
+			rest.finish();
+			run = openRun(runPath(id));
+		}
+
+		replace(inputs, run, archived, end);
+
+		spdlog::info("[PostingIndex]: Closed the periods before {:%F %T} UTC: archived {} postings in {} bytes "
+			"({:.1f} per posting), {} stay indexed, in {:.1f} ms",
+			std::chrono::sys_time<std::chrono::microseconds>{std::chrono::microseconds{end}}, archive.rows(), archive.size(),
+			archive.rows() ? static_cast<double>(archive.size()) / archive.rows() : 0.0, rest.count(),
+			std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+	}
+
+	asio::awaitable<bool> aggregate(std::shared_ptr<const Version> version, std::optional<ledger::AccountId> account,
+		uint64_t from, uint64_t to, std::vector<ledger::ReportRow>& totals)
+	{
+		for (auto& archive: version->archives) {
+			if (archive->maxTime >= from && archive->minTime < to && !archive->aggregate(account, from, to, totals)) {
+				co_return false;
+			}
+		}
+
+		co_return true;
+	}
+
+	std::filesystem::path mDirectory;
+	std::filesystem::path mArchiveDirectory;
+	size_t mMemtableLimit;
+	size_t mFanout;
+	Period mPeriod;
+	uint64_t mCloseDelay;	// in microseconds
+	asio::thread_pool mQueries;
+	Wal& mWal;
+
+	// The currency of every account by id, 0 for ids not taken yet: the
+	// accounts open at startup and those the indexer saw opened since.
+	std::mutex mCurrencyMutex;
+	std::vector<ledger::Currency> mCurrencies;
+
+	mutable std::mutex mMutex;	// guards mVersion
+	std::shared_ptr<const Version> mVersion;
+	std::mutex mEditMutex;
+	std::atomic<uint64_t> mNextRunId = 1;
+
+	// Indexer thread state.
+	std::shared_ptr<Memtable> mActive;
+	std::vector<Posting> mBatch;
+	std::vector<std::pair<ledger::AccountId, ledger::Currency>> mOpened;
+	std::atomic<bool> mFlushRequested = false;
+
+	mutable std::mutex mWakeMutex;
+	std::condition_variable mWake;
+	bool mStopping = false;
+	bool mWanted = false;	// a query waits for the indexer
+	uint64_t mIndexed = 0;	// what the memtable holds
+	std::vector<Waiter> mWaiters;
+	std::vector<Stretch> mStretches;	// of the log after mStretchesAfter, in order
+	uint64_t mStretchesAfter = 0;
+	size_t mStretchRecords = batchRecords;	// that a stretch grows to
+	std::thread mIndexer;
+	std::thread mCompactor;
+};
+
+/*
+ * Reads an account's postings off the version of the index it was started
+ * on: from every archive and run that may hold the account, keeping the
+ * group or block it is at, and from the memtables, up to the log record that
+ * was last applied then. Postings logged outside its lsn range are skipped.
+ * Each call collects up to a page from every source, starting after the
+ * last key returned, and keeps the smallest.
+ */
+struct PostingIndex::Scan {
+	Scan(const Scan&) = delete;
+	Scan& operator=(const Scan&) = delete;
+	Scan(Scan&&) = default;
+
+	// Fills `out` with the next postings on a query thread and resumes on
+	// the caller's executor. Returns how many; 0 once the scan is done.
+	asio::awaitable<size_t> next(std::span<Posting> out) {
+		co_return co_await asio::co_spawn(*mQueries, read(out), asio::use_awaitable);
+	}
+
+	// The lsn of the last log record the scan includes.
+	uint64_t lsn() const { return mThrough; }
+
+private:
+	friend struct PostingIndex;
+
+	// Over the blocks of a run or the groups of an archive.
+	template <typename Source>
+	struct Cursor {
+		std::shared_ptr<const Source> source;
+		size_t block = ~size_t{0};
+		std::vector<Posting> postings;
+	};
+
+	Scan(asio::thread_pool& queries, ledger::AccountId account, const PostingKey& after, uint64_t from,
+		uint64_t through, std::shared_ptr<const Version> version)
+		: mQueries(&queries)
+		, mAccount(account)
+		, mAfter(after)
+		, mFrom(from)
+		, mVersion(std::move(version))
+	{
+		for (auto& archive: mVersion->archives) {
+			if (archive->covers(account)) {
+				mArchives.push_back({.source = archive, .postings = {}});
+			}
+		}
+
+		for (auto& run: mVersion->runs) {
+			if (run->covers(account)) {
+				mRuns.push_back({.source = run, .postings = {}});
+			}
+		}
+
+		auto lock = std::lock_guard{mVersion->active->mutex};
+		mThrough = std::min(through, mVersion->active->lsn);
+	}
+
+	bool wanted(const Posting& posting) const {
+		return posting.key.sequence > mFrom && posting.key.sequence <= mThrough;
+	}
+
+	asio::awaitable<size_t> read(std::span<Posting> out) {
+		mCandidates.clear();
+
+		for (auto& cursor: mArchives) {
+			collect(cursor, out.size());
+		}
+
+		for (auto& cursor: mRuns) {
+			collect(cursor, out.size());
+		}
+
+		for (auto* memtable: {mVersion->flushing.get(), static_cast<const Memtable*>(mVersion->active.get())}) {
+			if (memtable) {
+				collect(*memtable, out.size());
+			}
+		}
+
+		auto count = std::min(out.size(), mCandidates.size());
+		std::partial_sort(mCandidates.begin(), mCandidates.begin() + count, mCandidates.end(), KeyLess{});
+		std::copy_n(mCandidates.begin(), count, out.begin());
+
+		if (count) {
+			mAfter = out[count - 1].key;
+		}
+
+		co_return count;
+	}
+
+	template <typename Source>
+	void collect(Cursor<Source>& cursor, size_t limit) {
+		auto& fences = cursor.source->fences;
+
+		// The last block starting at or before mAfter may hold keys after it.
+		auto block = static_cast<size_t>(std::upper_bound(fences.begin(), fences.end(), mAfter) - fences.begin());
+		block = block ? block - 1 : 0;
+		size_t taken = 0;
+
+		for (; block < fences.size() && fences[block].account <= mAccount && taken < limit; ++block) {
+			if (cursor.block != block) {
+				cursor.source->read(block, cursor.postings);
+				cursor.block = block;
+			}
+
+			auto posting = std::upper_bound(cursor.postings.begin(), cursor.postings.end(), mAfter,
+				[](const PostingKey& key, const Posting& posting) { return key < posting.key; });
+
+			for (; posting != cursor.postings.end() && taken < limit; ++posting) {
+				if (posting->key.account != mAccount) {
+					return;
+				}
+
+				if (wanted(*posting)) {
+					mCandidates.push_back(*posting);
+					++taken;
+				}
+			}
+		}
+	}
+
+	void collect(const Memtable& memtable, size_t limit) {
+		auto lock = std::lock_guard{memtable.mutex};
+		size_t taken = 0;
+
+		for (auto posting = memtable.postings.upper_bound(Posting{mAfter});
+			posting != memtable.postings.end() && posting->key.account == mAccount && taken < limit; ++posting)
+		{
+			if (wanted(*posting)) {
+				mCandidates.push_back(*posting);
+				++taken;
+			}
+		}
+	}
+
+	asio::thread_pool* mQueries;
+	ledger::AccountId mAccount;
+	PostingKey mAfter;
+	uint64_t mFrom;
+	uint64_t mThrough = 0;
+	std::shared_ptr<const Version> mVersion;
+	std::vector<Cursor<PeriodArchive>> mArchives;
+	std::vector<Cursor<Run>> mRuns;
+	std::vector<Posting> mCandidates;
+};
+
+inline PostingIndex::Scan PostingIndex::scan(ledger::AccountId account, const PostingKey& after, uint64_t from,
+	uint64_t through)
+{
+	return Scan{mQueries, account, after, from, through, current()};
+}
+
+} //namespace bookkeeper
@@ -4,24 +4,45 @@
 #include "asio.hpp"
 #include "asio/ssl.hpp"
 
+#include <chrono>
+#include <optional>
+
 #include "spdlog/spdlog.h"
 #include "nlohmann/json.hpp"
 
-#include <iostream>
-
+#include "admission.hpp"
+#include "dispatcher.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
 #include "session.hpp"
+#include "session_set.hpp"
+#include "timer_wheel.hpp"
+#include "tls.hpp"
 
 using asio::ip::tcp;
 
 namespace bookkeeper {
 
+using ReusePort = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
 struct Server {
 	Server() = delete;
 	Server(const Server&) = delete;
 	Server& operator=(const Server&) = delete;
 
-	explicit Server(asio::io_context& ctx)
+	explicit Server(asio::io_context& ctx, const nlohmann::json& config, Dispatcher& dispatcher, Admission& admission,
+		TimerWheel& wheel, ThreadMetrics& metrics, SessionSet& sessions)
 		: mAcceptor(ctx)
+		, mDispatcher(dispatcher)
+		, mAdmission(admission)
+		, mWheel(wheel)
+		, mMetrics(metrics)
+		, mSessions(sessions)
+		, mTimeouts(config)
+		// Every io thread binds its own acceptor to the same port and lets
+		// the kernel spread incoming connections between them.
+		, mReusePort(config.value("threads", 1) != 1)
+		, mFlushThreshold(config.value("write_flush_threshold", network::TcpStream::defaultFlushThreshold))
 	{
 	}
 
@@ -31,6 +52,11 @@ struct Server {
 		auto endpoint = tcp::endpoint(tcp::v4(), mPort);
 		mAcceptor.open(endpoint.protocol());
 		mAcceptor.set_option(tcp::acceptor::reuse_address(true));
+
+		if (mReusePort) {
+			mAcceptor.set_option(ReusePort(true));
+		}
+
 		mAcceptor.bind(endpoint);
 
 		mAcceptor.listen();
@@ -38,28 +64,78 @@ struct Server {
 		spdlog::info("[Server]: Starting server on {}", network::to_string(mAcceptor.local_endpoint()));
 
 		try {
-			while (true) {
+			while (!mStopping) {
+				// At capacity, leave new connections in the listen backlog.
+				if (mAdmission.saturated()) {
+					SPDLOG_DEBUG("[Server]: Pausing accepts on port {}: {} connections, {} requests in flight",
+						mPort, mAdmission.connections(), mAdmission.requests());
+					mMetrics.acceptPauses.add();
+					co_await mAdmission.waitUntilAccepting();
+					SPDLOG_DEBUG("[Server]: Resuming accepts on port {}", mPort);
+
+					if (mStopping) {
+						break;
+					}
+				}
+
 				auto socket = co_await mAcceptor.async_accept(asio::use_awaitable);
-				std::cout << "Got something!\n";
-				asio::co_spawn(mAcceptor.get_executor(), handleAccept(std::move(socket)), asio::detached);
+				// Replies are already coalesced by the stream's write queue, so
+				// Nagle would only add delayed-ACK stalls on top.
+				socket.set_option(tcp::no_delay(true));
+				SPDLOG_DEBUG("[Server]: Accepted connection on port {}", mPort);
+
+				mAdmission.addConnection();
+				mMetrics.accepted[mTransport].add();
+				asio::co_spawn(mAcceptor.get_executor(), handleAccept(std::move(socket)),
+					[this](std::exception_ptr) {
+						mAdmission.removeConnection();
+						mMetrics.closed[mTransport].add();
+					});
 			}
 		} catch (const std::exception& error) {
-			std::cout << "Wtf " << error.what() << std::endl;
+			if (!mStopping) {
+				spdlog::error("[Server]: Stopped accepting on port {}: {}", mPort, error.what());
+			}
 		}
 
+		if (mStopping) {
+			spdlog::info("[Server]: Stopped accepting on port {}", mPort);
+		}
+	}
+
+	// Closes the acceptor. Connections already accepted are left to finish;
+	// the io thread's SessionSet drains them.
+	void stop() {
+		mStopping = true;
+
+		std::error_code ignored;
+		mAcceptor.close(ignored);
 	}
 
 protected:
 	tcp::acceptor mAcceptor;
+	Dispatcher& mDispatcher;
+	Admission& mAdmission;
+	TimerWheel& mWheel;
+	ThreadMetrics& mMetrics;
+	SessionSet& mSessions;
+	SessionTimeouts mTimeouts;
 	uint16_t mPort;
+	ThreadMetrics::Transport mTransport;
+	bool mReusePort;
+	size_t mFlushThreshold;
+	bool mStopping = false;
 };
 
 struct TcpServer: Server {
 	using Server::Server;
 
-	explicit TcpServer(asio::io_context& ctx, const nlohmann::json& config)
-	: Server(ctx)
+	explicit TcpServer(asio::io_context& ctx, const nlohmann::json& config, Dispatcher& dispatcher, Admission& admission,
+		TimerWheel& wheel, ThreadMetrics& metrics, SessionSet& sessions)
+	: Server(ctx, config, dispatcher, admission, wheel, metrics, sessions)
 	{
+		mTransport = ThreadMetrics::tcp;
+
 		try {
 			mPort = config.value("open_port", 0);
 
@@ -78,7 +154,10 @@ struct TcpServer: Server {
 	}
 
 	awaitable<void> handleAccept(tcp::socket socket) {
-		auto session = Session{network::TcpStream{std::move(socket)}};
+		auto stream = network::TcpStream{std::move(socket)};
+		stream.setFlushThreshold(mFlushThreshold);
+
+		auto session = Session{std::move(stream), mDispatcher, mAdmission, mWheel, mTimeouts, mMetrics, mSessions};
 
 		try {
 			co_await session.run();
@@ -92,55 +171,103 @@ struct TcpServer: Server {
 
 struct SslServer: Server {
 
-	using SslContext = asio::ssl::context;
-
-	explicit SslServer(asio::io_context& ctx, const nlohmann::json& config)
-	: Server(ctx)
-	, mSslCtx{SslContext::sslv23}
+	explicit SslServer(asio::io_context& ctx, const nlohmann::json& config, Dispatcher& dispatcher, Admission& admission,
+		TimerWheel& wheel, ThreadMetrics& metrics, SessionSet& sessions, ServerTlsContext& tls)
+	: Server(ctx, config, dispatcher, admission, wheel, metrics, sessions)
+	, mTls{tls}
 	{
+		mTransport = ThreadMetrics::tls;
+
 		try {
 			mPort = config.value("ssl_port", 0);
 
 			if (!mPort) {
 				throw std::runtime_error("[Server]: No open_port specified in config");
 			}
+		} catch (const std::exception& error) {
+			throw std::runtime_error(std::string("[SslServer Construction]: ") + error.what());
+		}
 
-			auto certFile = config.value("cert_file", "");
-
-			if(!certFile.length()) {
-				throw std::runtime_error("[SslContextBuilder]: there is no \"config_file\" field in the config");
-			}
+	}
 
-			auto keyFile = config.value("key_file", "");
+	awaitable<void> handleAccept(tcp::socket socket) {
+		auto started = std::chrono::steady_clock::now();
+		auto sslSocket = co_await handshake(std::move(socket));
 
-			if(!keyFile.length()) {
-				throw std::runtime_error("[SslContextBuilder]: there is no \"key_file\" field in the config");
-			}
+		if (!sslSocket) {
+			co_return;
+		}
 
-			mSslCtx.set_options(SslContext::default_workarounds | SslContext::no_sslv2);
+		mMetrics.handshakes.add();
+		mMetrics.handshakeDuration.observe(std::chrono::steady_clock::now() - started);
 
-			mSslCtx.use_certificate_file(certFile, SslContext::pem);
-			mSslCtx.use_private_key_file(keyFile, SslContext::pem);
-		} catch (const std::exception& error) {
-			throw std::runtime_error(std::string("[SslServer Construction]: ") + error.what());
+		if (SSL_session_reused(sslSocket->native_handle())) {
+			mMetrics.handshakesResumed.add();
 		}
 
-	}
+		auto stream = network::SslStream{std::move(*sslSocket)};
+		stream.setFlushThreshold(mFlushThreshold);
+
+		auto session = Session{std::move(stream), mDispatcher, mAdmission, mWheel, mTimeouts, mMetrics, mSessions};
 
-	awaitable<void> handleAccept(tcp::socket socket) {
-		auto sslSocket = network::SslSocket{std::move(socket), mSslCtx};
 		try {
-	    	co_await sslSocket.async_handshake(asio::ssl::stream_base::server, asio::use_awaitable);
+			co_await session.run();
 		} catch (const std::exception& error) {
-			spdlog::error("{}", error.what());
+			spdlog::error("#{}: {}", session.num(), error.what());
 		}
+	}
 
-		auto session = Session{network::SslStream{std::move(sslSocket)}};
+	// Runs the handshake on the shared handshake pool when one is configured,
+	// so a burst of new connections does not stall the sessions already
+	// served by this io thread; otherwise handshakes happen in place. Either
+	// way the socket is closed if the handshake outlasts its timeout.
+	awaitable<std::optional<network::SslSocket>> handshake(tcp::socket socket) {
+		auto expired = false;
 
 		try {
-			co_await session.run();
+			auto* pool = mTls.handshakePool();
+
+			if (!pool) {
+				auto sslSocket = network::SslSocket{std::move(socket), mTls.context()};
+				auto deadline = TimerWheel::Entry{mWheel, [&] {
+					expired = true;
+					std::error_code ignored;
+					sslSocket.lowest_layer().close(ignored);
+				}};
+
+				armHandshakeDeadline(deadline);
+				co_await sslSocket.async_handshake(asio::ssl::stream_base::server, asio::use_awaitable);
+				co_return std::move(sslSocket);
+			}
+
+			// The socket belongs to the pool thread running the handshake, so
+			// the deadline closes it on the handshake's strand.
+			auto strand = asio::make_strand(*pool);
+			auto offloaded = std::make_shared<OffloadedHandshake>();
+			auto deadline = TimerWheel::Entry{mWheel, [&expired, strand, offloaded] {
+				expired = true;
+				asio::post(strand, [offloaded] { offloaded->expire(); });
+			}};
+
+			armHandshakeDeadline(deadline);
+
+			auto protocol = socket.local_endpoint().protocol();
+			auto handshaken = co_await asio::co_spawn(strand, offloadHandshake(protocol, socket.release(), offloaded),
+				asio::use_awaitable);
+
+			// Back on this io thread: adopt the descriptor and the negotiated
+			// SSL object, which keeps any records it has already read ahead.
+			co_return network::SslSocket{tcp::socket{mAcceptor.get_executor(), protocol, handshaken.fd}, handshaken.ssl};
 		} catch (const std::exception& error) {
-			spdlog::error("#{}: {}", session.num(), error.what());
+			if (expired) {
+				spdlog::info("[SslServer]: Closing after the handshake timeout");
+				mMetrics.timeouts[ThreadMetrics::handshake].add();
+			} else {
+				spdlog::error("[SslServer]: Handshake failed: {}", error.what());
+				mMetrics.handshakeFailures.add();
+			}
+
+			co_return std::nullopt;
 		}
 	}
 
@@ -149,7 +276,77 @@ struct SslServer: Server {
 	}
 
 private:
-	SslContext mSslCtx;
+	struct Handshaken {
+		SSL* ssl;
+		tcp::socket::native_handle_type fd;
+	};
+
+	// An offloaded handshake's socket, shared with its deadline. Both only
+	// touch it on the handshake's strand, and the deadline may come before
+	// the socket exists or after it has been handed back.
+	struct OffloadedHandshake {
+		void expire() {
+			expired = true;
+
+			if (socket) {
+				std::error_code ignored;
+				socket->lowest_layer().close(ignored);
+			}
+		}
+
+		std::optional<network::SslSocket> socket;
+		bool expired = false;
+	};
+
+	void armHandshakeDeadline(TimerWheel::Entry& deadline) {
+		if (mTimeouts.handshake > SessionTimeouts::Seconds::zero()) {
+			deadline.arm(mTimeouts.handshake);
+		}
+	}
+
+	// Runs on a handshake pool thread. Read-ahead with a buffer larger than
+	// asio's BIO pair makes OpenSSL pull every byte the engine has fed it
+	// (e.g. requests pipelined right behind the client Finished) into the SSL
+	// object itself, which is the only state that survives the move back.
+	// Both are turned off again once the handshake is done: what has been
+	// read ahead is still consumed first, and the large buffer is released
+	// with it instead of staying pinned for the life of the connection.
+	awaitable<Handshaken> offloadHandshake(tcp protocol, tcp::socket::native_handle_type fd,
+		std::shared_ptr<OffloadedHandshake> offloaded)
+	{
+		auto& sslSocket = offloaded->socket.emplace(tcp::socket{co_await asio::this_coro::executor, protocol, fd},
+			mTls.context());
+
+		if (offloaded->expired) {
+			throw std::runtime_error("[SslServer]: handshake timed out before it started");
+		}
+
+		auto* ssl = sslSocket.native_handle();
+
+		SSL_set_read_ahead(ssl, 1);
+		SSL_set_default_read_buffer_len(ssl, readAheadBufferSize);
+
+		co_await sslSocket.async_handshake(asio::ssl::stream_base::server, asio::use_awaitable);
+
+		if (BIO_ctrl_pending(SSL_get_rbio(ssl))) {
+			throw std::runtime_error("[SslServer]: unread TLS data left behind after the handshake");
+		}
+
+		SSL_set_read_ahead(ssl, 0);
+		SSL_set_default_read_buffer_len(ssl, 0);
+
+		SSL_up_ref(ssl);
+		auto handshaken = Handshaken{ssl, sslSocket.lowest_layer().release()};
+
+		// Destroyed here, on the strand: the stream's destructor still
+		// touches the SSL object the io thread is about to adopt.
+		offloaded->socket.reset();
+		co_return handshaken;
+	}
+
+	static constexpr size_t readAheadBufferSize = 64 * 1024;
+
+	ServerTlsContext& mTls;
 };
 
 } //namespace bookkeeper
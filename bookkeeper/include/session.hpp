@@ -2,13 +2,80 @@
 
 #include "asio.hpp"
 #include "spdlog/spdlog.h"
+#include "nlohmann/json.hpp"
+
+#include "admission.hpp"
+#include "allocations.hpp"
+#include "dispatcher.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "session_set.hpp"
+#include "timer_wheel.hpp"
 
 #include "network/stream.hpp"
 #include "network/channel.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory_resource>
+#include <optional>
+#include <tuple>
+
 namespace bookkeeper {
 
-static uint32_t sSessionCounter = 0;
+static std::atomic<uint32_t> sSessionCounter = 0;
+
+/*
+ * Deadlines that cut off dead and stalled peers, in seconds, 0 disabling
+ * one:
+ *
+ *   idle       no bytes of a request and no request being handled
+ *   header     from the first byte of a frame to the end of its header
+ *   frame      from the first byte of a frame to its last
+ *   write      a write in flight without completing
+ *   handshake  from accepting a TLS connection to the end of its handshake;
+ *              the header timeout unless set
+ *
+ * A session checks the first four on its io thread's timer wheel every
+ * checkInterval(), the shortest of them, so a peer is cut off at most that
+ * long after its deadline. SslServer arms the handshake deadline on the same
+ * wheel before there is a session.
+ */
+struct SessionTimeouts {
+	using Seconds = std::chrono::seconds;
+
+	explicit SessionTimeouts(const nlohmann::json& config)
+		: idle(config.value("idle_timeout", 0))
+		, header(config.value("header_timeout", 0))
+		, frame(config.value("frame_timeout", 0))
+		, write(config.value("write_timeout", 0))
+		, handshake(config.value("handshake_timeout", config.value("header_timeout", 0)))
+	{}
+
+	Seconds checkInterval() const {
+		auto interval = Seconds::zero();
+
+		for (auto timeout: {idle, header, frame, write}) {
+			if (timeout > Seconds::zero() && (interval == Seconds::zero() || timeout < interval)) {
+				interval = timeout;
+			}
+		}
+
+		return interval;
+	}
+
+	// Whether something that started at `since` has run out of `timeout`.
+	static bool expired(Seconds timeout, TimerWheel::Clock::time_point since, TimerWheel::Clock::time_point now) {
+		return timeout > Seconds::zero() && now - since >= timeout;
+	}
+
+	Seconds idle;
+	Seconds header;
+	Seconds frame;
+	Seconds write;
+	Seconds handshake;
+};
 
 template <typename Stream>
 struct Session {
@@ -17,49 +84,311 @@ struct Session {
 	Session& operator=(const Session& other) = delete;
 	~Session();
 
-	explicit Session(Stream&& stream)
-		: mChannel{std::move(stream)}
+	explicit Session(Stream&& stream, Dispatcher& dispatcher, Admission& admission, TimerWheel& wheel,
+		const SessionTimeouts& timeouts, ThreadMetrics& metrics, SessionSet& sessions)
+		: mArena{arenaOptions()}
+		, mChannel{std::move(stream)}
+		, mDispatcher(dispatcher)
+		, mAdmission(admission)
+		, mMetrics(metrics)
+		, mTimeouts(timeouts)
+		, mWheel(wheel)
+		, mDeadline{wheel, [this] { checkDeadlines(); }}
+		, mMembership{sessions, [this] { stop(); }, [this] { close(); }}
 		, mNum(++sSessionCounter)
+		, mDrained{mChannel.executor()}
+		, mWritable{mChannel.executor(), asio::steady_timer::time_point::max()}
 	{}
 
 	uint32_t num() const { return mNum; }
 	asio::awaitable<void> run();
 
+	// Sends a frame of a streamed reply ahead of its last one, once the
+	// outbound queue has room for it.
+	asio::awaitable<void> sendPartial(network::FrameWriter& frame);
+
 private:
+	static std::pmr::pool_options arenaOptions() {
+		return {.max_blocks_per_chunk = 0, .largest_required_pool_block = largestArenaBlock};
+	}
+
+	static constexpr size_t largestArenaBlock = 16 * 1024;
+
+	asio::awaitable<void> read();
+	asio::awaitable<void> handle(network::PooledFrame request, std::chrono::steady_clock::time_point received);
+	asio::awaitable<void> drain();
+	asio::awaitable<void> waitWritable();
+	void wakeWritable();
+	void checkDeadlines();
+	void stop();
 	void close();
-	uint32_t mNum;
 
+	// Request copies and replies. Blocks are pooled by size within the
+	// session, so the arena grows to the session's peak pipelining depth and
+	// is then reused: a request costs no heap allocation however many are in
+	// flight. Larger frames go straight to the heap. Declared first so that
+	// it outlives everything allocated from it.
+	std::pmr::unsynchronized_pool_resource mArena;
 	network::Channel<Stream> mChannel;
+	Dispatcher& mDispatcher;
+	Admission& mAdmission;
+	ThreadMetrics& mMetrics;
+
+	// Deadline state. Activity is stamped with the wheel's cached time,
+	// which costs nothing to read.
+	const SessionTimeouts& mTimeouts;
+	TimerWheel& mWheel;
+	TimerWheel::Entry mDeadline;
+	TimerWheel::Clock::time_point mLastActivity;
+	bool mReading = false;
+
+	// Shutdown: a stopped session reads no further frames and closes once
+	// its requests have been answered. Cancelling the reader's slot breaks
+	// off a read that is waiting for the next frame.
+	SessionSet::Member mMembership;
+	bool mStopping = false;
+	asio::cancellation_signal mStopReading;
+
+	uint32_t mNum;
+
+	// Requests dispatched to handlers that have not replied yet. The timer
+	// is cancelled whenever the count drops to zero.
+	size_t mInflight = 0;
+	asio::steady_timer mDrained;
+
+	// Coroutines waiting for the outbound queue to drain to the low-water
+	// mark: the reader, paused on a full queue, and streamed replies. The
+	// timer never expires; it is cancelled once a reply finds the queue
+	// drained, which wakes them all.
+	size_t mWritableWaiters = 0;
+	asio::steady_timer mWritable;
 };
 
 template <typename Stream>
 Session<Stream>::~Session() {
-	spdlog::debug("[Session] #{}: Destroying session", mNum);
+	SPDLOG_DEBUG("[Session] #{}: Destroying session", mNum);
 	close();
 }
 
 template <typename Stream>
 asio::awaitable<void> Session<Stream>::run() {
-	std::string isSecure = Stream::isSecure ? "secured" : "open";
-	spdlog::info("[Session] #{}: Started new {} session with {}", mNum, isSecure, mChannel.remoteEndpoint());
+	SPDLOG_DEBUG("[Session] #{}: Started new {} session with {}", mNum, Stream::isSecure ? "secured" : "open",
+		mChannel.remoteEndpoint());
+
+	// Arming first brings an idle wheel's clock up to date.
+	if (auto interval = mTimeouts.checkInterval(); interval > SessionTimeouts::Seconds::zero()) {
+		mDeadline.arm(interval);
+	}
+
+	mLastActivity = mWheel.now();
+
+	// The reader runs as a coroutine of its own, so that stop() can cancel
+	// it without cancelling anything else the session waits for.
+	std::exception_ptr error;
+	mStopping = mStopping || mMembership.stopping();
+
+	if (!mStopping) {
+		std::tie(error) = co_await asio::co_spawn(co_await asio::this_coro::executor, read(),
+			asio::bind_cancellation_slot(mStopReading.slot(), asio::as_tuple(asio::use_awaitable)));
+	}
+
+	// A stopped reader may have ended with the cancellation.
+	if (mStopping) {
+		error = nullptr;
+	}
 
-	while (true) {
-		auto message = co_await mChannel.getMessage();
+	// Handlers refer to this session, so it must outlive all of them.
+	// Their writes are still subject to the write deadline.
+	mReading = false;
+	co_await drain();
 
-		spdlog::info("[Session] #{}: Message from {}: {}", mNum, mChannel.remoteEndpoint(), message);
-		message += " yourself!";
-		co_await mChannel.sendMessage(message);
+	if (error) {
+		mDeadline.cancel();
+		std::rethrow_exception(error);
+	}
+
+	// Every reply has been written: tell the peer the session is over.
+	if (mChannel.isOpen()) {
+		try {
+			co_await mChannel.shutdown();
+		} catch (const std::exception& error) {
+			SPDLOG_DEBUG("[Session] #{}: Shutdown failed: {}", mNum, error.what());
+		}
 	}
 
-	co_await mChannel.shutdown();
-	co_return;
+	mDeadline.cancel();
+	SPDLOG_DEBUG("[Session] #{}: Stopped", mNum);
+}
+
+// Keeps reading while earlier requests are still being handled; replies
+// carry the request id and go out in completion order. Once stopped, frames
+// that are already buffered are still handled.
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::read() {
+	auto executor = co_await asio::this_coro::executor;
+	auto remoteEndpoint = mChannel.remoteEndpoint();
+
+	while (!mStopping || mChannel.frameBuffered()) {
+		// A peer that does not read its replies stops being read from.
+		if (mAdmission.highWaterMark() && mChannel.queuedBytes() > mAdmission.highWaterMark()) {
+			SPDLOG_DEBUG("[Session] #{}: Throttling reads, {} bytes queued", mNum, mChannel.queuedBytes());
+			mMetrics.readThrottles.add();
+			co_await waitWritable();
+		}
+
+		mReading = true;
+		auto frame = co_await mChannel.getFrame();
+		mReading = false;
+		mLastActivity = mWheel.now();
+		auto received = std::chrono::steady_clock::now();
+
+		mMetrics.framesReceived.add();
+		mMetrics.bytesReceived.add(network::FrameHeader::size + frame.payload.size());
+
+		BOOKKEEPER_SAMPLED_DEBUG("[Session] #{}: Message from {}: {}", mNum, remoteEndpoint, frame.payload);
+		allocations::countRequest();
+
+		// The frame stays valid while waiting, since nothing more is read.
+		if (!mAdmission.tryAcquireRequest()) {
+			co_await mAdmission.acquireRequest();
+		}
+
+		++mInflight;
+		asio::co_spawn(executor, handle(network::PooledFrame::copyOf(frame, &mArena), received), asio::detached);
+	}
+}
+
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::handle(network::PooledFrame request,
+	std::chrono::steady_clock::time_point received)
+{
+	try {
+		network::FrameWriter reply{&mArena};
+		co_await mDispatcher.dispatch(request, reply, *this);
+
+		auto size = reply.size();
+		co_await mChannel.sendFrame(reply);
+
+		mMetrics.framesSent.add();
+		mMetrics.bytesSent.add(size);
+		mMetrics.requestDuration[ThreadMetrics::requestTypeIndex(request.type)].observe(
+			std::chrono::steady_clock::now() - received);
+	} catch (const std::exception& error) {
+		spdlog::error("[Session] #{}: Request #{} failed: {}", mNum, request.requestId, error.what());
+		close();
+	}
+
+	mAdmission.releaseRequest();
+	wakeWritable();
+
+	if (--mInflight == 0) {
+		mLastActivity = mWheel.now();
+		mDrained.cancel();
+	}
+}
+
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::drain() {
+	while (mInflight) {
+		mDrained.expires_at(asio::steady_timer::time_point::max());
+		co_await mDrained.async_wait(asio::as_tuple(asio::use_awaitable));
+	}
+}
+
+// A stream waits before every frame rather than being throttled as a whole
+// like single replies, so a peer that reads slowly holds its query back
+// instead of the queue growing by the whole result. Without a high-water
+// mark the window is an empty queue.
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::sendPartial(network::FrameWriter& frame) {
+	co_await waitWritable();
+
+	auto size = frame.size();
+	co_await mChannel.sendFrame(frame);
+
+	mMetrics.framesSent.add();
+	mMetrics.bytesSent.add(size);
+	wakeWritable();
+}
+
+// The write coroutine that owns the queue only returns once it is empty, so
+// some sender always gets to see the queue drained and wake the waiters.
+// Re-arming the timer would cancel the other waiters, so it is never re-armed.
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::waitWritable() {
+	++mWritableWaiters;
+
+	while (mChannel.isOpen() && mChannel.queuedBytes() > mAdmission.lowWaterMark()) {
+		co_await mWritable.async_wait(asio::as_tuple(asio::use_awaitable));
+	}
+
+	--mWritableWaiters;
+}
+
+template <typename Stream>
+void Session<Stream>::wakeWritable() {
+	if (mWritableWaiters && (mChannel.queuedBytes() <= mAdmission.lowWaterMark() || !mChannel.isOpen())) {
+		mWritable.cancel();
+	}
+}
+
+template <typename Stream>
+void Session<Stream>::checkDeadlines() {
+	if (!mChannel.isOpen()) {
+		return;
+	}
+
+	auto now = mWheel.now();
+	std::optional<ThreadMetrics::Timeout> expired;
+
+	// Buffered bytes while reading can only be a partial frame.
+	if (mReading) {
+		auto buffered = mChannel.bufferedBytes();
+
+		if (!buffered) {
+			if (!mInflight && SessionTimeouts::expired(mTimeouts.idle, mLastActivity, now)) {
+				expired = ThreadMetrics::idle;
+			}
+		} else if (buffered < network::FrameHeader::size &&
+			SessionTimeouts::expired(mTimeouts.header, mChannel.frameStarted(), now)) {
+			expired = ThreadMetrics::header;
+		} else if (SessionTimeouts::expired(mTimeouts.frame, mChannel.frameStarted(), now)) {
+			expired = ThreadMetrics::frame;
+		}
+	}
+
+	if (!expired && mChannel.writing() && SessionTimeouts::expired(mTimeouts.write, mChannel.writeProgress(), now)) {
+		expired = ThreadMetrics::write;
+	}
+
+	if (expired) {
+		spdlog::info("[Session] #{}: Closing after the {} timeout", mNum, ThreadMetrics::timeoutNames[*expired]);
+		mMetrics.timeouts[*expired].add();
+		close();
+		return;
+	}
+
+	mDeadline.arm(mTimeouts.checkInterval());
+}
+
+// Lets a frame that has started arriving finish, so that no request is cut
+// in half, but cancels a read that is waiting for the next one.
+template <typename Stream>
+void Session<Stream>::stop() {
+	mStopping = true;
+
+	if (mReading && !mChannel.bufferedBytes()) {
+		SPDLOG_DEBUG("[Session] #{}: Stopping", mNum);
+		mStopReading.emit(asio::cancellation_type::terminal);
+	}
 }
 
 template <typename Stream>
 void Session<Stream>::close() {
 	if (mChannel.isOpen()) {
-		spdlog::debug("[Session] #{}: Closing channel", mNum);
+		SPDLOG_DEBUG("[Session] #{}: Closing channel", mNum);
 		mChannel.close();
+		wakeWritable();
 	}
 }
 
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <functional>
+
+namespace bookkeeper {
+
+/*
+ * The sessions of one io thread, so that shutdown can reach them. Members
+ * are intrusive, like timer wheel entries, so joining and leaving cost a few
+ * pointer writes.
+ *
+ * Like everything else on an io thread, not thread-safe.
+ */
+struct SessionSet {
+	using Clock = std::chrono::steady_clock;
+
+	// How long drain() waits for sessions it had to close outright.
+	static constexpr auto closeGrace = std::chrono::seconds{1};
+
+private:
+	struct Node {
+		Node* prev = nullptr;
+		Node* next = nullptr;
+
+		bool linked() const { return next != nullptr; }
+
+		void unlink() {
+			prev->next = next;
+			next->prev = prev;
+			prev = next = nullptr;
+		}
+
+		void linkBefore(Node& node) {
+			prev = node.prev;
+			next = &node;
+			node.prev->next = this;
+			node.prev = this;
+		}
+	};
+
+public:
+	// A session's membership: `stop` asks it to finish the requests it has
+	// already read and close gracefully, `close` cuts it off.
+	struct Member: private Node {
+		Member() = delete;
+		Member(const Member&) = delete;
+		Member& operator=(const Member&) = delete;
+
+		explicit Member(SessionSet& set, std::function<void()> stop, std::function<void()> close)
+			: mSet(set)
+			, mStop(std::move(stop))
+			, mClose(std::move(close))
+		{
+			linkBefore(mSet.mMembers);
+			++mSet.mCount;
+		}
+
+		~Member() {
+			if (linked()) {
+				unlink();
+				mSet.leave();
+			}
+		}
+
+		// Sessions that start while the set drains must stop by themselves.
+		bool stopping() const { return mSet.mStopping; }
+
+	private:
+		friend struct SessionSet;
+
+		SessionSet& mSet;
+		std::function<void()> mStop;
+		std::function<void()> mClose;
+	};
+
+	SessionSet() = delete;
+	SessionSet(const SessionSet&) = delete;
+	SessionSet& operator=(const SessionSet&) = delete;
+
+	explicit SessionSet(asio::io_context& ctx)
+		: mEmpty{ctx, asio::steady_timer::time_point::max()}
+	{
+		mMembers.prev = mMembers.next = &mMembers;
+	}
+
+	// Members that outlive the set (sessions destroyed with their
+	// io_context) must not touch it.
+	~SessionSet() {
+		while (mMembers.next != &mMembers) {
+			mMembers.next->unlink();
+		}
+	}
+
+	size_t size() const { return mCount; }
+	bool stopping() const { return mStopping; }
+
+	// Stops every session and waits for them to finish until the deadline,
+	// then closes the ones left and gives them a moment to unwind.
+	asio::awaitable<void> drain(Clock::time_point deadline) {
+		mStopping = true;
+
+		if (mCount) {
+			spdlog::info("[SessionSet]: Draining {} sessions", mCount);
+		}
+
+		forEach([](Member& member) { member.mStop(); });
+		co_await waitEmpty(deadline);
+
+		if (mCount) {
+			spdlog::warn("[SessionSet]: Closing {} sessions still open at the deadline", mCount);
+			forEach([](Member& member) { member.mClose(); });
+			co_await waitEmpty(Clock::now() + closeGrace);
+		}
+	}
+
+private:
+	// The callbacks only start asynchronous work, so no member leaves while
+	// the set is walked.
+	void forEach(auto&& callback) {
+		for (auto* node = mMembers.next; node != &mMembers;) {
+			auto* next = node->next;
+			callback(*static_cast<Member*>(node));
+			node = next;
+		}
+	}
+
+	asio::awaitable<void> waitEmpty(Clock::time_point deadline) {
+		while (mCount && Clock::now() < deadline) {
+			mEmpty.expires_at(deadline);
+			co_await mEmpty.async_wait(asio::as_tuple(asio::use_awaitable));
+		}
+	}
+
+	void leave() {
+		if (--mCount == 0 && mStopping) {
+			mEmpty.cancel();
+		}
+	}
+
+	Node mMembers;
+	size_t mCount = 0;
+	bool mStopping = false;
+	asio::steady_timer mEmpty;
+};
+
+} //namespace bookkeeper
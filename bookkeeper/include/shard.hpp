@@ -0,0 +1,1049 @@
+#pragma once
+
+#include "asio.hpp"
+#include "nlohmann/json.hpp"
+
+#include "ledger/ledger.hpp"
+#include "ledger/protocol.hpp"
+
+#include "io_pool.hpp"
+#include "spsc_queue.hpp"
+#include "wal.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace bookkeeper {
+
+struct Shard;
+struct ShardCall;
+struct Shards;
+
+namespace detail {
+
+// An intrusive list link, as in TimerWheel and SessionSet.
+struct ShardLink {
+	ShardLink* prev = nullptr;
+	ShardLink* next = nullptr;
+
+	bool linked() const { return next != nullptr; }
+
+	void unlink() {
+		prev->next = next;
+		next->prev = prev;
+		prev = next = nullptr;
+	}
+
+	void linkBefore(ShardLink& node) {
+		prev = node.prev;
+		next = &node;
+		node.prev->next = this;
+		node.prev = this;
+	}
+};
+
+} //namespace detail
+
+// What one shard asks another to do for a call, or its answer.
+struct ShardMessage {
+	enum class Kind : uint8_t {
+		balance,	// read the balance of legs[0].account
+		post,	// post the whole transaction, every account being the receiver's
+		prepare,	// hold the receiver's accounts and check its legs
+		commit,	// apply the receiver's legs and release them
+		abort,	// release them
+		reply,	// to the coordinator: done
+	};
+
+	Kind kind = Kind::reply;
+	uint32_t from = 0;
+	ShardCall* call = nullptr;
+};
+
+/*
+ * A request's state on the shard that coordinates it. The shards owning its
+ * accounts read the request from it and write their answers into it before
+ * replying, so messages only carry a pointer. It lives in the coordinating
+ * coroutine's frame, which waits for every reply before going on.
+ */
+struct ShardCall {
+	using Handler = asio::any_completion_handler<void()>;
+
+	// The legs of a transaction, or the account of a balance in legs[0],
+	// and the request payload that gets logged.
+	std::span<const ledger::Leg> legs;
+	std::string_view payload;
+
+	// Answers from the shards owning the legs.
+	ledger::Status status = ledger::Status::ok;
+	std::array<ledger::Currency, ledger::PostTransaction::maxLegs> currencies{};
+	ledger::Amount balance = 0;
+	uint64_t transaction = 0;
+	uint64_t lsn = 0;	// set once logged
+
+private:
+	friend struct Shard;
+	friend struct Shards;
+
+	// The lsn too, stored by the log itself: snapshots add the legs that are
+	// logged but not committed yet, reading it from the shards holding them.
+	std::atomic<uint64_t> mLogged = 0;
+
+	struct Link: detail::ShardLink {
+		ShardCall* call = nullptr;
+	};
+
+	// A prepared shard links the hold of the first leg it owns into its list
+	// of held transactions.
+	std::array<Link, ledger::PostTransaction::maxLegs> mHolds;
+
+	// Linked while the call is parked on a shard behind held accounts.
+	Link mWaiting;
+	ShardMessage mParked;
+
+	size_t mReplies = 0;
+	Handler mHandler;
+	asio::any_io_executor mWork;	// keeps the coordinator's io_context running
+};
+
+/*
+ * One io thread's part of the ledger. Accounts are split into a fixed
+ * number of partitions, each owned by one shard, and only the owning shard's
+ * thread touches them, so requests whose accounts are all local run to
+ * completion without a lock or a hop.
+ *
+ * Anything else is sent to the owning shards over lock-free SPSC queues, one
+ * per pair of shards. A sender rings the receiver's doorbell, posting a
+ * poll to its io_context, only when no poll is pending yet, so under load
+ * one post covers a whole batch of messages. A transaction spread over
+ * several shards commits in two phases: each shard in turn holds its
+ * accounts and checks its legs, then all of them apply or drop the legs
+ * once the coordinator has logged the transaction or given up. Writes that
+ * touch a held account wait for it to be released; balance reads do not,
+ * they see the balance as of the last commit.
+ *
+ * Transaction ids and the account count are kept per shard too: a shard
+ * hands out the ids congruent to its index modulo the number of shards, so
+ * no write touches a counter another thread writes.
+ *
+ * Like everything else on an io thread, not thread-safe: other threads only
+ * push onto its queues.
+ */
+struct Shard {
+	static constexpr size_t queueCapacity = 512;
+	static constexpr size_t pollBatch = 256;	// messages per queue before other handlers get a turn
+
+	using Queue = SpscQueue<ShardMessage, queueCapacity>;
+
+	struct Balance {
+		ledger::Status status = ledger::Status::ok;
+		ledger::Amount amount = 0;
+		ledger::Currency currency = 0;
+	};
+
+	struct PostResult {
+		ledger::Status status = ledger::Status::ok;
+		uint64_t transaction = 0;
+		uint64_t lsn = 0;	// 0 when nothing was logged
+	};
+
+	Shard() = delete;
+	Shard(const Shard&) = delete;
+	Shard& operator=(const Shard&) = delete;
+
+	explicit Shard(Shards& shards, size_t index, asio::io_context& ctx);
+
+	size_t index() const { return mIndex; }
+	bool owns(ledger::AccountId account) const;
+
+	// Opens an account in one of this shard's partitions, taking them in
+	// turn, and logs it. Returns the account and the lsn of its record.
+	std::pair<ledger::AccountId, uint64_t> openAccount(ledger::Currency currency, std::string_view payload);
+
+	// The fast path of balance(), for accounts of this shard.
+	std::optional<Balance> tryBalance(ledger::AccountId account) const;
+	asio::awaitable<Balance> balance(ledger::AccountId account);
+
+	// The fast path of post(), for transactions that are invalid as a whole
+	// or whose accounts are all this shard's and not held.
+	std::optional<PostResult> tryPost(std::span<const ledger::Leg> legs, std::string_view payload);
+	asio::awaitable<PostResult> post(std::span<const ledger::Leg> legs, std::string_view payload);
+
+private:
+	friend struct Shards;
+
+	using Link = detail::ShardLink;
+
+	template <typename Send>
+	asio::awaitable<void> exchange(ShardCall& call, size_t replies, Send send);
+
+	// Returns the last transaction id the copy may include.
+	template <typename Image>
+	uint64_t capture(Image& image);
+
+	uint64_t nextTransaction();
+
+	void send(size_t to, ShardMessage message);
+	void notify();
+	void poll();
+	void flush();
+	void handle(const ShardMessage& message);
+	void reply(const ShardMessage& message) { send(message.from, {ShardMessage::Kind::reply, uint32_t(mIndex), message.call}); }
+	void complete(ShardCall& call);
+
+	bool tryForwarded(const ShardMessage& message);
+	bool tryPrepare(const ShardMessage& message);
+	void release(ShardCall& call, bool commit);
+	void park(const ShardMessage& message);
+	void wake();
+
+	// nullopt while one of the accounts is held.
+	std::optional<PostResult> execute(std::span<const ledger::Leg> legs, std::string_view payload);
+
+	Shards& mShards;
+	size_t mIndex;
+	asio::io_context& mCtx;
+
+	std::vector<size_t> mPartitions;
+	size_t mNextPartition = 0;
+
+	uint64_t mLastTransaction = 0;	// the last id this shard handed out
+	std::atomic<uint64_t> mAccounts = 0;	// in its partitions; only its thread writes
+
+	// Indexed by the sending shard; this shard's own slot is empty, since it
+	// handles its own messages in place.
+	std::vector<std::unique_ptr<Queue>> mInbound;
+
+	// Indexed by the receiving shard: messages that found its queue full,
+	// sent on from a posted flush.
+	std::vector<std::deque<ShardMessage>> mBacklog;
+	bool mFlushing = false;
+
+	Link mHeld;	// transactions holding accounts here, by ShardCall::mHolds
+	Link mWaiting;	// parked calls, by ShardCall::mWaiting, oldest first
+
+	alignas(64) std::atomic<bool> mPolling = false;
+};
+
+/*
+ * The partitioned ledger and its shards, one per io thread. Partition p holds
+ * the accounts with ids congruent to p modulo partitionCount, densely
+ * indexed by id / partitionCount, and belongs to shard p modulo the number
+ * of shards. The partition count is fixed, so account ids and snapshots do
+ * not depend on the number of io threads.
+ *
+ * Mutations are logged with the ids they were given, since shards hand ids
+ * out concurrently, and transactions with the time they were posted at, in
+ * microseconds since the Unix epoch, for history queries:
+ *
+ *   openedAccount       | account: u32 | openAccount payload |
+ *   postedTransaction   | transaction: u64 | time: u64 | postTransaction payload |
+ */
+struct Shards {
+	static constexpr size_t partitionCount = 1024;
+
+	// How long capture() waits for every shard to copy its partitions.
+	static constexpr auto pauseTimeout = std::chrono::seconds{2};
+
+	enum class RecordType : uint16_t {
+		openedAccount = 0x101,
+		postedTransaction = 0x103,
+	};
+
+	struct Record {
+		ledger::MessageType type;
+		uint64_t id;
+		std::string_view payload;
+		uint64_t time = 0;	// of transactions, when logged
+	};
+
+	Shards() = delete;
+	Shards(const Shards&) = delete;
+	Shards& operator=(const Shards&) = delete;
+
+	explicit Shards(const nlohmann::json& config, IoPool& pool, Wal& wal)
+		: mPartitions(std::make_unique<Partition[]>(partitionCount))
+		, mWal(wal)
+	{
+		if (pool.size() > partitionCount) {
+			throw std::runtime_error("[Shards]: at most " + std::to_string(partitionCount) + " io threads are supported");
+		}
+
+		auto hint = config.value("ledger_accounts_hint", size_t{0}) / partitionCount;
+
+		for (size_t p = 0; p < partitionCount; ++p) {
+			mPartitions[p].ledger.reserve(hint);
+			mPartitions[p].held.reserve(hint);
+		}
+
+		for (size_t i = 0; i < pool.size(); ++i) {
+			mShards.push_back(std::make_unique<Shard>(*this, i, pool.context(i)));
+		}
+
+		for (auto& shard: mShards) {
+			for (size_t from = 0; from < mShards.size(); ++from) {
+				shard->mInbound.push_back(from == shard->mIndex ? nullptr : std::make_unique<Shard::Queue>());
+			}
+
+			for (size_t p = shard->mIndex; p < partitionCount; p += mShards.size()) {
+				shard->mPartitions.push_back(p);
+			}
+
+			shard->mBacklog.resize(mShards.size());
+		}
+	}
+
+	size_t size() const { return mShards.size(); }
+	Shard& shard(size_t index) { return *mShards[index]; }
+
+	uint64_t accounts() const {
+		uint64_t accounts = 0;
+
+		for (auto& shard: mShards) {
+			accounts += shard->mAccounts.load(std::memory_order_relaxed);
+		}
+
+		return accounts;
+	}
+
+	static size_t partitionOf(ledger::AccountId account) { return account % partitionCount; }
+	static ledger::AccountId localOf(ledger::AccountId account) { return account / partitionCount; }
+
+	static ledger::AccountId accountOf(size_t partition, ledger::AccountId local) {
+		return static_cast<ledger::AccountId>(local * partitionCount + partition);
+	}
+
+	size_t ownerOf(ledger::AccountId account) const { return partitionOf(account) % mShards.size(); }
+
+	// The time transactions are logged with, in microseconds since the Unix
+	// epoch.
+	static uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// Splits a log record into the request it logged and the id it was
+	// given; nullopt for anything else.
+	static std::optional<Record> parse(uint16_t type, std::string_view record) {
+		switch (static_cast<RecordType>(type)) {
+			case RecordType::openedAccount:
+				if (record.size() >= sizeof(ledger::AccountId)) {
+					ledger::AccountId account;
+					std::memcpy(&account, record.data(), sizeof(account));
+					return Record{ledger::MessageType::openAccount, account, record.substr(sizeof(account))};
+				}
+				break;
+			case RecordType::postedTransaction:
+				if (record.size() >= 2 * sizeof(uint64_t)) {
+					uint64_t transaction, time;
+					std::memcpy(&transaction, record.data(), sizeof(transaction));
+					std::memcpy(&time, record.data() + sizeof(transaction), sizeof(time));
+					return Record{ledger::MessageType::postTransaction, transaction, record.substr(2 * sizeof(uint64_t)), time};
+				}
+				break;
+		}
+
+		return std::nullopt;
+	}
+
+	// Startup, before the io threads run: state from a snapshot, with each
+	// partition's columns one after the other and the last log record each
+	// partition includes.
+	void restore(std::span<const uint64_t> accounts, std::span<const uint64_t> lsns,
+		std::span<const ledger::Amount> balances, std::span<const ledger::Currency> currencies, uint64_t lastTransaction)
+	{
+		size_t offset = 0;
+
+		for (size_t p = 0; p < partitionCount; ++p) {
+			auto count = accounts[p];
+			restorePartition(p, balances.subspan(offset, count), currencies.subspan(offset, count));
+			mPartitions[p].lsn = lsns[p];
+			offset += count;
+		}
+
+		mLastTransaction = lastTransaction;
+	}
+
+	// Replays the opening of account `id` logged at `lsn`.
+	ledger::AccountId replayOpen(uint64_t lsn, uint64_t id, ledger::Currency currency) {
+		auto account = static_cast<ledger::AccountId>(id);
+		auto& partition = mPartitions[partitionOf(account)];
+
+		if (lsn <= partition.lsn) {
+			return account;
+		}
+
+		if (localOf(account) != partition.ledger.accounts()) {
+			throw std::runtime_error("[Shards]: account " + std::to_string(account) + " opened out of order");
+		}
+
+		open(partitionOf(account), currency);
+		return account;
+	}
+
+	// Replays the transaction logged at `lsn`, which has no other
+	// transaction in flight to wait for, on the partitions whose snapshot
+	// does not include it yet. A snapshot taken while it was being applied
+	// may include some of its legs already: the others are applied without
+	// the balance check, which can only be made across all of them and which
+	// it passed when it was logged.
+	Shard::PostResult replayPost(uint64_t lsn, uint64_t id, std::span<const ledger::Leg> legs) {
+		auto status = ledger::Ledger::checkLegs(legs);
+		auto whole = true;
+
+		for (size_t i = 0; i < legs.size() && status == ledger::Status::ok; ++i) {
+			if (lsn > mPartitions[partitionOf(legs[i].account)].lsn) {
+				status = ledgerOf(legs[i].account).checkLeg(localOf(legs[i].account), legs[i].amount);
+			} else {
+				whole = false;
+			}
+		}
+
+		if (status == ledger::Status::ok && whole) {
+			status = ledger::Ledger::checkBalanced(legs, [&](size_t i) {
+				return ledgerOf(legs[i].account).currency(localOf(legs[i].account));
+			});
+		}
+
+		if (status != ledger::Status::ok) {
+			return {status};
+		}
+
+		for (auto& leg: legs) {
+			if (lsn > mPartitions[partitionOf(leg.account)].lsn) {
+				ledgerOf(leg.account).apply(localOf(leg.account), leg.amount);
+			}
+		}
+
+		mLastTransaction = std::max(mLastTransaction, id);
+		return {ledger::Status::ok, id, 0};
+	}
+
+	// Copies the ledger into `image`, each shard copying its own partitions
+	// on its io thread between two of its handlers, together with the lsn
+	// of the last log record the copy includes. No thread waits for another:
+	// the partitions of different shards include different records, which
+	// replay tells apart by those lsns. Completes on the caller's executor
+	// once every shard is done, and throws if one is not in time; the image
+	// must not be reused then, as that shard may still write to it. It keeps
+	// its capacity otherwise, so steady-state snapshots do not allocate.
+	template <typename Image>
+	asio::awaitable<void> capture(std::shared_ptr<Image> image) {
+		struct Progress {
+			explicit Progress(const asio::any_io_executor& executor, size_t shards)
+				: remaining(shards)
+				, timer(executor, pauseTimeout)
+			{}
+
+			size_t remaining;
+			uint64_t lastTransaction = 0;
+			asio::steady_timer timer;
+		};
+
+		auto executor = co_await asio::this_coro::executor;
+		auto progress = std::make_shared<Progress>(executor, mShards.size());
+		image->partitions.resize(partitionCount);
+
+		// The completions run on the caller's executor, and none can before
+		// this coroutine waits below.
+		for (auto& shard: mShards) {
+			asio::post(shard->mCtx, [&shard = *shard, image, progress, executor] {
+				auto lastTransaction = shard.capture(*image);
+
+				asio::post(executor, [progress, lastTransaction] {
+					progress->lastTransaction = std::max(progress->lastTransaction, lastTransaction);
+
+					if (!--progress->remaining) {
+						progress->timer.cancel();
+					}
+				});
+			});
+		}
+
+		co_await progress->timer.async_wait(asio::as_tuple(asio::use_awaitable));
+
+		if (progress->remaining) {
+			throw std::runtime_error("[Shards]: io threads did not copy their partitions for a snapshot");
+		}
+
+		image->lsn = image->partitions.front().lsn;
+
+		for (auto& partition: image->partitions) {
+			image->lsn = std::min(image->lsn, partition.lsn);
+		}
+
+		image->lastTransaction = progress->lastTransaction;
+	}
+
+	// The currency of every account by id, 0 for ids not taken yet. Startup
+	// only, before the io threads run and open accounts concurrently.
+	std::vector<ledger::Currency> currencies() const {
+		size_t size = 0;
+
+		for (size_t p = 0; p < partitionCount; ++p) {
+			if (auto count = mPartitions[p].ledger.accounts()) {
+				size = std::max<size_t>(size, accountOf(p, count - 1) + 1);
+			}
+		}
+
+		auto currencies = std::vector<ledger::Currency>(size, 0);
+
+		for (size_t p = 0; p < partitionCount; ++p) {
+			auto partition = mPartitions[p].ledger.currencies();
+
+			for (size_t local = 0; local < partition.size(); ++local) {
+				currencies[accountOf(p, local)] = partition[local];
+			}
+		}
+
+		return currencies;
+	}
+
+private:
+	friend struct Shard;
+
+	struct alignas(64) Partition {
+		ledger::Ledger ledger;
+		std::vector<uint8_t> held;	// by local id, while a transaction holds the account
+		uint64_t lsn = 0;	// the last log record the restored snapshot includes
+	};
+
+	static constexpr size_t maxLoggedPayload = sizeof(uint16_t) +
+		ledger::PostTransaction::maxLegs * (sizeof(ledger::AccountId) + sizeof(ledger::Amount)) +
+		ledger::IdempotencyKey::size;
+
+	ledger::Ledger& ledgerOf(ledger::AccountId account) { return mPartitions[partitionOf(account)].ledger; }
+
+	ledger::AccountId open(size_t partition, ledger::Currency currency) {
+		auto& owner = mPartitions[partition];
+		auto local = owner.ledger.openAccount(currency);
+		owner.held.push_back(0);
+
+		// Only the owning shard's thread opens accounts in a partition.
+		auto& accounts = mShards[partition % mShards.size()]->mAccounts;
+		accounts.store(accounts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return accountOf(partition, local);
+	}
+
+	// Logs `fields`, the ids and times, followed by the request payload,
+	// publishing the lsn as Wal::append() does.
+	template <typename... Fields>
+	uint64_t log(RecordType type, std::string_view payload, std::atomic<uint64_t>* published, Fields... fields) {
+		if (payload.size() > maxLoggedPayload) {
+			throw std::runtime_error("[Shards]: request of " + std::to_string(payload.size()) + " bytes is too large to log");
+		}
+
+		std::array<char, 2 * sizeof(uint64_t) + maxLoggedPayload> record;
+		size_t size = 0;
+		((std::memcpy(record.data() + size, &fields, sizeof(fields)), size += sizeof(fields)), ...);
+		std::memcpy(record.data() + size, payload.data(), payload.size());
+		return mWal.append(static_cast<uint16_t>(type), {record.data(), size + payload.size()}, published);
+	}
+
+	void restorePartition(size_t p, std::span<const ledger::Amount> balances, std::span<const ledger::Currency> currencies) {
+		auto& accounts = mShards[p % mShards.size()]->mAccounts;
+		accounts.store(accounts.load(std::memory_order_relaxed) - mPartitions[p].ledger.accounts() + balances.size(),
+			std::memory_order_relaxed);
+
+		mPartitions[p].ledger.restore(balances, currencies, 0);
+		mPartitions[p].held.assign(balances.size(), 0);
+	}
+
+	std::unique_ptr<Partition[]> mPartitions;
+	std::vector<std::unique_ptr<Shard>> mShards;
+	Wal& mWal;
+
+	// The highest transaction id restored or replayed, which the shards
+	// hand out ids above. Only written before the io threads run.
+	uint64_t mLastTransaction = 0;
+};
+
+inline Shard::Shard(Shards& shards, size_t index, asio::io_context& ctx)
+	: mShards(shards)
+	, mIndex(index)
+	, mCtx(ctx)
+{
+	mHeld.prev = mHeld.next = &mHeld;
+	mWaiting.prev = mWaiting.next = &mWaiting;
+}
+
+inline bool Shard::owns(ledger::AccountId account) const {
+	return mShards.ownerOf(account) == mIndex;
+}
+
+inline std::pair<ledger::AccountId, uint64_t> Shard::openAccount(ledger::Currency currency, std::string_view payload) {
+	auto partition = mPartitions[mNextPartition];
+	mNextPartition = (mNextPartition + 1) % mPartitions.size();
+
+	auto account = mShards.open(partition, currency);
+	return {account, mShards.log(Shards::RecordType::openedAccount, payload, nullptr, account)};
+}
+
+inline std::optional<Shard::Balance> Shard::tryBalance(ledger::AccountId account) const {
+	if (!owns(account)) {
+		return std::nullopt;
+	}
+
+	auto& ledger = mShards.ledgerOf(account);
+	auto local = Shards::localOf(account);
+
+	if (!ledger.exists(local)) {
+		return Balance{ledger::Status::unknownAccount};
+	}
+
+	return Balance{ledger::Status::ok, ledger.balance(local), ledger.currency(local)};
+}
+
+inline asio::awaitable<Shard::Balance> Shard::balance(ledger::AccountId account) {
+	auto leg = ledger::Leg{account, 0};
+	auto call = ShardCall{};
+	call.legs = {&leg, 1};
+
+	co_await exchange(call, 1, [&] {
+		send(mShards.ownerOf(account), {ShardMessage::Kind::balance, uint32_t(mIndex), &call});
+	});
+
+	co_return Balance{call.status, call.balance, call.currencies[0]};
+}
+
+inline std::optional<Shard::PostResult> Shard::tryPost(std::span<const ledger::Leg> legs, std::string_view payload) {
+	if (auto status = ledger::Ledger::checkLegs(legs); status != ledger::Status::ok) {
+		return PostResult{status};
+	}
+
+	for (auto& leg: legs) {
+		if (!owns(leg.account)) {
+			return std::nullopt;
+		}
+	}
+
+	return execute(legs, payload);
+}
+
+// Transactions whose accounts all belong to one shard are sent there whole.
+// The others prepare shard by shard in index order, so that two of them
+// never wait for each other's holds in a cycle.
+inline asio::awaitable<Shard::PostResult> Shard::post(std::span<const ledger::Leg> legs, std::string_view payload) {
+	if (auto status = ledger::Ledger::checkLegs(legs); status != ledger::Status::ok) {
+		co_return PostResult{status};
+	}
+
+	std::array<size_t, ledger::PostTransaction::maxLegs> shards;
+	size_t count = 0;
+
+	for (auto& leg: legs) {
+		shards[count++] = mShards.ownerOf(leg.account);
+	}
+
+	std::sort(shards.begin(), shards.begin() + count);
+	count = std::unique(shards.begin(), shards.begin() + count) - shards.begin();
+
+	auto call = ShardCall{};
+	call.legs = legs;
+	call.payload = payload;
+
+	if (count == 1) {
+		co_await exchange(call, 1, [&] {
+			send(shards[0], {ShardMessage::Kind::post, uint32_t(mIndex), &call});
+		});
+
+		co_return PostResult{call.status, call.transaction, call.lsn};
+	}
+
+	size_t prepared = 0;
+
+	while (prepared < count && call.status == ledger::Status::ok) {
+		co_await exchange(call, 1, [&] {
+			send(shards[prepared], {ShardMessage::Kind::prepare, uint32_t(mIndex), &call});
+		});
+
+		if (call.status == ledger::Status::ok) {
+			++prepared;
+		}
+	}
+
+	if (call.status == ledger::Status::ok) {
+		call.status = ledger::Ledger::checkBalanced(legs, [&](size_t i) { return call.currencies[i]; });
+	}
+
+	if (call.status == ledger::Status::ok) {
+		call.transaction = nextTransaction();
+		call.lsn = mShards.log(Shards::RecordType::postedTransaction, payload, &call.mLogged, call.transaction, Shards::now());
+	}
+
+	// The holds point into this frame, so every shard must be done with
+	// them before it goes.
+	auto kind = call.status == ledger::Status::ok ? ShardMessage::Kind::commit : ShardMessage::Kind::abort;
+
+	co_await exchange(call, prepared, [&] {
+		for (size_t i = 0; i < prepared; ++i) {
+			send(shards[i], {kind, uint32_t(mIndex), &call});
+		}
+	});
+
+	co_return PostResult{call.status, call.transaction, call.lsn};
+}
+
+// Runs `send` once the call is ready for replies, which may come back before
+// it returns when a message is to this shard, and resumes after `replies`.
+template <typename Send>
+asio::awaitable<void> Shard::exchange(ShardCall& call, size_t replies, Send send) {
+	if (!replies) {
+		co_return;
+	}
+
+	co_await asio::async_initiate<const asio::use_awaitable_t<>&, void()>([&](auto handler) {
+		// Moving into a non-empty any_completion_handler recurses in asio
+		// 1.24, see Wal::Waiter.
+		auto wrapped = ShardCall::Handler{std::move(handler)};
+		call.mHandler.swap(wrapped);
+		call.mReplies = replies;
+		call.mWork = asio::prefer(mCtx.get_executor(), asio::execution::outstanding_work.tracked);
+		send();
+	}, asio::use_awaitable);
+}
+
+inline void Shard::complete(ShardCall& call) {
+	if (--call.mReplies) {
+		return;
+	}
+
+	auto handler = ShardCall::Handler{};
+	handler.swap(call.mHandler);
+	call.mWork = {};
+	asio::post(mCtx, std::move(handler));
+}
+
+// Messages to this shard are handled in place.
+inline void Shard::send(size_t to, ShardMessage message) {
+	if (to == mIndex) {
+		handle(message);
+		return;
+	}
+
+	auto& target = mShards.shard(to);
+	auto& backlog = mBacklog[to];
+
+	if (backlog.empty() && target.mInbound[mIndex]->push(message)) {
+		target.notify();
+		return;
+	}
+
+	backlog.push_back(message);
+
+	if (!mFlushing) {
+		mFlushing = true;
+		asio::post(mCtx, [this] { flush(); });
+	}
+}
+
+// The exchanges pair with the one in poll(): either the poll that is pending
+// sees the message, or a new one is posted.
+inline void Shard::notify() {
+	if (!mPolling.exchange(true, std::memory_order_acq_rel)) {
+		asio::post(mCtx, [this] { poll(); });
+	}
+}
+
+inline void Shard::poll() {
+	mPolling.exchange(false, std::memory_order_acq_rel);
+	bool more = false;
+
+	for (auto& queue: mInbound) {
+		if (!queue) {
+			continue;
+		}
+
+		ShardMessage message;
+		size_t handled = 0;
+
+		while (handled < pollBatch && queue->pop(message)) {
+			handle(message);
+			++handled;
+		}
+
+		more = more || handled == pollBatch;
+	}
+
+	if (more) {
+		notify();
+	}
+}
+
+// Only runs when a receiver has fallen a whole queue behind; retries until
+// it catches up.
+inline void Shard::flush() {
+	mFlushing = false;
+
+	for (size_t to = 0; to < mBacklog.size(); ++to) {
+		auto& backlog = mBacklog[to];
+
+		if (backlog.empty()) {
+			continue;
+		}
+
+		auto& target = mShards.shard(to);
+
+		while (!backlog.empty() && target.mInbound[mIndex]->push(backlog.front())) {
+			backlog.pop_front();
+		}
+
+		target.notify();
+
+		if (!backlog.empty() && !mFlushing) {
+			mFlushing = true;
+			asio::post(mCtx, [this] { flush(); });
+		}
+	}
+}
+
+inline void Shard::handle(const ShardMessage& message) {
+	auto& call = *message.call;
+
+	switch (message.kind) {
+		case ShardMessage::Kind::balance: {
+			auto balance = *tryBalance(call.legs[0].account);
+			call.status = balance.status;
+			call.balance = balance.amount;
+			call.currencies[0] = balance.currency;
+			reply(message);
+			break;
+		}
+		case ShardMessage::Kind::post:
+			if (!tryForwarded(message)) {
+				park(message);
+			}
+			break;
+		case ShardMessage::Kind::prepare:
+			if (!tryPrepare(message)) {
+				park(message);
+			}
+			break;
+		case ShardMessage::Kind::commit:
+		case ShardMessage::Kind::abort:
+			release(call, message.kind == ShardMessage::Kind::commit);
+			reply(message);
+			wake();
+			break;
+		case ShardMessage::Kind::reply:
+			complete(call);
+			break;
+	}
+}
+
+inline bool Shard::tryForwarded(const ShardMessage& message) {
+	auto& call = *message.call;
+	auto result = execute(call.legs, call.payload);
+
+	if (!result) {
+		return false;
+	}
+
+	call.status = result->status;
+	call.transaction = result->transaction;
+	call.lsn = result->lsn;
+	reply(message);
+	return true;
+}
+
+// Unknown accounts fail the transaction at once; held ones make it wait,
+// holding nothing meanwhile.
+inline bool Shard::tryPrepare(const ShardMessage& message) {
+	auto& call = *message.call;
+	std::optional<size_t> first;
+
+	for (size_t i = 0; i < call.legs.size(); ++i) {
+		auto account = call.legs[i].account;
+
+		if (!owns(account)) {
+			continue;
+		}
+
+		auto& partition = mShards.mPartitions[Shards::partitionOf(account)];
+		auto local = Shards::localOf(account);
+
+		if (!partition.ledger.exists(local)) {
+			call.status = ledger::Status::unknownAccount;
+			reply(message);
+			return true;
+		}
+
+		if (partition.held[local]) {
+			return false;
+		}
+
+		first = first.value_or(i);
+	}
+
+	for (size_t i = *first; i < call.legs.size(); ++i) {
+		auto& leg = call.legs[i];
+
+		if (!owns(leg.account)) {
+			continue;
+		}
+
+		auto& ledger = mShards.ledgerOf(leg.account);
+		auto local = Shards::localOf(leg.account);
+
+		if (auto status = ledger.checkLeg(local, leg.amount); status != ledger::Status::ok) {
+			call.status = status;
+			reply(message);
+			return true;
+		}
+
+		call.currencies[i] = ledger.currency(local);
+	}
+
+	for (size_t i = *first; i < call.legs.size(); ++i) {
+		if (owns(call.legs[i].account)) {
+			mShards.mPartitions[Shards::partitionOf(call.legs[i].account)].held[Shards::localOf(call.legs[i].account)] = 1;
+		}
+	}
+
+	auto& hold = call.mHolds[*first];
+	hold.call = &call;
+	hold.linkBefore(mHeld);
+
+	reply(message);
+	return true;
+}
+
+inline void Shard::release(ShardCall& call, bool commit) {
+	std::optional<size_t> first;
+
+	for (size_t i = 0; i < call.legs.size(); ++i) {
+		auto& leg = call.legs[i];
+
+		if (!owns(leg.account)) {
+			continue;
+		}
+
+		auto& partition = mShards.mPartitions[Shards::partitionOf(leg.account)];
+		auto local = Shards::localOf(leg.account);
+
+		if (commit) {
+			partition.ledger.apply(local, leg.amount);
+		}
+
+		partition.held[local] = 0;
+		first = first.value_or(i);
+	}
+
+	call.mHolds[*first].unlink();
+}
+
+inline void Shard::park(const ShardMessage& message) {
+	auto& call = *message.call;
+	call.mParked = message;
+	call.mWaiting.call = &call;
+	call.mWaiting.linkBefore(mWaiting);
+}
+
+// Retries the parked calls in the order they came in, after accounts have
+// been released.
+inline void Shard::wake() {
+	for (auto* node = mWaiting.next; node != &mWaiting;) {
+		auto* next = node->next;
+		auto message = static_cast<ShardCall::Link*>(node)->call->mParked;
+		node->unlink();
+
+		auto done = message.kind == ShardMessage::Kind::post ? tryForwarded(message) : tryPrepare(message);
+
+		if (!done) {
+			node->linkBefore(*next);
+		}
+
+		node = next;
+	}
+}
+
+inline std::optional<Shard::PostResult> Shard::execute(std::span<const ledger::Leg> legs, std::string_view payload) {
+	std::array<ledger::Currency, ledger::PostTransaction::maxLegs> currencies;
+
+	for (auto& leg: legs) {
+		auto& partition = mShards.mPartitions[Shards::partitionOf(leg.account)];
+		auto local = Shards::localOf(leg.account);
+
+		if (partition.ledger.exists(local) && partition.held[local]) {
+			return std::nullopt;
+		}
+	}
+
+	for (size_t i = 0; i < legs.size(); ++i) {
+		auto& ledger = mShards.ledgerOf(legs[i].account);
+		auto local = Shards::localOf(legs[i].account);
+
+		if (auto status = ledger.checkLeg(local, legs[i].amount); status != ledger::Status::ok) {
+			return PostResult{status};
+		}
+
+		currencies[i] = ledger.currency(local);
+	}
+
+	if (auto status = ledger::Ledger::checkBalanced(legs, [&](size_t i) { return currencies[i]; }); status != ledger::Status::ok) {
+		return PostResult{status};
+	}
+
+	for (auto& leg: legs) {
+		mShards.ledgerOf(leg.account).apply(Shards::localOf(leg.account), leg.amount);
+	}
+
+	auto transaction = nextTransaction();
+	return PostResult{ledger::Status::ok, transaction,
+		mShards.log(Shards::RecordType::postedTransaction, payload, nullptr, transaction, Shards::now())};
+}
+
+// The next id above every one handed out or replayed that is congruent to
+// this shard's index; with one shard, simply the next one.
+inline uint64_t Shard::nextTransaction() {
+	auto shards = mShards.size();
+	auto last = std::max(mLastTransaction, mShards.mLastTransaction);
+	mLastTransaction = last + 1 + (mIndex + shards - (last + 1) % shards) % shards;
+	return mLastTransaction;
+}
+
+// Runs on this shard's thread, so its own writes are either wholly in the
+// copy or wholly after the lsn taken first. Transactions of other shards
+// are applied here only once logged; the ones logged but still held here
+// are covered by the lsn too, so their legs are added to the copy.
+template <typename Image>
+uint64_t Shard::capture(Image& image) {
+	auto lsn = mShards.mWal.lastLsn();
+
+	for (auto p: mPartitions) {
+		auto& ledger = mShards.mPartitions[p].ledger;
+		auto& copy = image.partitions[p];
+		copy.lsn = lsn;
+		copy.balances.assign(ledger.balances().begin(), ledger.balances().end());
+		copy.currencies.assign(ledger.currencies().begin(), ledger.currencies().end());
+	}
+
+	// Wal::append() publishes the lsn before lastLsn() can return it.
+	for (auto* node = mHeld.next; node != &mHeld; node = node->next) {
+		auto& call = *static_cast<ShardCall::Link*>(node)->call;
+		auto logged = call.mLogged.load(std::memory_order_relaxed);
+
+		if (!logged || logged > lsn) {
+			continue;
+		}
+
+		for (auto& leg: call.legs) {
+			if (owns(leg.account)) {
+				image.partitions[Shards::partitionOf(leg.account)].balances[Shards::localOf(leg.account)] += leg.amount;
+			}
+		}
+	}
+
+	return std::max(mLastTransaction, mShards.mLastTransaction);
+}
+
+} //namespace bookkeeper
@@ -0,0 +1,410 @@
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+#include "nlohmann/json.hpp"
+
+#include "ledger/ledger.hpp"
+
+#include "crc32c.hpp"
+#include "files.hpp"
+#include "shard.hpp"
+#include "wal.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * A snapshot is the ledger partitions' columns written out as they are in
+ * memory, one partition after the other, so loading one is a checksum pass
+ * and two copies per partition out of an mmap:
+ *
+ *   | magic: u64 | version: u32 | crc32c: u32 | lsn: u64 | lastTransaction: u64 |
+ *   | partitions: u64 | accounts: u64[partitions] | lsns: u64[partitions] |
+ *   | balances: i64[total accounts] | currencies: u32[total accounts] |
+ *
+ * Integers are in host (little-endian) order and the checksum covers
+ * everything after it. Each partition is copied on its own io thread, so
+ * `lsns` holds the last log record each one includes, and `lsn` is the
+ * lowest of them; recovery replays the log from the record after it, each
+ * record onto the partitions that do not include it.
+ */
+struct SnapshotImage {
+	static constexpr uint64_t magic = 0x3130504e534b42ull;	// "BKSNP01"
+	static constexpr uint32_t version = 3;
+	static constexpr size_t headerSize = 40;
+
+	struct Partition {
+		uint64_t lsn = 0;
+		std::vector<ledger::Amount> balances;
+		std::vector<ledger::Currency> currencies;
+	};
+
+	uint64_t lsn = 0;
+	uint64_t lastTransaction = 0;
+	std::vector<Partition> partitions;
+
+	uint64_t accounts() const {
+		uint64_t accounts = 0;
+
+		for (auto& partition: partitions) {
+			accounts += partition.balances.size();
+		}
+
+		return accounts;
+	}
+};
+
+/*
+ * Takes snapshots in the background and restores the newest one at startup.
+ *
+ * Each io thread only stops for the copy of its own partitions' columns
+ * (a few milliseconds per million accounts, split among the threads) and
+ * never waits for another; encoding, checksumming and syncing the file
+ * happen on the snapshot thread. A snapshot is made visible
+ * by an atomic rename once the log covers it durably, the two newest are
+ * kept, and log segments are removed only once the older of those covers
+ * them, so a damaged newest snapshot still has a log tail to fall back on.
+ */
+struct Snapshotter {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr size_t keptSnapshots = 2;
+
+	Snapshotter() = delete;
+	Snapshotter(const Snapshotter&) = delete;
+	Snapshotter& operator=(const Snapshotter&) = delete;
+
+	explicit Snapshotter(const nlohmann::json& config, Shards& shards, Wal& wal)
+		: mDirectory(config.value("snapshot_dir", ""))
+		, mInterval(config.value("snapshot_interval", 300))
+		, mRecordThreshold(config.value("snapshot_wal_records", uint64_t{1'000'000}))
+		, mShards(shards)
+		, mWal(wal)
+		, mTimer{mIo}
+	{
+		if (mDirectory.empty()) {
+			throw std::runtime_error("[Snapshotter]: No \"snapshot_dir\" specified in config");
+		}
+
+		std::filesystem::create_directories(mDirectory);
+	}
+
+	~Snapshotter() {
+		stop();
+	}
+
+	// Loads the newest intact snapshot into `shards` and returns its lsn, or
+	// 0 when there is none.
+	uint64_t restore(Shards& shards) {
+		auto snapshots = listSnapshots();
+
+		for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+			try {
+				auto lsn = load(*it, shards);
+				mLastLsn = lsn;
+				return lsn;
+			} catch (const std::exception& error) {
+				spdlog::error("[Snapshotter]: Skipping {}: {}", it->string(), error.what());
+			}
+		}
+
+		return 0;
+	}
+
+	void start() {
+		asio::co_spawn(mIo, run(), asio::detached);
+		mThread = std::thread{[this] { mIo.run(); }};
+	}
+
+	void stop() {
+		asio::post(mIo, [this] {
+			mStopping = true;
+			mTimer.cancel();
+		});
+
+		if (mThread.joinable()) {
+			mThread.join();
+		}
+	}
+
+private:
+	static constexpr auto checkInterval = std::chrono::seconds{1};
+
+	asio::awaitable<void> run() {
+		auto lastSnapshot = Clock::now();
+
+		while (!mStopping) {
+			mTimer.expires_after(checkInterval);
+			co_await mTimer.async_wait(asio::as_tuple(asio::use_awaitable));
+
+			auto pending = mWal.lastLsn() - mLastLsn;
+
+			if (mStopping || !pending || (pending < mRecordThreshold && Clock::now() - lastSnapshot < mInterval)) {
+				continue;
+			}
+
+			try {
+				co_await take();
+				lastSnapshot = Clock::now();
+			} catch (const std::exception& error) {
+				spdlog::error("[Snapshotter]: Snapshot failed: {}", error.what());
+				lastSnapshot = Clock::now();	// retry after a full interval
+			}
+		}
+	}
+
+	asio::awaitable<void> take() {
+		auto start = Clock::now();
+
+		try {
+			co_await mShards.capture(mImage);
+		} catch (...) {
+			// A late io thread may still copy into it.
+			mImage = std::make_shared<SnapshotImage>();
+			throw;
+		}
+
+		auto captured = Clock::now();
+		auto& image = *mImage;
+
+		// Never persist state the log could lose in a crash.
+		co_await mWal.asyncWaitDurable(image.lsn, asio::use_awaitable);
+
+		auto path = snapshotPath(image.lsn);
+		write(path);
+		mLastLsn = image.lsn;
+
+		auto snapshots = listSnapshots();
+
+		for (size_t i = 0; i + keptSnapshots < snapshots.size(); ++i) {
+			std::filesystem::remove(snapshots[i]);
+		}
+
+		if (snapshots.size() >= keptSnapshots) {
+			mWal.removeSegmentsThrough(lsnOf(snapshots[snapshots.size() - keptSnapshots]));
+		}
+
+		spdlog::info("[Snapshotter]: Wrote {} at lsn {} ({} accounts, {:.1f} ms copying, {:.1f} ms total)",
+			path.filename().string(), image.lsn, image.accounts(),
+			std::chrono::duration<double, std::milli>(captured - start).count(),
+			std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+
+	void write(const std::filesystem::path& path) {
+		auto& image = *mImage;
+		auto partitions = static_cast<uint64_t>(image.partitions.size());
+		auto countsSize = partitions * sizeof(uint64_t);
+
+		mCounts.clear();
+		mLsns.clear();
+
+		for (auto& partition: image.partitions) {
+			mCounts.push_back(partition.balances.size());
+			mLsns.push_back(partition.lsn);
+		}
+
+		uint8_t header[SnapshotImage::headerSize];
+		std::memcpy(header, &SnapshotImage::magic, 8);
+		std::memcpy(header + 8, &SnapshotImage::version, 4);
+		std::memcpy(header + 16, &image.lsn, 8);
+		std::memcpy(header + 24, &image.lastTransaction, 8);
+		std::memcpy(header + 32, &partitions, 8);
+
+		auto crc = crc32c(header + 16, SnapshotImage::headerSize - 16);
+		crc = crc32c(mCounts.data(), countsSize, crc);
+		crc = crc32c(mLsns.data(), countsSize, crc);
+
+		for (auto& partition: image.partitions) {
+			crc = crc32c(partition.balances.data(), partition.balances.size() * sizeof(ledger::Amount), crc);
+		}
+
+		for (auto& partition: image.partitions) {
+			crc = crc32c(partition.currencies.data(), partition.currencies.size() * sizeof(ledger::Currency), crc);
+		}
+
+		std::memcpy(header + 12, &crc, 4);
+
+		auto temporary = path;
+		temporary += ".tmp";
+
+		auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category(), "cannot create " + temporary.string());
+		}
+
+		auto error = files::writeAll(fd, header, sizeof(header));
+
+		if (!error) {
+			error = files::writeAll(fd, mCounts.data(), countsSize);
+		}
+
+		if (!error) {
+			error = files::writeAll(fd, mLsns.data(), countsSize);
+		}
+
+		for (size_t p = 0; p < image.partitions.size() && !error; ++p) {
+			auto& balances = image.partitions[p].balances;
+			error = files::writeAll(fd, balances.data(), balances.size() * sizeof(ledger::Amount));
+		}
+
+		for (size_t p = 0; p < image.partitions.size() && !error; ++p) {
+			auto& currencies = image.partitions[p].currencies;
+			error = files::writeAll(fd, currencies.data(), currencies.size() * sizeof(ledger::Currency));
+		}
+
+		if (!error && ::fdatasync(fd) != 0) {
+			error = {errno, std::system_category()};
+		}
+
+		::close(fd);
+
+		if (!error && ::rename(temporary.c_str(), path.c_str()) != 0) {
+			error = {errno, std::system_category()};
+		}
+
+		if (!error) {
+			error = files::syncDirectory(mDirectory);
+		}
+
+		if (error) {
+			std::error_code ignored;
+			std::filesystem::remove(temporary, ignored);
+			throw std::system_error(error, "cannot write " + path.string());
+		}
+	}
+
+	static uint64_t load(const std::filesystem::path& path, Shards& shards) {
+		auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category(), "cannot open");
+		}
+
+		struct stat status;
+		if (::fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < SnapshotImage::headerSize) {
+			::close(fd);
+			throw std::runtime_error("truncated header");
+		}
+
+		auto size = static_cast<size_t>(status.st_size);
+		auto* data = static_cast<const uint8_t*>(::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+		::close(fd);
+
+		if (data == MAP_FAILED) {
+			throw std::system_error(errno, std::system_category(), "cannot map");
+		}
+
+		::madvise(const_cast<uint8_t*>(data), size, MADV_SEQUENTIAL);
+
+		struct Unmap {
+			const uint8_t* data;
+			size_t size;
+			~Unmap() { ::munmap(const_cast<uint8_t*>(data), size); }
+		} unmap{data, size};
+
+		uint64_t magic, lsn, lastTransaction, count;
+		uint32_t version, crc;
+		std::memcpy(&magic, data, 8);
+		std::memcpy(&version, data + 8, 4);
+		std::memcpy(&crc, data + 12, 4);
+		std::memcpy(&lsn, data + 16, 8);
+		std::memcpy(&lastTransaction, data + 24, 8);
+		std::memcpy(&count, data + 32, 8);
+
+		if (magic != SnapshotImage::magic || version != SnapshotImage::version) {
+			throw std::runtime_error("not a snapshot of this version");
+		}
+
+		auto remaining = size - SnapshotImage::headerSize;
+		auto* counts = reinterpret_cast<const uint64_t*>(data + SnapshotImage::headerSize);
+
+		if (count != Shards::partitionCount || remaining / 2 < count * sizeof(uint64_t)) {
+			throw std::runtime_error("partitions do not match");
+		}
+
+		remaining -= 2 * count * sizeof(uint64_t);
+		uint64_t accounts = 0;
+
+		for (size_t p = 0; p < count; ++p) {
+			accounts += std::min<uint64_t>(counts[p], remaining);
+		}
+
+		auto columnBytes = sizeof(ledger::Amount) + sizeof(ledger::Currency);
+
+		if (accounts > remaining / columnBytes || remaining != accounts * columnBytes) {
+			throw std::runtime_error("size does not match its header");
+		}
+
+		if (crc != crc32c(data + 16, size - 16)) {
+			throw std::runtime_error("checksum mismatch");
+		}
+
+		// Every column is naturally aligned: the header and the counts are
+		// multiples of 8 bytes and the mapping starts on a page.
+		auto* balances = reinterpret_cast<const ledger::Amount*>(data + size - remaining);
+		auto* currencies = reinterpret_cast<const ledger::Currency*>(balances + accounts);
+
+		shards.restore({counts, count}, {counts + count, count}, {balances, accounts}, {currencies, accounts}, lastTransaction);
+
+		return lsn;
+	}
+
+	std::filesystem::path snapshotPath(uint64_t lsn) const {
+		return mDirectory / fmt::format("snapshot-{:020}.bin", lsn);
+	}
+
+	static uint64_t lsnOf(const std::filesystem::path& snapshot) {
+		return std::stoull(snapshot.filename().string().substr(9));
+	}
+
+	std::vector<std::filesystem::path> listSnapshots() const {
+		std::vector<std::filesystem::path> snapshots;
+
+		for (auto& entry: std::filesystem::directory_iterator{mDirectory}) {
+			auto name = entry.path().filename().string();
+			if (entry.is_regular_file() && name.starts_with("snapshot-") && name.ends_with(".bin")) {
+				snapshots.push_back(entry.path());
+			}
+		}
+
+		// Zero-padded names sort in lsn order.
+		std::sort(snapshots.begin(), snapshots.end());
+		return snapshots;
+	}
+
+	std::filesystem::path mDirectory;
+	std::chrono::seconds mInterval;
+	uint64_t mRecordThreshold;
+	Shards& mShards;
+	Wal& mWal;
+
+	asio::io_context mIo{1};
+	asio::steady_timer mTimer;
+	std::thread mThread;
+	bool mStopping = false;
+
+	// Snapshot thread state. The image and the tables keep their capacity
+	// between snapshots.
+	uint64_t mLastLsn = 0;
+	std::shared_ptr<SnapshotImage> mImage = std::make_shared<SnapshotImage>();
+	std::vector<uint64_t> mCounts;
+	std::vector<uint64_t> mLsns;
+};
+
+} //namespace bookkeeper
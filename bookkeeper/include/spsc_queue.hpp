@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+
+namespace bookkeeper {
+
+/*
+ * A bounded single-producer single-consumer ring. Each side owns one index
+ * on its own cache line and keeps a cached copy of the other's, so it only
+ * reads the other side's line when the ring looks full or empty: a push or
+ * pop is a slot copy and a release store.
+ */
+template <typename T, size_t capacity>
+struct SpscQueue {
+	static_assert(std::has_single_bit(capacity), "capacity must be a power of two");
+
+	SpscQueue() = default;
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	// Producer side. Returns false if the ring is full.
+	bool push(const T& value) {
+		auto tail = mTail.load(std::memory_order_relaxed);
+
+		if (tail - mHeadCache == capacity) {
+			mHeadCache = mHead.load(std::memory_order_acquire);
+
+			if (tail - mHeadCache == capacity) {
+				return false;
+			}
+		}
+
+		mSlots[tail & (capacity - 1)] = value;
+		mTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side. Returns false if the ring is empty.
+	bool pop(T& value) {
+		auto head = mHead.load(std::memory_order_relaxed);
+
+		if (head == mTailCache) {
+			mTailCache = mTail.load(std::memory_order_acquire);
+
+			if (head == mTailCache) {
+				return false;
+			}
+		}
+
+		value = mSlots[head & (capacity - 1)];
+		mHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	alignas(64) std::atomic<size_t> mHead = 0;
+	size_t mTailCache = 0;
+
+	alignas(64) std::atomic<size_t> mTail = 0;
+	size_t mHeadCache = 0;
+
+	alignas(64) std::array<T, capacity> mSlots{};
+};
+
+} //namespace bookkeeper
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace bookkeeper {
+
+/*
+ * A hashed timing wheel for the coarse deadlines of one io thread's
+ * sessions. Entries are intrusive, so arming, re-arming and cancelling are a
+ * few pointer writes with no allocation, and one steady_timer ticks for all
+ * of them instead of one timer per session and operation. Deadlines are
+ * rounded up to the next tick; ones further out than a full turn of the
+ * wheel stay in their slot until the turn they are due in.
+ *
+ * Like everything else on an io thread, not thread-safe.
+ */
+struct TimerWheel {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr auto tick = std::chrono::milliseconds{100};
+	static constexpr size_t slotCount = 512;
+
+private:
+	struct Node {
+		Node* prev = nullptr;
+		Node* next = nullptr;
+
+		bool linked() const { return next != nullptr; }
+
+		void unlink() {
+			prev->next = next;
+			next->prev = prev;
+			prev = next = nullptr;
+		}
+
+		void linkBefore(Node& node) {
+			prev = node.prev;
+			next = &node;
+			node.prev->next = this;
+			node.prev = this;
+		}
+	};
+
+public:
+	// Runs its callback on the wheel's io thread once the deadline has
+	// passed, unless it is re-armed or cancelled first.
+	struct Entry: private Node {
+		Entry() = delete;
+		Entry(const Entry&) = delete;
+		Entry& operator=(const Entry&) = delete;
+
+		explicit Entry(TimerWheel& wheel, std::function<void()> callback)
+			: mWheel(wheel)
+			, mCallback(std::move(callback))
+		{}
+
+		~Entry() { cancel(); }
+
+		bool armed() const { return linked(); }
+
+		void arm(Clock::duration delay) {
+			cancel();
+			mWheel.schedule(*this, delay);
+		}
+
+		void cancel() {
+			if (linked()) {
+				unlink();
+				--mWheel.mCount;
+			}
+		}
+
+	private:
+		friend struct TimerWheel;
+
+		TimerWheel& mWheel;
+		std::function<void()> mCallback;
+		uint64_t mTick = 0;
+	};
+
+	TimerWheel() = delete;
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	explicit TimerWheel(asio::io_context& ctx)
+		: mTimer{ctx}
+		, mStart{Clock::now()}
+		, mNow{mStart}
+	{
+		for (auto& slot: mSlots) {
+			slot.prev = slot.next = &slot;
+		}
+	}
+
+	// Entries that outlive the wheel (sessions destroyed with their
+	// io_context) must not touch its slots.
+	~TimerWheel() {
+		for (auto& slot: mSlots) {
+			while (slot.next != &slot) {
+				slot.next->unlink();
+			}
+		}
+	}
+
+	// The time of the last tick: free to read, and never more than a tick
+	// behind.
+	Clock::time_point now() const { return mNow; }
+
+	size_t size() const { return mCount; }
+
+private:
+	void schedule(Entry& entry, Clock::duration delay) {
+		// An idle wheel has not been keeping up with the clock.
+		if (!mTicking) {
+			mNow = Clock::now();
+			mCurrentTick = static_cast<uint64_t>((mNow - mStart) / tick);
+		}
+
+		// Round up, so an entry never fires before its deadline.
+		auto ticks = (std::max(delay, Clock::duration::zero()) + tick - Clock::duration{1}) / tick;
+		entry.mTick = mCurrentTick + std::max<uint64_t>(ticks, 1);
+		entry.linkBefore(mSlots[entry.mTick % slotCount]);
+		++mCount;
+
+		if (!mTicking) {
+			mTicking = true;
+			wait();
+		}
+	}
+
+	void wait() {
+		mTimer.expires_at(mStart + (mCurrentTick + 1) * tick);
+		mTimer.async_wait([this](std::error_code error) {
+			if (!error) {
+				advance();
+			}
+		});
+	}
+
+	// Catches up with the clock one slot at a time. Due entries are moved
+	// out of their slot before any callback runs, since callbacks re-arm.
+	void advance() {
+		mNow = Clock::now();
+		auto target = static_cast<uint64_t>((mNow - mStart) / tick);
+
+		while (mCurrentTick < target) {
+			++mCurrentTick;
+
+			auto& slot = mSlots[mCurrentTick % slotCount];
+			Node due;
+			due.prev = due.next = &due;
+
+			for (auto* node = slot.next; node != &slot;) {
+				auto* next = node->next;
+
+				if (static_cast<Entry*>(node)->mTick <= mCurrentTick) {
+					node->unlink();
+					node->linkBefore(due);
+				}
+
+				node = next;
+			}
+
+			while (due.next != &due) {
+				auto& entry = *static_cast<Entry*>(due.next);
+				entry.unlink();
+				--mCount;
+				entry.mCallback();
+			}
+		}
+
+		if (mCount) {
+			wait();
+		} else {
+			mTicking = false;
+		}
+	}
+
+	asio::steady_timer mTimer;
+	Clock::time_point mStart;
+	Clock::time_point mNow;
+	uint64_t mCurrentTick = 0;
+	size_t mCount = 0;
+	bool mTicking = false;
+	std::array<Node, slotCount> mSlots;
+};
+
+} //namespace bookkeeper
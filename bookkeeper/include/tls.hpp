@@ -0,0 +1,220 @@
+
+#pragma once
+
+#include "asio.hpp"
+#include "asio/ssl.hpp"
+
+#include "spdlog/spdlog.h"
+#include "nlohmann/json.hpp"
+
+#include "metrics.hpp"
+
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+namespace bookkeeper {
+
+// Periodically logs how many TLS handshakes were resumed from a cached
+// session or ticket rather than paying for a full key exchange.
+inline asio::awaitable<void> reportTlsStats(const Metrics& metrics, std::chrono::seconds interval) {
+	auto timer = asio::steady_timer{co_await asio::this_coro::executor};
+	uint64_t reported = 0;
+
+	while (true) {
+		timer.expires_after(interval);
+		co_await timer.async_wait(asio::use_awaitable);
+
+		auto handshakes = metrics.sum([](auto& thread) -> auto& { return thread.handshakes; });
+
+		if (handshakes != reported) {
+			reported = handshakes;
+			auto resumed = metrics.sum([](auto& thread) -> auto& { return thread.handshakesResumed; });
+			spdlog::info("[Tls]: {} handshakes, {} resumed ({:.1f}% hit rate)",
+				handshakes, resumed, 100.0 * static_cast<double>(resumed) / static_cast<double>(handshakes));
+		}
+	}
+}
+
+/*
+ * Session ticket keys. New tickets are always sealed with the current key;
+ * the previous one is kept for decryption only, so tickets stay valid for
+ * one more rotation period and clients holding them are handed a fresh one.
+ */
+struct TicketKeyRing {
+	using Clock = std::chrono::steady_clock;
+
+	struct Key {
+		std::array<unsigned char, 16> name;
+		std::array<unsigned char, 32> aesKey;
+		std::array<unsigned char, 32> hmacKey;
+		Clock::time_point created;
+	};
+
+	explicit TicketKeyRing(std::chrono::seconds rotation)
+		: mRotation(rotation)
+	{
+		mCurrent = generate();
+		mPrevious = generate();
+	}
+
+	// The OpenSSL ticket callback: 1 = key found, 2 = found but renew the
+	// ticket, 0 = unknown key (full handshake), -1 = error.
+	int handle(unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt) {
+		auto lock = std::lock_guard{mMutex};
+
+		if (encrypt) {
+			if (Clock::now() - mCurrent.created >= mRotation) {
+				mPrevious = mCurrent;
+				mCurrent = generate();
+				spdlog::info("[TicketKeyRing]: Rotated session ticket key");
+			}
+
+			if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+				return -1;
+			}
+
+			std::memcpy(name, mCurrent.name.data(), mCurrent.name.size());
+			return init(mCurrent, iv, cipher, mac, true) ? 1 : -1;
+		}
+
+		for (auto* key: {&mCurrent, &mPrevious}) {
+			if (std::memcmp(name, key->name.data(), key->name.size()) == 0) {
+				if (!init(*key, iv, cipher, mac, false)) {
+					return -1;
+				}
+
+				return key == &mCurrent ? 1 : 2;
+			}
+		}
+
+		return 0;
+	}
+
+private:
+	static Key generate() {
+		auto key = Key{};
+
+		if (RAND_bytes(key.name.data(), key.name.size()) != 1 ||
+			RAND_bytes(key.aesKey.data(), key.aesKey.size()) != 1 ||
+			RAND_bytes(key.hmacKey.data(), key.hmacKey.size()) != 1) {
+			throw std::runtime_error("[TicketKeyRing]: RAND_bytes failed");
+		}
+
+		key.created = Clock::now();
+		return key;
+	}
+
+	static bool init(Key& key, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, bool encrypt) {
+		char digest[] = "SHA256";
+		OSSL_PARAM params[] = {
+			OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmacKey.data(), key.hmacKey.size()),
+			OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+			OSSL_PARAM_construct_end()
+		};
+
+		if (EVP_MAC_CTX_set_params(mac, params) != 1) {
+			return false;
+		}
+
+		return encrypt
+			? EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey.data(), iv) == 1
+			: EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey.data(), iv) == 1;
+	}
+
+	std::mutex mMutex;
+	std::chrono::seconds mRotation;
+	Key mCurrent;
+	Key mPrevious;
+};
+
+/*
+ * The server-side SSL context shared by the SslServers of all io threads, so
+ * that the session cache and ticket keys are common to every acceptor: a
+ * client resumes no matter which thread the kernel hands it to.
+ */
+struct ServerTlsContext {
+	using SslContext = asio::ssl::context;
+
+	ServerTlsContext() = delete;
+	ServerTlsContext(const ServerTlsContext&) = delete;
+	ServerTlsContext& operator=(const ServerTlsContext&) = delete;
+
+	explicit ServerTlsContext(const nlohmann::json& config)
+		: mSslCtx{SslContext::sslv23}
+		, mTicketKeys{std::chrono::seconds{config.value("tls_ticket_rotation", 3600)}}
+	{
+		if (auto threads = config.value("handshake_threads", 0u)) {
+			mHandshakePool = std::make_unique<asio::thread_pool>(threads);
+		}
+
+		try {
+			auto certFile = config.value("cert_file", "");
+
+			if(!certFile.length()) {
+				throw std::runtime_error("[SslContextBuilder]: there is no \"config_file\" field in the config");
+			}
+
+			auto keyFile = config.value("key_file", "");
+
+			if(!keyFile.length()) {
+				throw std::runtime_error("[SslContextBuilder]: there is no \"key_file\" field in the config");
+			}
+
+			mSslCtx.set_options(SslContext::default_workarounds | SslContext::no_sslv2);
+
+			mSslCtx.use_certificate_file(certFile, SslContext::pem);
+			mSslCtx.use_private_key_file(keyFile, SslContext::pem);
+
+			auto* handle = mSslCtx.native_handle();
+			static const unsigned char sessionIdContext[] = "bookkeeper";
+
+			SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(handle, config.value("tls_session_cache_size", 20480));
+			SSL_CTX_set_timeout(handle, config.value("tls_session_timeout", 7200));
+			SSL_CTX_set_session_id_context(handle, sessionIdContext, sizeof(sessionIdContext) - 1);
+
+			// An idle connection keeps no read or write buffer: OpenSSL frees
+			// them once drained and takes new ones when the next record comes.
+			SSL_CTX_set_mode(handle, SSL_MODE_RELEASE_BUFFERS);
+
+			SSL_CTX_set_ex_data(handle, exDataIndex(), this);
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(handle, &ServerTlsContext::onTicketKey);
+		} catch (const std::exception& error) {
+			throw std::runtime_error(std::string("[ServerTlsContext Construction]: ") + error.what());
+		}
+	}
+
+	SslContext& context() { return mSslCtx; }
+
+	// Threads dedicated to TLS handshakes, or null to handshake in place.
+	asio::thread_pool* handshakePool() { return mHandshakePool.get(); }
+
+private:
+	// asio keeps its verify callback in the context's app data slot, so the
+	// back pointer needs an ex_data index of its own.
+	static int exDataIndex() {
+		static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	static int onTicketKey(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher,
+		EVP_MAC_CTX* mac, int encrypt)
+	{
+		auto* self = static_cast<ServerTlsContext*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), exDataIndex()));
+		return self->mTicketKeys.handle(name, iv, cipher, mac, encrypt);
+	}
+
+	SslContext mSslCtx;
+	TicketKeyRing mTicketKeys;
+	std::unique_ptr<asio::thread_pool> mHandshakePool;
+};
+
+} //namespace bookkeeper
@@ -0,0 +1,704 @@
+#pragma once
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+#include "nlohmann/json.hpp"
+
+#include "crc32c.hpp"
+#include "files.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace bookkeeper {
+
+/*
+ * Segmented write-ahead log with group commit. The io threads append records
+ * to a pending buffer under a short lock and get back a log sequence number
+ * (lsn); a single flusher coroutine on the log's own thread swaps that buffer
+ * out and makes the whole group durable with one write and one fdatasync,
+ * then completes every waiter whose lsn it covered. While one group is being
+ * synced the next one accumulates, so the sync rate, not the request rate,
+ * bounds the number of fdatasync calls.
+ *
+ * Record layout (all integers little-endian), the checksum covering
+ * everything after it:
+ *
+ *   | length: u32 | crc32c: u32 | lsn: u64 | type: u16 | payload: length bytes |
+ *
+ * Segments are named after the first lsn they hold and a new one is started
+ * once the current one exceeds "wal_segment_size". Lsns are contiguous across
+ * segments, which lets recovery tell a torn tail from a lost segment. With
+ * "wal_retain_segments" set, segments stay after snapshots cover them, as
+ * an archive of every request.
+ */
+struct Wal {
+	using WaitHandler = asio::any_completion_handler<void(std::error_code)>;
+	using ReplayHandler = std::function<void(uint64_t lsn, uint16_t type, std::string_view payload)>;
+
+	static constexpr size_t headerSize = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint16_t);
+	static constexpr size_t maxPayloadSize = 16 * 1024 * 1024;
+
+	Wal() = delete;
+	Wal(const Wal&) = delete;
+	Wal& operator=(const Wal&) = delete;
+
+	explicit Wal(const nlohmann::json& config)
+		: mDirectory(config.value("wal_dir", ""))
+		, mSegmentLimit(config.value("wal_segment_size", size_t{64} << 20))
+		, mRetainSegments(config.value("wal_retain_segments", false))
+		, mSignal{mIo}
+	{
+		if (mDirectory.empty()) {
+			throw std::runtime_error("[Wal]: No \"wal_dir\" specified in config");
+		}
+
+		std::filesystem::create_directories(mDirectory);
+	}
+
+	~Wal() {
+		stop();
+
+		if (mFd >= 0) {
+			::close(mFd);
+		}
+	}
+
+	// Replays every intact record with an lsn above `after` (the lsn a
+	// snapshot was taken at, or 0) in log order and truncates the last
+	// segment at its first torn or corrupt record. Must be called before
+	// start(); returns the last lsn found.
+	uint64_t recover(uint64_t after, const ReplayHandler& replay) {
+		auto segments = listSegments();
+
+		if (!segments.empty() && firstLsnOf(segments.front()) > after + 1) {
+			throw std::runtime_error("[Wal]: log starts at lsn " + std::to_string(firstLsnOf(segments.front())) +
+				", records after lsn " + std::to_string(after) + " are missing");
+		}
+
+		mLastLsn = 0;
+
+		for (size_t i = 0; i < segments.size(); ++i) {
+			// Segments wholly covered by the snapshot are not even read.
+			if (i + 1 < segments.size() && firstLsnOf(segments[i + 1]) <= after + 1) {
+				mLastLsn = firstLsnOf(segments[i + 1]) - 1;
+				continue;
+			}
+
+			auto valid = replaySegment(segments[i], after, replay);
+			auto size = std::filesystem::file_size(segments[i]);
+
+			if (valid == size) {
+				continue;
+			}
+
+			if (i + 1 != segments.size()) {
+				throw std::runtime_error("[Wal]: corrupt record in " + segments[i].string() + " before the last segment");
+			}
+
+			spdlog::warn("[Wal]: Truncating torn tail of {} at offset {} ({} bytes dropped)",
+				segments[i].string(), valid, size - valid);
+			std::filesystem::resize_file(segments[i], valid);
+		}
+
+		// Everything up to `after` is covered by the snapshot even if the
+		// segments holding it are gone.
+		mLastLsn = std::max(mLastLsn, after);
+		mDurable = mLastLsn;
+		return mLastLsn;
+	}
+
+	// Removes the segments whose records all have an lsn of at most `lsn`,
+	// once a snapshot covering them is durable, unless they are retained.
+	// The open segment is kept.
+	void removeSegmentsThrough(uint64_t lsn) {
+		if (mRetainSegments) {
+			return;
+		}
+
+		lsn = std::min(lsn, mRetainAfter.load(std::memory_order_acquire));
+		auto segments = listSegments();
+
+		for (size_t i = 0; i + 1 < segments.size() && firstLsnOf(segments[i + 1]) <= lsn + 1; ++i) {
+			std::error_code error;
+			std::filesystem::remove(segments[i], error);
+
+			if (error) {
+				spdlog::warn("[Wal]: Cannot remove {}: {}", segments[i].string(), error.message());
+				return;
+			}
+
+			SPDLOG_DEBUG("[Wal]: Removed segment {}", segments[i].string());
+		}
+	}
+
+	// Keeps the segments holding records after `lsn` however far snapshots
+	// get, for a consumer of the log that has made only the records through
+	// `lsn` durable on its own.
+	void retainAfter(uint64_t lsn) {
+		mRetainAfter.store(lsn, std::memory_order_release);
+	}
+
+	uint64_t lastLsn() const {
+		auto lock = std::lock_guard{mMutex};
+		return mLastLsn;
+	}
+
+	// Opens a fresh segment and starts the flusher thread.
+	void start() {
+		openSegment(mLastLsn + 1);
+		mPending.reserve(initialBufferSize);
+		mWriting.reserve(initialBufferSize);
+
+		asio::co_spawn(mIo, flush(), [](std::exception_ptr error) {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		});
+
+		mThread = std::thread{[this] { mIo.run(); }};
+	}
+
+	// Makes everything appended so far durable and stops the flusher.
+	void stop() {
+		{
+			auto lock = std::lock_guard{mMutex};
+			mStopping = true;
+			wakeFlusher();
+		}
+
+		if (mThread.joinable()) {
+			mThread.join();
+		}
+	}
+
+	// Adds a record to the pending group and returns its lsn. Records are
+	// logged in the order of the append calls, so callers that need the log
+	// to follow the order of their own state changes append under the same
+	// lock that guards those changes. The lsn is also stored in `published`,
+	// if given, before the lock is released: a thread that calls lastLsn()
+	// afterwards finds it there if it is at most what that returned.
+	uint64_t append(uint16_t type, std::string_view payload, std::atomic<uint64_t>* published = nullptr) {
+		if (payload.size() > maxPayloadSize) {
+			throw std::runtime_error("[Wal]: record of " + std::to_string(payload.size()) + " bytes is too large");
+		}
+
+		auto lock = std::lock_guard{mMutex};
+		auto lsn = ++mLastLsn;
+
+		if (published) {
+			published->store(lsn, std::memory_order_relaxed);
+		}
+
+		if (mError) {
+			return lsn;	// its wait fails with mError
+		}
+
+		auto offset = mPending.size();
+		mPending.resize(offset + headerSize + payload.size());
+		auto* record = mPending.data() + offset;
+
+		storeLe(record, static_cast<uint32_t>(payload.size()));
+		storeLe(record + 8, lsn);
+		storeLe(record + 16, type);
+		std::memcpy(record + headerSize, payload.data(), payload.size());
+		storeLe(record + 4, crc32c(record + 8, headerSize - 8 + payload.size()));
+
+		wakeFlusher();
+		return lsn;
+	}
+
+	// Completes on the caller's executor once the record with `lsn` is on
+	// disk, or with the error that stopped the log.
+	template <typename CompletionToken>
+	auto asyncWaitDurable(uint64_t lsn, CompletionToken&& token) {
+		return asio::async_initiate<CompletionToken, void(std::error_code)>([this, lsn](auto handler) {
+			auto lock = std::unique_lock{mMutex};
+
+			auto executor = asio::prefer(asio::get_associated_executor(handler, mIo.get_executor()),
+				asio::execution::outstanding_work.tracked);
+
+			if (lsn > mDurable && !mError) {
+				mWaiters.push_back(Waiter{lsn, std::move(executor), WaitHandler{std::move(handler)}});
+				return;
+			}
+
+			auto error = mError;
+			lock.unlock();
+			asio::post(executor, asio::append(std::move(handler), error));
+		}, token);
+	}
+
+	uint64_t durableLsn() const {
+		auto lock = std::lock_guard{mMutex};
+		return mDurable;
+	}
+
+private:
+	friend struct WalReader;
+
+	static constexpr size_t initialBufferSize = 1024 * 1024;
+
+	struct Waiter {
+		Waiter(uint64_t lsn, asio::any_io_executor executor, WaitHandler handler)
+			: lsn(lsn)
+			, executor(std::move(executor))
+			, handler(std::move(handler))
+		{}
+
+		Waiter(Waiter&&) noexcept = default;
+
+		// The move assignment of asio 1.24's any_completion_handler copies
+		// through its converting constructor and recurses; reset and swap.
+		Waiter& operator=(Waiter&& other) noexcept {
+			lsn = other.lsn;
+			executor = std::move(other.executor);
+			handler = nullptr;
+			handler.swap(other.handler);
+			return *this;
+		}
+
+		uint64_t lsn;
+		asio::any_io_executor executor;	// keeps the waiter's io_context running
+		WaitHandler handler;
+	};
+
+	asio::awaitable<void> flush() {
+		while (true) {
+			uint64_t groupLsn = 0;
+
+			{
+				auto lock = std::lock_guard{mMutex};
+
+				if (mPending.empty()) {
+					if (mStopping) {
+						break;
+					}
+					mIdle = true;
+				} else {
+					mWriting.swap(mPending);
+					groupLsn = mLastLsn;
+				}
+			}
+
+			if (mWriting.empty()) {
+				mSignal.expires_at(asio::steady_timer::time_point::max());
+				co_await mSignal.async_wait(asio::as_tuple(asio::use_awaitable));
+				continue;
+			}
+
+			auto error = writeGroup();
+
+			if (!error && mSegmentSize >= mSegmentLimit) {
+				error = rotate(groupLsn + 1);
+			}
+
+			complete(groupLsn, error);
+			mWriting.clear();
+
+			if (error) {
+				spdlog::critical("[Wal]: Stopped logging: {}", error.message());
+				break;
+			}
+		}
+	}
+
+	// Completes the waiters covered by a group that ended at `groupLsn`, or
+	// all of them once the log has failed.
+	void complete(uint64_t groupLsn, std::error_code error) {
+		{
+			auto lock = std::lock_guard{mMutex};
+
+			if (error) {
+				mError = error;
+				mStopping = true;
+			} else {
+				mDurable = groupLsn;
+			}
+
+			// Completion order does not matter (replies carry their request
+			// id), and unlike stable_partition this needs no scratch buffer.
+			auto done = std::partition(mWaiters.begin(), mWaiters.end(),
+				[this](const Waiter& waiter) { return waiter.lsn > mDurable && !mError; });
+			std::move(done, mWaiters.end(), std::back_inserter(mCompleted));
+			mWaiters.erase(done, mWaiters.end());
+		}
+
+		for (auto& waiter: mCompleted) {
+			asio::post(waiter.executor, [handler = std::move(waiter.handler), error]() mutable {
+				std::move(handler)(error);
+			});
+		}
+
+		mCompleted.clear();
+	}
+
+	std::error_code rotate(uint64_t firstLsn) {
+		::close(mFd);
+		mFd = -1;
+
+		try {
+			openSegment(firstLsn);
+		} catch (const std::system_error& error) {
+			return error.code();
+		}
+
+		return {};
+	}
+
+	std::error_code writeGroup() {
+		if (auto error = files::writeAll(mFd, mWriting.data(), mWriting.size())) {
+			return error;
+		}
+
+		mSegmentSize += mWriting.size();
+
+		if (::fdatasync(mFd) != 0) {
+			return {errno, std::system_category()};
+		}
+
+		return {};
+	}
+
+	void openSegment(uint64_t firstLsn) {
+		auto path = segmentPath(firstLsn);
+
+		// A segment of the same name can only exist if recovery found no
+		// intact record in it.
+		mFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+		if (mFd < 0) {
+			throw std::system_error(errno, std::system_category(), "[Wal]: cannot open " + path.string());
+		}
+
+		mSegmentSize = 0;
+
+		if (auto error = files::syncDirectory(mDirectory)) {
+			throw std::system_error(error, "[Wal]: cannot sync " + mDirectory.string());
+		}
+
+		SPDLOG_DEBUG("[Wal]: Started segment {}", path.string());
+	}
+
+	std::filesystem::path segmentPath(uint64_t firstLsn) const {
+		return mDirectory / fmt::format("wal-{:020}.log", firstLsn);
+	}
+
+	static uint64_t firstLsnOf(const std::filesystem::path& segment) {
+		return std::stoull(segment.filename().string().substr(4));
+	}
+
+	std::vector<std::filesystem::path> listSegments() const {
+		std::vector<std::filesystem::path> segments;
+
+		for (auto& entry: std::filesystem::directory_iterator{mDirectory}) {
+			auto name = entry.path().filename().string();
+			if (entry.is_regular_file() && name.starts_with("wal-") && name.ends_with(".log")) {
+				segments.push_back(entry.path());
+			}
+		}
+
+		// Zero-padded names sort in lsn order.
+		std::sort(segments.begin(), segments.end());
+		return segments;
+	}
+
+	// Returns the length of the intact prefix of the segment.
+	size_t replaySegment(const std::filesystem::path& path, uint64_t after, const ReplayHandler& replay) {
+		auto file = std::ifstream{path, std::ios::binary};
+		auto data = std::string{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+		auto* bytes = reinterpret_cast<const uint8_t*>(data.data());
+		size_t offset = 0;
+
+		while (data.size() - offset >= headerSize) {
+			auto* record = bytes + offset;
+			auto length = loadLe<uint32_t>(record);
+			auto lsn = loadLe<uint64_t>(record + 8);
+
+			if (length > maxPayloadSize || data.size() - offset - headerSize < length ||
+				loadLe<uint32_t>(record + 4) != crc32c(record + 8, headerSize - 8 + length) ||
+				(mLastLsn && lsn != mLastLsn + 1)) {
+				break;
+			}
+
+			if (lsn > after) {
+				replay(lsn, loadLe<uint16_t>(record + 16), std::string_view{data.data() + offset + headerSize, length});
+			}
+
+			mLastLsn = lsn;
+			offset += headerSize + length;
+		}
+
+		return offset;
+	}
+
+	template <typename T>
+	static void storeLe(uint8_t* out, T value) {
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			out[i] = static_cast<uint8_t>(value >> (8 * i));
+		}
+	}
+
+	template <typename T>
+	static T loadLe(const uint8_t* in) {
+		T value = 0;
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			value |= static_cast<T>(in[i]) << (8 * i);
+		}
+		return value;
+	}
+
+	// Must be called with mMutex held.
+	void wakeFlusher() {
+		if (mIdle) {
+			mIdle = false;
+			asio::post(mIo, [this] { mSignal.cancel(); });
+		}
+	}
+
+	std::filesystem::path mDirectory;
+	size_t mSegmentLimit;
+	bool mRetainSegments;
+	std::atomic<uint64_t> mRetainAfter = std::numeric_limits<uint64_t>::max();
+
+	asio::io_context mIo{1};
+	asio::steady_timer mSignal;
+	std::thread mThread;
+
+	// Flusher state.
+	int mFd = -1;
+	size_t mSegmentSize = 0;
+	std::vector<uint8_t> mWriting;
+	std::vector<Waiter> mCompleted;
+
+	mutable std::mutex mMutex;
+	std::vector<uint8_t> mPending;
+	std::vector<Waiter> mWaiters;
+	uint64_t mLastLsn = 0;
+	uint64_t mDurable = 0;
+	std::error_code mError;
+	bool mIdle = false;
+	bool mStopping = false;
+};
+
+/*
+ * Reads the durable records of a running log in lsn order, for consumers
+ * of it like the posting index. Segments are read a chunk at a time with
+ * pread on a descriptor of the reader's own, so a reader holds one chunk
+ * (or one record, if larger) however long the log, and reading the segment
+ * being written is safe: the reader stops at the durable lsn, and resumes
+ * from there on the next call once more has been synced. Reading blocks on
+ * the file, so it is done off the io threads.
+ */
+struct WalReader {
+	static constexpr size_t chunkSize = 256 * 1024;
+
+	struct Record {
+		uint64_t lsn;
+		uint16_t type;
+		std::string_view payload;	// valid until the next call to next()
+	};
+
+	WalReader() = delete;
+	WalReader(const WalReader&) = delete;
+	WalReader& operator=(const WalReader&) = delete;
+
+	// Starts after `after`, or at the oldest record still on disk if that
+	// one has been removed.
+	explicit WalReader(const Wal& wal, uint64_t after)
+		: mWal(wal)
+		, mLsn(after)
+	{}
+
+	~WalReader() {
+		if (mFd >= 0) {
+			::close(mFd);
+		}
+	}
+
+	// The next durable record, or nullopt if there is none yet.
+	std::optional<Record> next() {
+		while (true) {
+			if (mFd < 0 && !openSegment()) {
+				return std::nullopt;
+			}
+
+			if (auto record = parse()) {
+				if (record->lsn <= mLsn) {
+					continue;
+				}
+
+				mLsn = record->lsn;
+				return record;
+			}
+
+			if (mStalled) {
+				return std::nullopt;
+			}
+
+			if (!fill()) {
+				// The segment is complete once a later one exists, and one
+				// does once a record this one lacks is durable: there is no
+				// need to look before.
+				if (mWal.durableLsn() <= mLsn || !openSegment()) {
+					return std::nullopt;
+				}
+			}
+		}
+	}
+
+	// The lsn of the last record returned, or the one it started after.
+	uint64_t lsn() const { return mLsn; }
+
+private:
+	// Cuts the next record from the buffer: nullopt when it is incomplete,
+	// and, with mStalled set, when it is not durable yet.
+	std::optional<Record> parse() {
+		mStalled = false;
+		auto* bytes = reinterpret_cast<const uint8_t*>(mBuffer.data() + mBegin);
+		auto available = mEnd - mBegin;
+
+		if (available < Wal::headerSize) {
+			return std::nullopt;
+		}
+
+		auto length = Wal::loadLe<uint32_t>(bytes);
+		auto lsn = Wal::loadLe<uint64_t>(bytes + 8);
+
+		if (lsn > mDurable) {
+			mDurable = mWal.durableLsn();
+		}
+
+		// Past the durable lsn the bytes may be half written.
+		if (lsn > mDurable || length > Wal::maxPayloadSize) {
+			mStalled = true;
+			return std::nullopt;
+		}
+
+		if (available - Wal::headerSize < length) {
+			mWanted = Wal::headerSize + length;
+			return std::nullopt;
+		}
+
+		if (Wal::loadLe<uint32_t>(bytes + 4) != crc32c(bytes + 8, Wal::headerSize - 8 + length)) {
+			throw std::runtime_error("[WalReader]: corrupt record " + std::to_string(lsn) + " in " + mPath.string());
+		}
+
+		mBegin += Wal::headerSize + length;
+		return Record{lsn, Wal::loadLe<uint16_t>(bytes + 16),
+			std::string_view{mBuffer.data() + mBegin - length, length}};
+	}
+
+	// Reads the next chunk of the segment behind what is buffered; false at
+	// its end.
+	bool fill() {
+		if (mBegin) {
+			std::memmove(mBuffer.data(), mBuffer.data() + mBegin, mEnd - mBegin);
+			mEnd -= mBegin;
+			mBegin = 0;
+		}
+
+		mBuffer.resize(std::max({mBuffer.size(), mEnd + chunkSize, mWanted}));
+
+		while (true) {
+			auto result = ::pread(mFd, mBuffer.data() + mEnd, mBuffer.size() - mEnd, mOffset);
+
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if (result < 0) {
+				throw std::system_error(errno, std::system_category(), "[WalReader]: cannot read " + mPath.string());
+			}
+
+			mEnd += result;
+			mOffset += result;
+			return result > 0;
+		}
+	}
+
+	// Opens the segment holding the record after mLsn, or the one after the
+	// open segment when that has been read to its end. False if there is
+	// none. The directory is listed again only when the segments it held
+	// last time do not include that one.
+	bool openSegment() {
+		auto found = findSegment();
+
+		if (!found) {
+			mSegments = mWal.listSegments();
+			found = findSegment();
+		}
+
+		if (!found) {
+			return false;
+		}
+
+		auto fd = ::open(found->c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0) {
+			// Removed since it was listed: whatever comes next is newer.
+			mSegments.clear();
+			return false;
+		}
+
+		if (mFd >= 0) {
+			::close(mFd);
+		}
+
+		mFd = fd;
+		mPath = *found;
+		mFirstLsn = Wal::firstLsnOf(mPath);
+		mOffset = 0;
+		mBegin = mEnd = mWanted = 0;
+		return true;
+	}
+
+	std::optional<std::filesystem::path> findSegment() const {
+		auto wanted = mLsn + 1;
+		std::optional<std::filesystem::path> found;
+
+		for (auto& segment: mSegments) {
+			auto first = Wal::firstLsnOf(segment);
+
+			if (mFd >= 0 ? first > mFirstLsn : first <= wanted || !found) {
+				found = segment;
+
+				if (mFd >= 0) {
+					break;
+				}
+			}
+		}
+
+		return found;
+	}
+
+	const Wal& mWal;
+	uint64_t mLsn;
+	uint64_t mDurable = 0;
+	std::vector<std::filesystem::path> mSegments;	// as last listed
+
+	int mFd = -1;
+	std::filesystem::path mPath;
+	uint64_t mFirstLsn = 0;
+	off_t mOffset = 0;
+
+	std::vector<char> mBuffer;
+	size_t mBegin = 0;
+	size_t mEnd = 0;
+	size_t mWanted = 0;
+	bool mStalled = false;
+};
+
+} //namespace bookkeeper
@@ -2,9 +2,19 @@
 #include "nlohmann/json.hpp"
 #include "spdlog/spdlog.h"
 
+#include "allocations.hpp"
+#include "metrics_server.hpp"
 #include "server.hpp"
+#include "session_set.hpp"
+#include "snapshot.hpp"
+#include "io_pool.hpp"
+#include "logging.hpp"
 
+#include <atomic>
+#include <csignal>
 #include <filesystem>
+#include <fstream>
+#include <iostream>
 
 using asio::ip::tcp;
 
@@ -13,6 +23,18 @@ using namespace bookkeeper;
 nlohmann::json& defaultConfig() {
 	auto execDir = std::filesystem::canonical("/proc/self/exe").parent_path();
 
+	auto walDir = execDir;
+	walDir += "/../../var/wal";
+
+	auto snapshotDir = execDir;
+	snapshotDir += "/../../var/snapshot";
+
+	auto indexDir = execDir;
+	indexDir += "/../../var/index";
+
+	auto archiveDir = execDir;
+	archiveDir += "/../../var/archive";
+
 	execDir += "/../../etc/cert";
 
 	auto certFile = execDir;
@@ -22,31 +44,202 @@ nlohmann::json& defaultConfig() {
 
 	static nlohmann::json config = nlohmann::json::parse(fmt::format(R"(
 			{{
+				"threads": 0,
 				"open_port": 8080,
 				"ssl_port": 8443,
+				"metrics_port": 9464,
+				"write_flush_threshold": 262144,
+				"log_level": "info",
+				"log_queue_size": 8192,
+				"log_sample_rate": 1000,
+				"tls_session_cache_size": 20480,
+				"tls_session_timeout": 7200,
+				"tls_ticket_rotation": 3600,
+				"tls_stats_interval": 60,
+				"handshake_threads": 0,
+				"max_connections": 10000,
+				"max_inflight_requests": 65536,
+				"outbound_high_water_mark": 1048576,
+				"idle_timeout": 300,
+				"header_timeout": 10,
+				"frame_timeout": 30,
+				"write_timeout": 30,
+				"shutdown_timeout": 30,
+				"ledger_accounts_hint": 1048576,
+				"idempotency_cache_size": 262144,
+				"idempotency_ttl": 86400,
+				"wal_dir": "{}",
+				"wal_segment_size": 67108864,
+				"wal_retain_segments": false,
+				"snapshot_dir": "{}",
+				"snapshot_interval": 300,
+				"snapshot_wal_records": 1000000,
+				"index_dir": "{}",
+				"index_memtable_postings": 262144,
+				"index_fanout": 8,
+				"index_query_threads": 2,
+				"archive_dir": "{}",
+				"archive_period": "month",
+				"archive_close_delay": 86400,
 				"cert_file": "{}",
 				"key_file": "{}"
 			}}
-		)", std::string(certFile), std::string(keyFile)));
+		)", std::string(walDir.lexically_normal()), std::string(snapshotDir.lexically_normal()),
+			std::string(indexDir.lexically_normal()), std::string(archiveDir.lexically_normal()), std::string(certFile),
+			std::string(keyFile)));
 
 	return config;
 }
 
+// Drains one io thread: its acceptors stop, and its sessions answer what
+// they have read and close.
+asio::awaitable<void> drain(Server& tcpServer, Server& sslServer, SessionSet& sessions,
+	std::chrono::steady_clock::time_point deadline)
+{
+	tcpServer.stop();
+	sslServer.stop();
+	co_await sessions.drain(deadline);
+}
+
 int main(int argc, char** argv) {
+	auto startTime = std::chrono::steady_clock::now();
+
 	try {
-		spdlog::set_level(spdlog::level::debug);
-		asio::io_context io;
+		auto& config = defaultConfig();
+
+		// An optional JSON file given as the only argument overrides the
+		// defaults key by key.
+		if (argc > 1) {
+			auto file = std::ifstream{argv[1]};
+
+			if (!file) {
+				throw std::runtime_error(fmt::format("[Config]: cannot open {}", argv[1]));
+			}
+
+			config.update(nlohmann::json::parse(file));
+		}
+
+		logging::init(config);
+
+		auto pool = IoPool{config.value("threads", 1u)};
+		auto tls = ServerTlsContext{config};
+
+		auto wal = Wal{config};
+		auto idempotency = IdempotencyCache{config};
+		auto shards = Shards{config, pool, wal};
+
+		// Startup cost is bounded by the snapshot size plus the log written
+		// since it was taken, not by the whole history.
+		auto snapshotter = Snapshotter{config, shards, wal};
+		auto snapshotLsn = snapshotter.restore(shards);
+		auto snapshotLoaded = std::chrono::steady_clock::now();
+
+		uint64_t replayed = 0;
+		auto lastLsn = wal.recover(snapshotLsn, [&](uint64_t lsn, uint16_t type, std::string_view payload) {
+			Dispatcher::replay(shards, idempotency, lsn, type, payload);
+			++replayed;
+		});
+
+		// Before the snapshotter may remove segments the index still needs,
+		// and before the io threads open accounts the index copies the
+		// currencies of.
+		auto index = PostingIndex{config, wal, shards};
 
-		auto tcpServer = TcpServer{io, defaultConfig()};
-		auto sslServer = SslServer{io, defaultConfig()};
+		wal.start();
+		index.start();
+		snapshotter.start();
 
-		asio::co_spawn(io, tcpServer.start(), asio::detached);
-		asio::co_spawn(io, sslServer.start(), asio::detached);
+		spdlog::info("[Startup]: {} accounts at lsn {}: snapshot at lsn {} loaded in {:.1f} ms, {} log records replayed in {:.1f} ms",
+			shards.accounts(), lastLsn, snapshotLsn,
+			std::chrono::duration<double, std::milli>(snapshotLoaded - startTime).count(), replayed,
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - snapshotLoaded).count());
 
-		io.run();
+		auto metrics = Metrics{pool.size()};
+		metrics.addGauge("bookkeeper_wal_last_lsn", "Sequence number of the last record appended to the log.",
+			[&wal] { return static_cast<double>(wal.lastLsn()); });
+		metrics.addGauge("bookkeeper_wal_durable_lsn", "Sequence number of the last record synced to disk.",
+			[&wal] { return static_cast<double>(wal.durableLsn()); });
+		metrics.addGauge("bookkeeper_index_lsn", "Sequence number of the last log record written to index runs.",
+			[&index] { return static_cast<double>(index.lsn()); });
+
+		std::vector<std::unique_ptr<Dispatcher>> dispatchers;
+		std::vector<std::unique_ptr<Admission>> admissions;
+		std::vector<std::unique_ptr<TimerWheel>> wheels;
+		std::vector<std::unique_ptr<SessionSet>> sessionSets;
+		std::vector<std::unique_ptr<TcpServer>> tcpServers;
+		std::vector<std::unique_ptr<SslServer>> sslServers;
+
+		for (size_t i = 0; i < pool.size(); ++i) {
+			auto& io = pool.context(i);
+
+			dispatchers.push_back(std::make_unique<Dispatcher>(shards.shard(i), wal, index, idempotency));
+			admissions.push_back(std::make_unique<Admission>(io, config, pool.size()));
+			wheels.push_back(std::make_unique<TimerWheel>(io));
+			sessionSets.push_back(std::make_unique<SessionSet>(io));
+			tcpServers.push_back(std::make_unique<TcpServer>(io, config, *dispatchers.back(), *admissions.back(), *wheels.back(),
+				metrics.thread(i), *sessionSets.back()));
+			sslServers.push_back(std::make_unique<SslServer>(io, config, *dispatchers.back(), *admissions.back(), *wheels.back(),
+				metrics.thread(i), *sessionSets.back(), tls));
+
+			asio::co_spawn(io, tcpServers.back()->start(), asio::detached);
+			asio::co_spawn(io, sslServers.back()->start(), asio::detached);
+		}
+
+		auto metricsServer = MetricsServer{pool.context(0), config, metrics};
+		asio::co_spawn(pool.context(0), metricsServer.start(), asio::detached);
+
+		asio::co_spawn(pool.context(0), reportTlsStats(metrics, std::chrono::seconds{config.value("tls_stats_interval", 60)}),
+			asio::detached);
+
+#if defined(BOOKKEEPER_COUNT_ALLOCATIONS)
+		asio::co_spawn(pool.context(0), allocations::report(std::chrono::seconds{1}), asio::detached);
+#endif
+
+		// The first SIGINT or SIGTERM drains every io thread, up to
+		// "shutdown_timeout" seconds, and stops the pool once all of them are
+		// done; a second one stops it at once.
+		auto signals = asio::signal_set{pool.context(0), SIGINT, SIGTERM};
+		auto shutdownTimeout = std::chrono::seconds{config.value("shutdown_timeout", 30)};
+		std::atomic<size_t> draining = pool.size();
+
+		signals.async_wait([&](std::error_code error, int signal) {
+			if (error) {
+				return;
+			}
+
+			spdlog::info("[Shutdown]: Received signal {}, draining for up to {} s", signal, shutdownTimeout.count());
+
+			signals.async_wait([&](std::error_code error, int) {
+				if (!error) {
+					spdlog::warn("[Shutdown]: Received another signal, stopping now");
+					pool.stop();
+				}
+			});
+
+			auto deadline = std::chrono::steady_clock::now() + shutdownTimeout;
+
+			for (size_t i = 0; i < pool.size(); ++i) {
+				asio::co_spawn(pool.context(i), drain(*tcpServers[i], *sslServers[i], *sessionSets[i], deadline),
+					[&](std::exception_ptr) {
+						if (--draining == 0) {
+							pool.stop();
+						}
+					});
+			}
+		});
+
+		pool.run();
+
+		// The io threads have stopped, so nothing appends to the log any more.
+		snapshotter.stop();
+		wal.stop();
+		index.stop();
+		spdlog::info("[Shutdown]: Log durable up to lsn {}, indexed up to lsn {}", wal.durableLsn(), index.lsn());
 	} catch (const std::exception& error) {
 		std::cerr << error.what() << std::endl;
 	}
 
+	spdlog::shutdown();
+
 	return 0;
 }
\ No newline at end of file
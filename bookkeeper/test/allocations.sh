@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+#
+# Checks that serving requests does not allocate. Starts a server built with
+# BOOKKEEPER_COUNT_ALLOCATIONS, runs a few seconds of client load of each kind
+# against it and fails unless the allocations it logs while the load is
+# steady, i.e. leaving out the intervals in which connections open and close,
+# come to 0.000 per request.
+#
+# Usage: allocations.sh <counting server> <client> <cert dir>
+
+set -euo pipefail
+
+server=$1
+client=$2
+certs=$3
+
+dir=$(mktemp -d)
+log=$dir/server.log
+pid=
+
+cleanup() {
+	if [[ -n $pid ]]; then
+		kill -TERM "$pid" 2>/dev/null || true
+		wait "$pid" 2>/dev/null || true
+	fi
+
+	rm -rf "$dir"
+}
+
+trap cleanup EXIT
+
+cat > "$dir/config.json" <<EOF
+{
+	"threads": 2,
+	"open_port": 28080,
+	"ssl_port": 28443,
+	"metrics_port": 29464,
+	"wal_dir": "$dir/wal",
+	"snapshot_dir": "$dir/snapshot",
+	"index_dir": "$dir/index",
+	"archive_dir": "$dir/archive",
+	"cert_file": "$certs/server.cert",
+	"key_file": "$certs/server.key"
+}
+EOF
+
+"$server" "$dir/config.json" > "$log" 2>&1 &
+pid=$!
+
+for _ in $(seq 50); do
+	if grep -q "Running .* io threads" "$log"; then
+		break
+	fi
+
+	sleep 0.1
+done
+
+failed=0
+
+# Runs one load and checks the report lines logged during it.
+check() {
+	local name=$1
+	shift
+
+	local before
+	before=$(wc -l < "$log")
+
+	"$client" bench --port "$@" --connections 8 --depth 8 --duration 4 > /dev/null
+
+	# Reports are logged every second; wait for the one covering the end.
+	sleep 1.5
+
+	local summary
+	summary=$(tail -n +"$((before + 1))" "$log" | grep "\[Allocations\]" | sed '1d;$d' |
+		awk '{ allocations += $(NF - 7); requests += $(NF - 4) }
+			END { if (requests) printf "%d allocations for %d requests (%.3f per request)", allocations, requests, allocations / requests }')
+
+	if [[ -z $summary ]]; then
+		echo "$name: no steady-state report"
+		failed=1
+	elif [[ $summary != *"(0.000 per request)" ]]; then
+		echo "$name: $summary"
+		failed=1
+	else
+		echo "$name: ok, $summary"
+	fi
+}
+
+check "echo" 28080 --tcp
+check "ledger" 28080 --tcp --ledger
+check "idempotent ledger" 28080 --tcp --idempotent
+check "ledger over tls" 28443 --ssl --ledger
+
+if (( failed )); then
+	echo "--- server log"
+	cat "$log"
+fi
+
+exit "$failed"
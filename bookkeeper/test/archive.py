@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+#
+# Checks that closing a period archives every posting made in it. Writes a
+# log of transactions made hours ago, in one hour few enough to fit one group
+# of an archive and in another many enough to span several, starts the
+# server on it with hourly periods, waits until they are closed, and checks
+# that the reports over them match the legs logged.
+#
+# Usage: archive.py <server> <cert dir>
+
+import os
+import random
+import struct
+import sys
+import time
+
+from harness import ALL_ACCOUNTS, OPENED_ACCOUNT, POSTED_TRANSACTION, Server, currency, legs, write_log
+
+PORT = 28200
+HOUR = 3600 * 1000000
+# Transactions of two postings each: the small period fits one archive group
+# of 65536 rows, the large one spans three.
+SMALL = 300
+LARGE = 70000
+CLOSE_TIMEOUT = 240
+
+OK = 0
+PERIOD_OPEN = 8
+
+# Two accounts of each currency, on different partitions.
+ACCOUNTS = {0: "EUR", 1: "EUR", 2: "USD", 3: "USD"}
+
+
+# Adds the postings of `transactions` transactions made within the hour from
+# `start` to the log and returns their totals per account.
+def post(records, start, transactions):
+    postings = {}
+
+    for _ in range(transactions):
+        transaction = len(records) - len(ACCOUNTS) + 1
+        debited, credited = (0, 1) if transaction % 2 else (2, 3)
+        amount = random.randint(1, 1000000)
+        made = start + random.randrange(HOUR)
+        records.append((POSTED_TRANSACTION, struct.pack("<QQ", transaction, made) +
+            legs((debited, amount), (credited, -amount))))
+        postings.setdefault(debited, []).append(amount)
+        postings.setdefault(credited, []).append(-amount)
+
+    return postings
+
+
+# The report expected over `periods`, each {account: [amounts]}, for `account`.
+def expect(account, *periods):
+    totals = {}
+
+    for postings in periods:
+        for posted, amounts in postings.items():
+            if account in (ALL_ACCOUNTS, posted):
+                count, debits, credits = totals.get(ACCOUNTS[posted], (0, 0, 0))
+                totals[ACCOUNTS[posted]] = (count + len(amounts), debits + sum(a for a in amounts if a > 0),
+                    credits - sum(a for a in amounts if a < 0))
+
+    return totals
+
+
+def main():
+    server, certs = sys.argv[1:3]
+
+    with Server(server, certs, PORT, archive_period="hour", archive_close_delay=1) as bookkeeper:
+        current = int(time.time() * 1e6) // HOUR * HOUR
+        large_start = current - 5 * HOUR
+        small_start = current - 3 * HOUR
+
+        random.seed(1)
+        records = [(OPENED_ACCOUNT, struct.pack("<II", account, currency(code))) for account, code in ACCOUNTS.items()]
+        large = post(records, large_start, LARGE)
+        small = post(records, small_start, SMALL)
+
+        os.makedirs(bookkeeper.path("wal"))
+        write_log(bookkeeper.path("wal", f"wal-{1:020}.log"), records)
+
+        bookkeeper.start()
+        connection = bookkeeper.connect()
+
+        # The close needs the logged postings flushed first, which the checks
+        # before it, a minute apart, only request.
+        deadline = time.time() + CLOSE_TIMEOUT
+
+        while "Closed the periods" not in bookkeeper.log():
+            if time.time() > deadline:
+                print("the periods were not closed")
+                print("--- server log")
+                print(bookkeeper.log())
+                return 1
+
+            time.sleep(1)
+
+        # Postings made now, which must stay out of the closed periods.
+        for _ in range(10):
+            connection.post((0, 5), (1, -5))
+
+        checks = [
+            ("the small period", ALL_ACCOUNTS, small_start, small_start + HOUR, expect(ALL_ACCOUNTS, small)),
+            ("the large period", ALL_ACCOUNTS, large_start, large_start + HOUR, expect(ALL_ACCOUNTS, large)),
+            ("both periods", ALL_ACCOUNTS, large_start - HOUR, current, expect(ALL_ACCOUNTS, large, small)),
+            ("account 2 in the large period", 2, large_start, large_start + HOUR, expect(2, large)),
+            ("account 1 in the small period", 1, small_start, small_start + HOUR, expect(1, small)),
+            ("the hour between them", ALL_ACCOUNTS, large_start + HOUR, small_start, {}),
+        ]
+
+        failures = []
+
+        for name, account, start, end, expected in checks:
+            status, totals = connection.report(account, start, end)
+
+            if status != OK or totals != expected:
+                failures.append(f"{name}: status {status}, {totals}, not {expected}")
+
+        status, _ = connection.report(ALL_ACCOUNTS, small_start, current + HOUR)
+
+        if status != PERIOD_OPEN:
+            failures.append(f"a report into the open period got status {status}")
+
+        if failures:
+            print("\n".join(failures))
+            print("--- server log")
+            print(bookkeeper.log())
+            return 1
+
+        print(f"ok, {2 * (LARGE + SMALL)} postings archived")
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
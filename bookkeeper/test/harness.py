@@ -0,0 +1,260 @@
+#
+# What the Python tests share: a server started on a directory of its own,
+# connections speaking the frame protocol, and logs written as Wal writes
+# them.
+#
+
+import json
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+OPEN_ACCOUNT = 1
+POST_TRANSACTION = 2
+GET_BALANCE = 3
+GET_HISTORY = 4
+GET_REPORT = 5
+
+OPENED_ACCOUNT = 0x101
+POSTED_TRANSACTION = 0x103
+
+ALL_ACCOUNTS = 0xffffffff
+
+
+def currency(code):
+    return struct.unpack("<I", code.encode().ljust(4, b"\0"))[0]
+
+
+def crc32c_table():
+    table = []
+
+    for byte in range(256):
+        crc = byte
+
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0)
+
+        table.append(crc)
+
+    return table
+
+
+CRC32C_TABLE = crc32c_table()
+
+
+def crc32c(data):
+    crc = 0xffffffff
+
+    for byte in data:
+        crc = (crc >> 8) ^ CRC32C_TABLE[(crc ^ byte) & 0xff]
+
+    return crc ^ 0xffffffff
+
+
+# Encodes one log record; `records` of them, from lsn 1 on, make a segment.
+def log_record(lsn, type, payload):
+    body = struct.pack("<QH", lsn, type) + payload
+    return struct.pack("<II", len(payload), crc32c(body)) + body
+
+
+def write_log(path, records):
+    with open(path, "wb") as segment:
+        for lsn, (type, payload) in enumerate(records, 1):
+            segment.write(log_record(lsn, type, payload))
+
+
+# Returns (offset, lsn, type, payload) for each record of a segment.
+def read_log(path):
+    with open(path, "rb") as segment:
+        data = segment.read()
+
+    records = []
+    offset = 0
+
+    while offset + 18 <= len(data):
+        length, _, lsn, type = struct.unpack_from("<IIQH", data, offset)
+        records.append((offset, lsn, type, data[offset + 18:offset + 18 + length]))
+        offset += 18 + length
+
+    return records
+
+
+def legs(*legs):
+    return struct.pack("<H", len(legs)) + b"".join(struct.pack("<Iq", account, amount) for account, amount in legs)
+
+
+class Connection:
+    def __init__(self, port):
+        self.socket = socket.create_connection(("127.0.0.1", port))
+        self.request_id = 0
+
+    def close(self):
+        self.socket.close()
+
+    def send(self, type, payload):
+        self.request_id += 1
+        self.socket.sendall(struct.pack("<IHQ", len(payload), type, self.request_id) + payload)
+        return self.request_id
+
+    def read(self, size):
+        data = b""
+
+        while len(data) < size:
+            chunk = self.socket.recv(size - len(data))
+
+            if not chunk:
+                raise RuntimeError("connection closed")
+
+            data += chunk
+
+        return data
+
+    # The next reply, which must answer `request_id`.
+    def receive(self, request_id, type):
+        size, reply_type, reply_id = struct.unpack("<IHQ", self.read(14))
+        payload = self.read(size)
+
+        if reply_type != type or reply_id != request_id:
+            raise RuntimeError(f"reply {reply_type}/{reply_id} to request {type}/{request_id}")
+
+        return payload
+
+    def call(self, type, payload):
+        return self.receive(self.send(type, payload), type)
+
+    # Returns the status and, if ok, the value of a write's reply.
+    def open_account(self, code, key=b""):
+        return struct.unpack("<HI", self.call(OPEN_ACCOUNT, struct.pack("<I", currency(code)) + key).ljust(6, b"\0"))
+
+    def post(self, *legs_, key=b""):
+        return struct.unpack("<HQ", self.call(POST_TRANSACTION, legs(*legs_) + key).ljust(10, b"\0"))
+
+    def balance(self, account):
+        status, balance, _ = struct.unpack("<HqI", self.call(GET_BALANCE, struct.pack("<I", account)).ljust(14, b"\0"))
+
+        if status:
+            raise RuntimeError(f"balance of {account} failed with status {status}")
+
+        return balance
+
+    # Returns the rows of a history request and the cursor it ends at.
+    def history(self, account, cursor, limit):
+        request_id = self.send(GET_HISTORY, struct.pack("<I4QI", account, *cursor, limit))
+        rows = []
+
+        while True:
+            page = self.receive(request_id, GET_HISTORY)
+            status = struct.unpack_from("<H", page)[0]
+
+            if status:
+                raise RuntimeError(f"history failed with status {status}")
+
+            _, more, *cursor, count = struct.unpack_from("<HH4QH", page)
+
+            for i in range(count):
+                rows.append(struct.unpack_from("<QQq", page, 38 + 24 * i))
+
+            if not more:
+                return rows, tuple(cursor)
+
+    # Returns the status and {currency: (postings, debits, credits)}.
+    def report(self, account, start, end):
+        reply = self.call(GET_REPORT, struct.pack("<IQQ", account, start, end))
+        status = struct.unpack_from("<H", reply)[0]
+        totals = {}
+
+        if not status:
+            for i in range(struct.unpack_from("<H", reply, 2)[0]):
+                code, *row = struct.unpack_from("<IQqq", reply, 4 + 28 * i)
+                totals[struct.pack("<I", code).rstrip(b"\0").decode()] = tuple(row)
+
+        return status, totals
+
+
+class Server:
+    """
+    A server on a temporary directory, removed when the server is left as a
+    context manager. `config` overrides the test defaults key by key.
+    """
+
+    def __init__(self, binary, certs, port, **config):
+        self.binary = binary
+        self.port = port
+        self.directory = tempfile.mkdtemp()
+        self.process = None
+        self.started = 0
+        self.connections = []
+        self.log_path = os.path.join(self.directory, "server.log")
+        self.config_path = os.path.join(self.directory, "config.json")
+
+        self.config = {
+            "threads": 2,
+            "open_port": port,
+            "ssl_port": port + 1,
+            "metrics_port": port + 2,
+            "wal_dir": os.path.join(self.directory, "wal"),
+            "snapshot_dir": os.path.join(self.directory, "snapshot"),
+            "index_dir": os.path.join(self.directory, "index"),
+            "archive_dir": os.path.join(self.directory, "archive"),
+            "cert_file": os.path.join(certs, "server.cert"),
+            "key_file": os.path.join(certs, "server.key"),
+        }
+
+        self.config.update(config)
+
+        with open(self.config_path, "w") as file:
+            json.dump(self.config, file)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *error):
+        if self.process:
+            self.stop()
+
+        shutil.rmtree(self.directory)
+
+    def path(self, *parts):
+        return os.path.join(self.directory, *parts)
+
+    # Starts the server and waits until it serves, after recovery.
+    def start(self):
+        self.started = len(self.log()) if os.path.exists(self.log_path) else 0
+        self.process = subprocess.Popen([self.binary, self.config_path], stdout=open(self.log_path, "a"),
+            stderr=subprocess.STDOUT)
+
+        for _ in range(300):
+            if "io threads" in self.log(since_start=True):
+                return
+
+            if self.process.poll() is not None:
+                raise RuntimeError("server exited:\n" + self.log(since_start=True))
+
+            time.sleep(0.1)
+
+        raise RuntimeError("server did not start:\n" + self.log(since_start=True))
+
+    def connect(self):
+        self.connections.append(Connection(self.port))
+        return self.connections[-1]
+
+    # Stops the server with `sig`: SIGTERM drains it, SIGKILL is a crash.
+    def stop(self, sig=signal.SIGTERM):
+        # An open connection would hold up the drain.
+        for connection in self.connections:
+            connection.close()
+
+        self.connections.clear()
+        self.process.send_signal(sig)
+        self.process.wait()
+        self.process = None
+
+    # The whole log, or what the server logged since it was last started.
+    def log(self, since_start=False):
+        with open(self.log_path) as file:
+            return file.read()[self.started if since_start else 0:]
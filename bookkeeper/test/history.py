@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+#
+# Checks that paging through an account's history returns every posting
+# exactly once even though posting times are not in log order. Writes a log
+# whose transactions were made at shuffled times, up to hours ahead, starts
+# the server on it with a small memtable, so that the history is spread over
+# runs and the memtable, and pages through the account with a small limit
+# while new postings, made before most of the logged ones, keep arriving.
+#
+# Usage: history.py <server> <cert dir>
+
+import os
+import random
+import struct
+import sys
+import time
+
+from harness import OPENED_ACCOUNT, POSTED_TRANSACTION, Server, currency, legs, write_log
+
+PORT = 28180
+LOGGED = 3000
+LIMIT = 97
+POSTED_PER_PAGE = 5
+POSTING_PAGES = 40
+
+
+def main():
+    server, certs = sys.argv[1:3]
+
+    with Server(server, certs, PORT, index_memtable_postings=512) as bookkeeper:
+        # Accounts 0 and 1, the first of partitions 0 and 1, and transactions
+        # between them made up to two hours either side of now.
+        now = int(time.time() * 1e6)
+        random.seed(1)
+        records = [(OPENED_ACCOUNT, struct.pack("<II", account, currency("EUR"))) for account in (0, 1)]
+        expected = set()
+
+        for transaction in range(1, LOGGED + 1):
+            made = now + random.randint(-7200, 7200) * 1000000
+            records.append((POSTED_TRANSACTION, struct.pack("<QQ", transaction, made) +
+                legs((0, transaction), (1, -transaction))))
+            expected.add(transaction)
+
+        os.makedirs(bookkeeper.path("wal"))
+        write_log(bookkeeper.path("wal", f"wal-{1:020}.log"), records)
+
+        bookkeeper.start()
+        connection = bookkeeper.connect()
+        cursor = (0, 0, 0, 0)
+        seen = []
+        pages = 0
+
+        # Pages until the history is done after the postings stopped.
+        while True:
+            rows, cursor = connection.history(0, cursor, LIMIT)
+            seen.extend(row[0] for row in rows)
+            pages += 1
+
+            if pages <= POSTING_PAGES:
+                for _ in range(POSTED_PER_PAGE):
+                    status, transaction = connection.post((0, 1), (1, -1))
+
+                    if status:
+                        raise RuntimeError(f"posting failed with status {status}")
+
+                    expected.add(transaction)
+            elif not rows:
+                break
+
+        duplicates = len(seen) - len(set(seen))
+        missing = expected - set(seen)
+        unexpected = set(seen) - expected
+
+        if duplicates or missing or unexpected:
+            print(f"{len(seen)} rows in {pages} pages: {duplicates} duplicates, {len(missing)} missing, "
+                f"{len(unexpected)} unexpected")
+            print("--- server log")
+            print(bookkeeper.log())
+            return 1
+
+        print(f"ok, {len(seen)} postings in {pages} pages")
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
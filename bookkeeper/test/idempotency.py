@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+#
+# Checks that a write retried with its idempotency key is executed once.
+# Sends the same keyed transaction on several connections at once, so that
+# most copies arrive while the first is still pending, then once more after
+# it completed, and checks that every copy gets the first one's result, that
+# the key with another payload gets keyReused, and that the balances and the
+# history hold each transaction exactly once.
+#
+# Usage: idempotency.py <server> <cert dir>
+
+import struct
+import sys
+
+from harness import POST_TRANSACTION, Server, legs
+
+PORT = 28190
+ROUNDS = 50
+COPIES = 8
+
+OK = 0
+KEY_REUSED = 7
+
+
+def key(round):
+    return struct.pack("<QQ", 0x6b6579, round + 1)
+
+
+def main():
+    server, certs = sys.argv[1:3]
+
+    with Server(server, certs, PORT) as bookkeeper:
+        bookkeeper.start()
+        connections = [bookkeeper.connect() for _ in range(COPIES)]
+        first = connections[0]
+        failures = []
+
+        status, a = first.open_account("EUR", key(ROUNDS))
+        _, b = first.open_account("EUR")
+
+        if status or first.open_account("EUR", key(ROUNDS)) != (OK, a):
+            failures.append("a retried account opening did not return the first account")
+
+        transactions = set()
+
+        for round in range(ROUNDS):
+            payload = legs((a, round + 1), (b, -(round + 1))) + key(round)
+            requests = [(connection, connection.send(POST_TRANSACTION, payload)) for connection in connections]
+            replies = {struct.unpack("<HQ", connection.receive(request, POST_TRANSACTION)) for connection, request in requests}
+
+            if len(replies) != 1 or next(iter(replies))[0] != OK:
+                failures.append(f"round {round}: concurrent copies got {sorted(replies)}")
+                continue
+
+            reply = next(iter(replies))
+            transactions.add(reply[1])
+
+            if first.post((a, round + 1), (b, -(round + 1)), key=key(round)) != reply:
+                failures.append(f"round {round}: a retry after completion did not get {reply}")
+
+            if first.post((a, round + 2), (b, -(round + 2)), key=key(round))[0] != KEY_REUSED:
+                failures.append(f"round {round}: the key with another payload was not rejected")
+
+        total = ROUNDS * (ROUNDS + 1) // 2
+        rows, _ = first.history(a, (0, 0, 0, 0), 0)
+
+        if first.balance(a) != total or first.balance(b) != -total:
+            failures.append(f"balances are {first.balance(a)} and {first.balance(b)}, not {total} and {-total}")
+
+        if len(rows) != ROUNDS or {row[0] for row in rows} != transactions:
+            failures.append(f"history holds {len(rows)} postings, not the {ROUNDS} transactions replied")
+
+        if failures:
+            print("\n".join(failures))
+            print("--- server log")
+            print(bookkeeper.log())
+            return 1
+
+        print(f"ok, {ROUNDS} transactions sent {COPIES + 1} times each")
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Checks that a server killed mid-write recovers every transaction it can
+# still prove and nothing else. Posts transactions, kills the server with
+# SIGKILL, damages what it left behind the way a crash or a bad disk would,
+# restarts it and checks the balances against the transactions whose log
+# records survived:
+#
+# - a torn tail: the last record cut off halfway;
+# - a crc mismatch: a record further back altered, which drops it and
+#   everything logged after it;
+# - nothing damaged, with snapshots taken: the newest one is restored and
+#   the log replayed from its lsn;
+# - a damaged newest snapshot: the older one is restored and the longer
+#   log tail after it replayed.
+#
+# Usage: recovery.py <server> <cert dir>
+
+import os
+import random
+import signal
+import struct
+import sys
+import time
+
+from harness import POSTED_TRANSACTION, Server, read_log
+
+PORT = 28210
+POSTS = 100
+SNAPSHOT_RECORDS = 50
+
+HEADER_SIZE = 18
+
+
+class Ledger:
+    """
+    The balances the server must have, kept alongside the transactions
+    posted to it.
+    """
+
+    def __init__(self, connection):
+        self.connection = connection
+        self.accounts = [connection.open_account("EUR")[1] for _ in range(3)]
+        self.balances = dict.fromkeys(self.accounts, 0)
+
+    def post(self, count):
+        for _ in range(count):
+            debited, credited = random.sample(self.accounts, 2)
+            amount = random.randint(1, 1000)
+            status, _ = self.connection.post((debited, amount), (credited, -amount))
+
+            if status:
+                raise RuntimeError(f"posting failed with status {status}")
+
+            self.balances[debited] += amount
+            self.balances[credited] -= amount
+
+    # Takes back the transaction logged as `payload`.
+    def drop(self, payload):
+        count = struct.unpack_from("<H", payload, 16)[0]
+
+        for i in range(count):
+            account, amount = struct.unpack_from("<Iq", payload, 18 + 12 * i)
+            self.balances[account] -= amount
+
+    def check(self, case):
+        balances = {account: self.connection.balance(account) for account in self.accounts}
+
+        if balances != self.balances:
+            return [f"{case}: balances are {balances}, not {self.balances}"]
+
+        return []
+
+
+def last_segment(bookkeeper):
+    segments = sorted(name for name in os.listdir(bookkeeper.path("wal")) if name.startswith("wal-"))
+    return bookkeeper.path("wal", segments[-1])
+
+
+def snapshots(bookkeeper):
+    return sorted(name for name in os.listdir(bookkeeper.path("snapshot")) if name.startswith("snapshot-"))
+
+
+def lsn_of(snapshot):
+    return int(snapshot[len("snapshot-"):-len(".bin")])
+
+
+def wait_for_snapshots(bookkeeper, count):
+    for _ in range(100):
+        if bookkeeper.log().count("[Snapshotter]: Wrote") >= count:
+            return
+
+        time.sleep(0.1)
+
+    raise RuntimeError(f"snapshot {count} was not written")
+
+
+# Kills the server, lets `damage` cut the last segment down or alter it,
+# restarts the server, and checks the ledger, before and after posting more.
+def crash(bookkeeper, ledger, case, damage):
+    bookkeeper.stop(signal.SIGKILL)
+    segment = last_segment(bookkeeper)
+    records = read_log(segment)
+
+    with open(segment, "r+b") as file:
+        dropped = damage(file, records)
+
+    for _, _, type, payload in dropped:
+        if type != POSTED_TRANSACTION:
+            raise RuntimeError(f"{case}: dropped a record of type {type:#x}")
+
+        ledger.drop(payload)
+
+    bookkeeper.start()
+    ledger.connection = bookkeeper.connect()
+    failures = ledger.check(case)
+
+    if f"at lsn {dropped[0][1] - 1}:" not in bookkeeper.log(since_start=True):
+        failures.append(f"{case}: the log does not end at lsn {dropped[0][1] - 1}")
+
+    ledger.post(POSTS // 10)
+    return failures + ledger.check(case + ", then posting")
+
+
+# Kills the server, damages its newest snapshot if `damaged`, restarts it
+# and checks that the snapshot expected was restored and the log replayed
+# from there.
+def restore(bookkeeper, ledger, case, damaged):
+    bookkeeper.stop(signal.SIGKILL)
+    kept = snapshots(bookkeeper)
+
+    if damaged:
+        with open(bookkeeper.path("snapshot", kept[-1]), "r+b") as file:
+            file.seek(-1, os.SEEK_END)
+            last = file.read(1)[0]
+            file.seek(-1, os.SEEK_END)
+            file.write(bytes([last ^ 0xff]))
+
+    bookkeeper.start()
+    ledger.connection = bookkeeper.connect()
+    failures = ledger.check(case)
+    lsn = lsn_of(kept[-2] if damaged else kept[-1])
+    log = bookkeeper.log(since_start=True)
+
+    if f"snapshot at lsn {lsn} " not in log:
+        failures.append(f"{case}: the snapshot at lsn {lsn} was not restored")
+
+    if damaged and "Skipping" not in log:
+        failures.append(f"{case}: the damaged snapshot was not skipped")
+
+    ledger.post(POSTS // 10)
+    return failures + ledger.check(case + ", then posting")
+
+
+def torn_tail(file, records):
+    offset, _, _, payload = records[-1]
+    file.truncate(offset + HEADER_SIZE + len(payload) // 2)
+    return records[-1:]
+
+
+def crc_mismatch(file, records):
+    offset, _, _, payload = records[-3]
+    file.seek(offset + HEADER_SIZE + len(payload) - 1)
+    file.write(bytes([payload[-1] ^ 0xff]))
+    return records[-3:]
+
+
+def log_tail(bookkeeper):
+    bookkeeper.start()
+    ledger = Ledger(bookkeeper.connect())
+    ledger.post(POSTS)
+
+    failures = crash(bookkeeper, ledger, "torn tail", torn_tail)
+    return failures + crash(bookkeeper, ledger, "crc mismatch", crc_mismatch)
+
+
+# Two snapshots, with records logged after each.
+def snapshotted(bookkeeper):
+    bookkeeper.start()
+    ledger = Ledger(bookkeeper.connect())
+
+    for count in (1, 2):
+        ledger.post(SNAPSHOT_RECORDS + 10)
+        wait_for_snapshots(bookkeeper, count)
+
+    ledger.post(SNAPSHOT_RECORDS // 2)
+
+    failures = restore(bookkeeper, ledger, "replay from the snapshot", damaged=False)
+    return failures + restore(bookkeeper, ledger, "damaged snapshot", damaged=True)
+
+
+def main():
+    server, certs = sys.argv[1:3]
+    random.seed(1)
+
+    for scenario, config in ((log_tail, {}), (snapshotted, {"snapshot_wal_records": SNAPSHOT_RECORDS})):
+        with Server(server, certs, PORT, **config) as bookkeeper:
+            failures = scenario(bookkeeper)
+
+            if failures:
+                print("\n".join(failures))
+                print("--- server log")
+                print(bookkeeper.log())
+                return 1
+
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
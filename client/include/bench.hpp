@@ -0,0 +1,386 @@
+
+#pragma once
+
+#include <asio.hpp>
+#include <asio/experimental/awaitable_operators.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "ledger/protocol.hpp"
+
+#include "client.hpp"
+#include "histogram.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace client {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+	std::string host = "127.0.0.1";
+	std::string port;
+	bool ssl = true;
+	size_t threads = 1;
+	size_t connections = 16;
+	size_t depth = 1;	// closed loop: requests in flight per connection
+	double rate = 0;	// open loop: total requests per second, 0 = closed loop
+	size_t payloadSize = 64;
+	size_t reconnect = 0;	// requests per connection before reconnecting, 0 = never
+	bool ledger = false;	// post transfers between two accounts per connection instead of echoing
+	bool idempotent = false;	// give every transfer its own idempotency key
+	std::chrono::seconds duration{10};
+
+	static BenchOptions parse(int argc, char** argv) {
+		auto options = BenchOptions{};
+
+		for (int i = 0; i < argc; ++i) {
+			std::string arg = argv[i];
+
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc) {
+					throw std::runtime_error("[Bench]: missing value for " + arg);
+				}
+				return argv[++i];
+			};
+
+			if (arg == "--host") {
+				options.host = value();
+			} else if (arg == "--port") {
+				options.port = value();
+			} else if (arg == "--tcp") {
+				options.ssl = false;
+			} else if (arg == "--ssl") {
+				options.ssl = true;
+			} else if (arg == "--threads") {
+				options.threads = std::stoul(value());
+			} else if (arg == "--connections") {
+				options.connections = std::stoul(value());
+			} else if (arg == "--depth") {
+				options.depth = std::stoul(value());
+			} else if (arg == "--rate") {
+				options.rate = std::stod(value());
+			} else if (arg == "--payload") {
+				options.payloadSize = std::stoul(value());
+			} else if (arg == "--reconnect") {
+				options.reconnect = std::stoul(value());
+			} else if (arg == "--ledger") {
+				options.ledger = true;
+			} else if (arg == "--idempotent") {
+				options.ledger = true;
+				options.idempotent = true;
+			} else if (arg == "--duration") {
+				options.duration = std::chrono::seconds{std::stoul(value())};
+			} else {
+				throw std::runtime_error("[Bench]: unknown option " + arg);
+			}
+		}
+
+		if (options.port.empty()) {
+			options.port = options.ssl ? "8443" : "8080";
+		}
+
+		if (!options.threads || !options.connections || !options.depth) {
+			throw std::runtime_error("[Bench]: --threads, --connections and --depth must be positive");
+		}
+
+		return options;
+	}
+};
+
+struct BenchStats {
+	Histogram latency;	// nanoseconds
+	uint64_t requests = 0;
+	uint64_t errors = 0;
+	uint64_t bytes = 0;
+	uint64_t connects = 0;
+	uint64_t resumed = 0;
+
+	void merge(const BenchStats& other) {
+		latency.merge(other.latency);
+		requests += other.requests;
+		errors += other.errors;
+		bytes += other.bytes;
+		connects += other.connects;
+		resumed += other.resumed;
+	}
+};
+
+/*
+ * One benchmark connection. In closed-loop mode it keeps `depth` requests in
+ * flight; in open-loop mode it sends on a fixed schedule and measures latency
+ * from the scheduled send time, so a stalled server is not hidden by the
+ * client backing off (coordinated omission).
+ */
+template <typename Stream>
+struct BenchConnection {
+	static constexpr size_t slotBits = 20;
+	static constexpr size_t openLoopSlots = 1 << 16;
+
+	BenchConnection(Stream&& stream, const BenchOptions& options, BenchStats& stats, Clock::time_point deadline)
+		: mChannel{std::move(stream)}
+		, mOptions(options)
+		, mStats(stats)
+		, mDeadline(deadline)
+		, mPayload(options.payloadSize, 'x')
+		, mSendTimes(options.rate > 0 ? openLoopSlots : options.depth)
+		, mSignal{mChannel.executor()}
+	{
+		for (size_t slot = mSendTimes.size(); slot > 0; --slot) {
+			mFreeSlots.push_back(slot - 1);
+		}
+	}
+
+	asio::awaitable<void> run() {
+		using namespace asio::experimental::awaitable_operators;
+
+		if (mOptions.ledger) {
+			co_await prepareTransfers();
+		}
+
+		co_await (send() || receive());
+	}
+
+private:
+	// Opens a pair of accounts and replaces the echo payload with a transfer
+	// between them; the bench then measures end-to-end posting latency.
+	asio::awaitable<void> prepareTransfers() {
+		auto transfer = ledger::PostTransaction{};
+		transfer.legCount = 2;
+
+		for (auto& leg: std::span{transfer.legs.data(), transfer.legCount}) {
+			network::FrameWriter request;
+			request.begin(static_cast<uint16_t>(ledger::MessageType::openAccount), 0);
+			ledger::OpenAccount{.currency = ledger::currencyCode("EUR"), .key = {}}.encode(request);
+			co_await mChannel.sendFrame(request);
+
+			auto reply = co_await mChannel.getFrame();
+			auto status = ledger::Status{};
+			auto reader = ledger::PayloadReader{reply.payload};
+
+			if (!reader.read(status).read(leg.account).complete() || status != ledger::Status::ok) {
+				throw std::runtime_error("[Bench]: could not open an account");
+			}
+		}
+
+		transfer.legs[0].amount = 1;
+		transfer.legs[1].amount = -1;
+
+		// The low half of the key, last in the payload, becomes the request
+		// sequence number when sending.
+		if (mOptions.idempotent) {
+			auto random = std::random_device{};
+			transfer.key = {(static_cast<uint64_t>(random()) << 32) | random(), 1};
+		}
+
+		network::FrameWriter writer;
+		writer.begin(0, 0);
+		transfer.encode(writer);
+
+		auto frame = writer.finish();
+		mPayload.assign(static_cast<const char*>(frame.data()) + network::FrameHeader::size,
+			frame.size() - network::FrameHeader::size);
+		mType = static_cast<uint16_t>(ledger::MessageType::postTransaction);
+	}
+
+	asio::awaitable<void> send() {
+		auto interval = mOptions.rate > 0
+			? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(mOptions.connections / mOptions.rate))
+			: Clock::duration::zero();
+		auto scheduled = Clock::now();
+		uint64_t sequence = 0;
+
+		while (!mClosed && Clock::now() < mDeadline && (!mOptions.reconnect || sequence < mOptions.reconnect)) {
+			if (mOptions.rate > 0) {
+				// Replies cancel the timer too, so re-arm until the slot is due.
+				scheduled += interval;
+				while (!mClosed && Clock::now() < scheduled) {
+					mSignal.expires_at(scheduled);
+					co_await mSignal.async_wait(asio::as_tuple(use_awaitable));
+				}
+			} else {
+				while (!mClosed && mFreeSlots.empty()) {
+					co_await waitSignal();
+				}
+				scheduled = Clock::now();
+			}
+
+			if (mClosed) {
+				break;
+			}
+
+			if (mFreeSlots.empty()) {
+				++mStats.errors;	// open loop ran out of slots: server is far behind
+				continue;
+			}
+
+			auto slot = mFreeSlots.back();
+			mFreeSlots.pop_back();
+			mSendTimes[slot] = scheduled;
+			++sequence;
+
+			if (mOptions.idempotent) {
+				auto* low = mPayload.data() + mPayload.size() - sizeof(sequence);
+				for (size_t i = 0; i < sizeof(sequence); ++i) {
+					low[i] = static_cast<char>(sequence >> (8 * i));
+				}
+			}
+
+			co_await mChannel.sendFrame(mType, (sequence << slotBits) | slot, mPayload);
+		}
+
+		// Let the outstanding replies arrive, but do not wait forever.
+		auto drainDeadline = Clock::now() + std::chrono::seconds{5};
+		while (!mClosed && mFreeSlots.size() != mSendTimes.size() && Clock::now() < drainDeadline) {
+			mSignal.expires_at(drainDeadline);
+			co_await mSignal.async_wait(asio::as_tuple(use_awaitable));
+		}
+	}
+
+	// A server that closes first, e.g. while draining for a restart, ends
+	// the connection: the sender is woken so that it stops too.
+	asio::awaitable<void> receive() {
+		try {
+			while (true) {
+				auto reply = co_await mChannel.getFrame();
+				auto slot = reply.requestId & ((1ull << slotBits) - 1);
+
+				mStats.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - mSendTimes[slot]).count());
+				mStats.bytes += reply.payload.size() + network::FrameHeader::size;
+				++mStats.requests;
+
+				auto status = ledger::Status{};
+				if (mType != 0 && (ledger::PayloadReader{reply.payload}.read(status).failed() || status != ledger::Status::ok)) {
+					++mStats.errors;
+				}
+
+				mFreeSlots.push_back(slot);
+				mSignal.cancel();
+			}
+		} catch (...) {
+			mClosed = true;
+			mSignal.cancel();
+			throw;
+		}
+	}
+
+	asio::awaitable<void> waitSignal() {
+		mSignal.expires_at(Clock::time_point::max());
+		co_await mSignal.async_wait(asio::as_tuple(use_awaitable));
+	}
+
+	network::Channel<Stream> mChannel;
+	const BenchOptions& mOptions;
+	BenchStats& mStats;
+	Clock::time_point mDeadline;
+	std::string mPayload;
+	uint16_t mType = 0;
+	std::vector<Clock::time_point> mSendTimes;
+	std::vector<uint32_t> mFreeSlots;
+	bool mClosed = false;
+	asio::steady_timer mSignal;
+};
+
+/*
+ * Drives `connections` benchmark connections spread over `threads` io
+ * threads, each with its own io_context and statistics, and prints the
+ * merged throughput and latency percentiles once the run is over.
+ */
+struct LoadGenerator {
+	explicit LoadGenerator(BenchOptions options)
+		: mOptions(std::move(options))
+	{}
+
+	void run() {
+		spdlog::info("[Bench]: {} connections over {} threads to {}:{} ({}), {}, {} for {}s",
+			mOptions.connections, mOptions.threads, mOptions.host, mOptions.port, mOptions.ssl ? "ssl" : "tcp",
+			mOptions.ledger ? std::string("ledger transfers") : fmt::format("{} byte payloads", mOptions.payloadSize),
+			mOptions.rate > 0 ? fmt::format("{} req/s", mOptions.rate) : fmt::format("depth {}", mOptions.depth),
+			mOptions.duration.count());
+
+		auto start = Clock::now();
+		auto deadline = start + mOptions.duration;
+		std::vector<std::thread> threads;
+
+		for (size_t i = 0; i < mOptions.threads; ++i) {
+			threads.emplace_back([this, i, deadline] { runThread(i, deadline); });
+		}
+
+		for (auto& thread: threads) {
+			thread.join();
+		}
+
+		report(std::chrono::duration<double>(Clock::now() - start).count());
+	}
+
+private:
+	void runThread(size_t index, Clock::time_point deadline) {
+		auto stats = BenchStats{};
+
+		try {
+			asio::io_context io(1);
+			auto endpoint = *tcp::resolver(io).resolve(mOptions.host, mOptions.port);
+			auto connections = mOptions.connections / mOptions.threads + (index < mOptions.connections % mOptions.threads);
+
+			if (mOptions.ssl) {
+				auto client = SslClient{io};
+				spawnConnections(io, client, endpoint, connections, stats, deadline);
+				io.run();
+				stats.resumed = client.resumed();
+			} else {
+				auto client = TcpClient{io};
+				spawnConnections(io, client, endpoint, connections, stats, deadline);
+				io.run();
+			}
+		} catch (const std::exception& error) {
+			spdlog::error("[Bench]: thread #{} failed: {}", index, error.what());
+		}
+
+		auto lock = std::lock_guard{mMutex};
+		mStats.merge(stats);
+	}
+
+	void spawnConnections(asio::io_context& io, auto& client, tcp::endpoint endpoint, size_t count,
+		BenchStats& stats, Clock::time_point deadline)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			asio::co_spawn(io, [this, &client, &stats, endpoint, deadline]() -> asio::awaitable<void> {
+				try {
+					do {
+						auto connection = BenchConnection{co_await client.connectStream(endpoint), mOptions, stats, deadline};
+						++stats.connects;
+						co_await connection.run();
+					} while (mOptions.reconnect && Clock::now() < deadline);
+				} catch (const std::exception& error) {
+					++stats.errors;
+					spdlog::error("[Bench]: connection failed: {}", error.what());
+				}
+			}, asio::detached);
+		}
+	}
+
+	void report(double seconds) {
+		auto us = [this](double quantile) { return mStats.latency.percentile(quantile) / 1000.0; };
+
+		fmt::print("requests:   {} in {:.2f}s, {} errors\n", mStats.requests, seconds, mStats.errors);
+		fmt::print("connects:   {} ({} tls resumed)\n", mStats.connects, mStats.resumed);
+		fmt::print("throughput: {:.0f} req/s, {:.2f} MiB/s received\n",
+			mStats.requests / seconds, mStats.bytes / seconds / (1024 * 1024));
+		fmt::print("latency us: min {:.1f}  mean {:.1f}  p50 {:.1f}  p99 {:.1f}  p999 {:.1f}  max {:.1f}\n",
+			mStats.latency.min() / 1000.0, mStats.latency.mean() / 1000.0, us(0.5), us(0.99), us(0.999),
+			mStats.latency.max() / 1000.0);
+	}
+
+	BenchOptions mOptions;
+	std::mutex mMutex;
+	BenchStats mStats;
+};
+
+} //namespace client
@@ -4,6 +4,8 @@
 #include <asio.hpp>
 #include <asio/ssl.hpp>
 
+#include <memory>
+
 #include "session.hpp"
 
 using asio::ip::tcp;
@@ -48,12 +50,22 @@ struct TcpClient: Client {
 	}
 
 	asio::awaitable<Session<network::TcpStream>> connect(tcp::endpoint endpoint) {
+		co_return Session{co_await connectStream(endpoint)};
+	}
+
+	asio::awaitable<network::TcpStream> connectStream(tcp::endpoint endpoint) {
 		tcp::socket socket(mIo);
 		co_await socket.async_connect(endpoint, use_awaitable);
-		co_return Session{network::TcpStream{std::move(socket)}};
+		socket.set_option(tcp::no_delay(true));
+		co_return network::TcpStream{std::move(socket)};
 	}
 };
 
+/*
+ * Keeps the most recent session (or TLS 1.3 ticket) the server handed out
+ * and offers it on every new connection, so reconnects resume instead of
+ * redoing the full key exchange.
+ */
 struct SslClient: Client {
 	SslClient(asio::io_context& io)
 		: Client(io)
@@ -61,6 +73,17 @@ struct SslClient: Client {
 	{
 		mSslCtx.set_default_verify_paths();
 		mSslCtx.set_verify_mode(asio::ssl::verify_none);
+
+		// Tickets arrive after the handshake in TLS 1.3, so sessions are
+		// collected from the new-session callback rather than on connect.
+		auto* handle = mSslCtx.native_handle();
+		SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_set_ex_data(handle, exDataIndex(), this);
+		SSL_CTX_sess_set_new_cb(handle, &SslClient::onNewSession);
+	}
+
+	~SslClient() {
+		SSL_CTX_sess_set_new_cb(mSslCtx.native_handle(), nullptr);
 	}
 
 
@@ -69,14 +92,45 @@ struct SslClient: Client {
 	}
 
 	asio::awaitable<Session<network::SslStream>> connect(tcp::endpoint endpoint) {
+		co_return Session{co_await connectStream(endpoint)};
+	}
+
+	asio::awaitable<network::SslStream> connectStream(tcp::endpoint endpoint) {
 		auto socket = network::SslSocket{mIo, mSslCtx};
+
+		if (mSession) {
+			SSL_set_session(socket.native_handle(), mSession.get());
+		}
+
 		co_await socket.lowest_layer().async_connect(endpoint, use_awaitable);
+		socket.lowest_layer().set_option(tcp::no_delay(true));
 		co_await socket.async_handshake(asio::ssl::stream_base::client, use_awaitable);
-		co_return Session{network::SslStream{std::move(socket)}};
+
+		if (SSL_session_reused(socket.native_handle())) {
+			++mResumed;
+		}
+
+		co_return network::SslStream{std::move(socket)};
 	}
 
+	uint64_t resumed() const { return mResumed; }
+
 private:
+	// The app data slot belongs to asio's verify callback.
+	static int exDataIndex() {
+		static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	static int onNewSession(SSL* ssl, SSL_SESSION* session) {
+		auto* self = static_cast<SslClient*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), exDataIndex()));
+		self->mSession = std::shared_ptr<SSL_SESSION>{session, SSL_SESSION_free};
+		return 1;	// we took ownership of the reference
+	}
+
 	asio::ssl::context mSslCtx;
+	std::shared_ptr<SSL_SESSION> mSession;
+	uint64_t mResumed = 0;
 };
 
 } //namespace client
\ No newline at end of file
@@ -0,0 +1,99 @@
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace client {
+
+/*
+ * HDR-style log-linear histogram: values below 128 get exact buckets, every
+ * power of two above that is split into 64 linear sub-buckets, so any
+ * recorded value is reported with less than 1.6% relative error while the
+ * whole 64-bit range fits in a few thousand counters.
+ */
+struct Histogram {
+	static constexpr unsigned subBucketBits = 7;
+	static constexpr uint64_t subBucketCount = 1ull << subBucketBits;
+	static constexpr uint64_t halfCount = subBucketCount / 2;
+	static constexpr size_t bucketCount = subBucketCount + (64 - subBucketBits) * halfCount;
+
+	Histogram()
+		: mCounts(bucketCount, 0)
+	{}
+
+	void record(uint64_t value) {
+		++mCounts[indexOf(value)];
+		++mTotal;
+		mMin = std::min(mMin, value);
+		mMax = std::max(mMax, value);
+		mSum += value;
+	}
+
+	void merge(const Histogram& other) {
+		for (size_t i = 0; i < bucketCount; ++i) {
+			mCounts[i] += other.mCounts[i];
+		}
+
+		mTotal += other.mTotal;
+		mMin = std::min(mMin, other.mMin);
+		mMax = std::max(mMax, other.mMax);
+		mSum += other.mSum;
+	}
+
+	// Smallest recorded value such that `quantile` of all values are <= it.
+	uint64_t percentile(double quantile) const {
+		if (!mTotal) {
+			return 0;
+		}
+
+		auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * mTotal + 0.5));
+		uint64_t seen = 0;
+
+		for (size_t i = 0; i < bucketCount; ++i) {
+			seen += mCounts[i];
+			if (seen >= rank) {
+				return std::min(upperBoundOf(i), mMax);
+			}
+		}
+
+		return mMax;
+	}
+
+	uint64_t count() const { return mTotal; }
+	uint64_t min() const { return mTotal ? mMin : 0; }
+	uint64_t max() const { return mMax; }
+	double mean() const { return mTotal ? static_cast<double>(mSum) / mTotal : 0.0; }
+
+private:
+	static size_t indexOf(uint64_t value) {
+		if (value < subBucketCount) {
+			return value;
+		}
+
+		auto shift = std::bit_width(value) - subBucketBits;
+		auto mantissa = value >> shift;	// in [halfCount, subBucketCount)
+		return subBucketCount + (shift - 1) * halfCount + (mantissa - halfCount);
+	}
+
+	static uint64_t upperBoundOf(size_t index) {
+		if (index < subBucketCount) {
+			return index;
+		}
+
+		auto shift = (index - subBucketCount) / halfCount + 1;
+		auto mantissa = (index - subBucketCount) % halfCount + halfCount;
+		return ((mantissa + 1) << shift) - 1;
+	}
+
+	std::vector<uint64_t> mCounts;
+	uint64_t mTotal = 0;
+	uint64_t mMin = std::numeric_limits<uint64_t>::max();
+	uint64_t mMax = 0;
+	uint64_t mSum = 0;
+};
+
+} //namespace client
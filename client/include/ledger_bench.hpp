@@ -0,0 +1,146 @@
+
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include "ledger/ledger.hpp"
+#include "histogram.hpp"
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace client {
+
+struct LedgerBenchOptions {
+	size_t accounts = 1 << 20;
+	size_t legs = 2;
+	size_t transactions = 10'000'000;
+
+	static LedgerBenchOptions parse(int argc, char** argv) {
+		auto options = LedgerBenchOptions{};
+
+		for (int i = 0; i < argc; ++i) {
+			std::string arg = argv[i];
+
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc) {
+					throw std::runtime_error("[LedgerBench]: missing value for " + arg);
+				}
+				return argv[++i];
+			};
+
+			if (arg == "--accounts") {
+				options.accounts = std::stoul(value());
+			} else if (arg == "--legs") {
+				options.legs = std::stoul(value());
+			} else if (arg == "--transactions") {
+				options.transactions = std::stoul(value());
+			} else {
+				throw std::runtime_error("[LedgerBench]: unknown option " + arg);
+			}
+		}
+
+		if (options.legs < 2 || options.legs > ledger::PostTransaction::maxLegs || options.accounts < options.legs) {
+			throw std::runtime_error("[LedgerBench]: --legs must be in [2, 16] and no more than --accounts");
+		}
+
+		return options;
+	}
+};
+
+/*
+ * In-process microbenchmark of the ledger core: posts random balanced
+ * transactions over uniformly chosen accounts on a single thread and reports
+ * the sustained posting rate. The transactions are generated up front into a
+ * ring that is replayed, so neither the RNG nor allocation is timed.
+ */
+struct LedgerBenchmark {
+	static constexpr size_t ringSize = 1 << 16;
+	static constexpr size_t batchSize = 1024;	// transactions per latency sample
+
+	explicit LedgerBenchmark(LedgerBenchOptions options)
+		: mOptions(options)
+	{}
+
+	void run() {
+		auto book = ledger::Ledger{};
+		book.reserve(mOptions.accounts);
+
+		for (size_t i = 0; i < mOptions.accounts; ++i) {
+			book.openAccount(ledger::currencyCode("EUR"));
+		}
+
+		auto ring = generate();
+		auto batches = Histogram{};
+		uint64_t rejected = 0;
+
+		spdlog::info("[LedgerBench]: {} transactions of {} legs over {} accounts",
+			mOptions.transactions, mOptions.legs, mOptions.accounts);
+
+		auto start = std::chrono::steady_clock::now();
+		auto batchStart = start;
+
+		for (size_t i = 0; i < mOptions.transactions; ++i) {
+			auto* legs = &ring[(i % ringSize) * mOptions.legs];
+
+			if (book.post({legs, mOptions.legs}).status != ledger::Status::ok) {
+				++rejected;
+			}
+
+			if ((i + 1) % batchSize == 0) {
+				auto now = std::chrono::steady_clock::now();
+				batches.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - batchStart).count());
+				batchStart = now;
+			}
+		}
+
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		auto perPosting = [&](double quantile) { return static_cast<double>(batches.percentile(quantile)) / batchSize; };
+
+		fmt::print("transactions: {} in {:.3f}s, {} rejected\n", mOptions.transactions, seconds, rejected);
+		fmt::print("throughput:   {:.0f} tx/s, {:.0f} legs/s\n",
+			mOptions.transactions / seconds, mOptions.transactions * mOptions.legs / seconds);
+		fmt::print("ns per tx:    mean {:.1f}  p50 {:.1f}  p99 {:.1f}  max {:.1f} (over batches of {})\n",
+			seconds * 1e9 / mOptions.transactions, perPosting(0.5), perPosting(0.99),
+			static_cast<double>(batches.max()) / batchSize, batchSize);
+	}
+
+private:
+	std::vector<ledger::Leg> generate() const {
+		auto random = std::mt19937_64{42};
+		auto account = std::uniform_int_distribution<ledger::AccountId>(0, mOptions.accounts - 1);
+		auto amount = std::uniform_int_distribution<ledger::Amount>(1, 100'000);
+		auto ring = std::vector<ledger::Leg>(ringSize * mOptions.legs);
+
+		for (size_t i = 0; i < ringSize; ++i) {
+			auto* legs = &ring[i * mOptions.legs];
+			ledger::Amount sum = 0;
+
+			for (size_t leg = 0; leg < mOptions.legs; ++leg) {
+				bool unique;
+				do {
+					legs[leg].account = account(random);
+					unique = true;
+					for (size_t other = 0; other < leg; ++other) {
+						unique = unique && legs[other].account != legs[leg].account;
+					}
+				} while (!unique);
+
+				if (leg + 1 < mOptions.legs) {
+					legs[leg].amount = amount(random);
+					sum += legs[leg].amount;
+				} else {
+					legs[leg].amount = -sum;
+				}
+			}
+		}
+
+		return ring;
+	}
+
+	LedgerBenchOptions mOptions;
+};
+
+} //namespace client
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <asio.hpp>
+#include <asio/experimental/awaitable_operators.hpp>
 #include <streambuf>
 
 #include "network/channel.hpp"
@@ -20,11 +21,16 @@ struct Session {
 	Session(Session&& other)
 		: mChannel{std::move(other.mChannel)}
 		, mNum(other.mNum)
+		, mLastRequestId(other.mLastRequestId)
+		, mPending(other.mPending)
+		, mRepliesDone{mChannel.executor()}
 	{}
 
 	Session& operator=(Session&& other) {
 		std::swap(mChannel, other.mChannel);
 		std::swap(mNum, other.mNum);
+		std::swap(mLastRequestId, other.mLastRequestId);
+		std::swap(mPending, other.mPending);
 	}
 
 	~Session();
@@ -32,16 +38,25 @@ struct Session {
 	explicit Session(Stream&& stream)
 		: mChannel{std::move(stream)}
 		, mNum(++sSessionCounter)
+		, mRepliesDone{mChannel.executor()}
 	{}
 
 	uint32_t num() const { return mNum; }
 	asio::awaitable<void> run();
 
 private:
+	asio::awaitable<void> sendInput();
+	asio::awaitable<void> receiveReplies();
 	void close();
-	uint32_t mNum;
 
 	network::Channel<Stream> mChannel;
+	uint32_t mNum;
+
+	// Lines are sent as soon as they are typed; replies are matched by
+	// request id whenever they arrive.
+	uint64_t mLastRequestId = 0;
+	size_t mPending = 0;
+	asio::steady_timer mRepliesDone;
 };
 
 template <typename Stream>
@@ -57,6 +72,14 @@ asio::awaitable<void> Session<Stream>::run() {
 	spdlog::info("[Session] #{}: Started new {} session with {}", mNum, isSecure, mChannel.remoteEndpoint());
 	spdlog::info("[Session] #{}: Type \":exit\" to exit", mNum);
 
+	using namespace asio::experimental::awaitable_operators;
+	co_await (sendInput() || receiveReplies());
+
+	co_await mChannel.shutdown();
+}
+
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::sendInput() {
 	auto inputStream = asio::streambuf{1024};
 	auto streamDescriptor = asio::posix::stream_descriptor{co_await asio::this_coro::executor, ::dup(STDIN_FILENO)};
 
@@ -71,14 +94,29 @@ asio::awaitable<void> Session<Stream>::run() {
 			break;
 		}
 
-		spdlog::info("[Session] #{}: Sending message \"{}\"", mNum, message);
+		auto requestId = ++mLastRequestId;
+		spdlog::info("[Session] #{}: Sending request #{} \"{}\"", mNum, requestId, message);
 
-		co_await mChannel.sendMessage(message);
-		auto reply = co_await mChannel.getMessage();
-		spdlog::info("[Session] #{}: got reply from the server: {}", mNum, reply);
+		++mPending;
+		co_await mChannel.sendFrame(0, requestId, message);
 	}
 
-	co_await mChannel.shutdown();
+	while (mPending) {
+		mRepliesDone.expires_at(asio::steady_timer::time_point::max());
+		co_await mRepliesDone.async_wait(asio::as_tuple(use_awaitable));
+	}
+}
+
+template <typename Stream>
+asio::awaitable<void> Session<Stream>::receiveReplies() {
+	while (true) {
+		auto reply = co_await mChannel.getFrame();
+		spdlog::info("[Session] #{}: got reply #{} from the server: {}", mNum, reply.requestId, reply.payload);
+
+		if (mPending && --mPending == 0) {
+			mRepliesDone.cancel();
+		}
+	}
 }
 
 template <typename Stream>
@@ -2,9 +2,34 @@
 #include "spdlog/spdlog.h"
 
 #include "client.hpp"
+#include "bench.hpp"
+#include "ledger_bench.hpp"
 
+#include <string_view>
+
+// Usage:
+//   client                 interactive session over SSL to 0.0.0.0:8443
+//   client bench [options] load generator, see client::BenchOptions::parse
+//   client ledger-bench [options]
+//                          in-process ledger microbenchmark, see client::LedgerBenchOptions::parse
 int main(int argc, char** argv) {
 	try {
+		if (argc > 1 && std::string_view(argv[1]) == "bench") {
+			spdlog::set_level(spdlog::level::info);
+
+			auto generator = client::LoadGenerator{client::BenchOptions::parse(argc - 2, argv + 2)};
+			generator.run();
+			return 0;
+		}
+
+		if (argc > 1 && std::string_view(argv[1]) == "ledger-bench") {
+			spdlog::set_level(spdlog::level::info);
+
+			auto benchmark = client::LedgerBenchmark{client::LedgerBenchOptions::parse(argc - 2, argv + 2)};
+			benchmark.run();
+			return 0;
+		}
+
 		spdlog::set_level(spdlog::level::debug);
 
 		asio::io_context io;
@@ -19,4 +44,4 @@ int main(int argc, char** argv) {
 	} catch (const std::exception& error) {
 		spdlog::error("{}", error.what());
 	}
-}
\ No newline at end of file
+}
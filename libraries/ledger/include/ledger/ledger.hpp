@@ -0,0 +1,183 @@
+#pragma once
+
+#include "ledger/protocol.hpp"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ledger {
+
+/*
+ * The double-entry ledger core. Account ids are dense indices handed out in
+ * opening order, and per-account state is kept as a struct of arrays, so a
+ * posting touches one balance word per leg and validation reads one currency
+ * word per leg, with no hashing and no pointer chasing.
+ *
+ * A transaction is a set of legs whose amounts sum to zero in every currency
+ * it touches. It is validated in full before any balance changes, so a
+ * rejected transaction leaves the ledger untouched.
+ *
+ * Not thread-safe: callers serialise access.
+ */
+struct Ledger {
+	struct PostResult {
+		Status status = Status::ok;
+		uint64_t transaction = 0;
+	};
+
+	Ledger() = default;
+	Ledger(const Ledger&) = delete;
+	Ledger& operator=(const Ledger&) = delete;
+
+	void reserve(size_t accounts) {
+		mBalances.reserve(accounts);
+		mCurrencies.reserve(accounts);
+	}
+
+	AccountId openAccount(Currency currency) {
+		mBalances.push_back(0);
+		mCurrencies.push_back(currency);
+		return static_cast<AccountId>(mBalances.size() - 1);
+	}
+
+	PostResult post(std::span<const Leg> legs) {
+		if (auto status = validate(legs); status != Status::ok) {
+			return {status, 0};
+		}
+
+		for (auto& leg: legs) {
+			mBalances[leg.account] += leg.amount;
+		}
+
+		return {Status::ok, ++mLastTransaction};
+	}
+
+	// Posting in parts, for a transaction whose legs are spread over several
+	// ledgers: checkLegs() on the transaction, checkLeg() on the ledger of
+	// every leg, checkBalanced() with the currencies those reported, then
+	// apply() per leg. The statuses are post()'s, though of several faults
+	// another one may be reported first.
+	static Status checkLegs(std::span<const Leg> legs) {
+		if (legs.size() < 2 || legs.size() > PostTransaction::maxLegs) {
+			return Status::invalidLeg;
+		}
+
+		for (size_t i = 0; i < legs.size(); ++i) {
+			if (legs[i].amount == 0) {
+				return Status::invalidLeg;
+			}
+
+			for (size_t j = 0; j < i; ++j) {
+				if (legs[j].account == legs[i].account) {
+					return Status::invalidLeg;
+				}
+			}
+		}
+
+		return Status::ok;
+	}
+
+	Status checkLeg(AccountId account, Amount amount) const {
+		if (!exists(account)) {
+			return Status::unknownAccount;
+		}
+
+		Amount updated;
+		if (__builtin_add_overflow(mBalances[account], amount, &updated)) {
+			return Status::overflow;
+		}
+
+		return Status::ok;
+	}
+
+	// `currencyOf(i)` is the currency of the account of legs[i].
+	template <typename CurrencyOf>
+	static Status checkBalanced(std::span<const Leg> legs, CurrencyOf currencyOf) {
+		for (size_t i = 0; i < legs.size(); ++i) {
+			auto currency = currencyOf(i);
+			bool first = true;
+			Amount sum = 0;
+
+			for (size_t j = 0; j < legs.size(); ++j) {
+				if (currencyOf(j) != currency) {
+					continue;
+				}
+
+				if (j < i) {
+					first = false;	// this currency has already been summed
+					break;
+				}
+
+				if (__builtin_add_overflow(sum, legs[j].amount, &sum)) {
+					return Status::overflow;
+				}
+			}
+
+			if (first && sum != 0) {
+				return Status::unbalanced;
+			}
+		}
+
+		return Status::ok;
+	}
+
+	void apply(AccountId account, Amount amount) { mBalances[account] += amount; }
+
+	bool exists(AccountId account) const { return account < mBalances.size(); }
+	Amount balance(AccountId account) const { return mBalances[account]; }
+	Currency currency(AccountId account) const { return mCurrencies[account]; }
+
+	size_t accounts() const { return mBalances.size(); }
+	uint64_t transactions() const { return mLastTransaction; }
+
+	// The raw columns, indexed by account id, for snapshots.
+	std::span<const Amount> balances() const { return mBalances; }
+	std::span<const Currency> currencies() const { return mCurrencies; }
+
+	// Replaces the whole state with one read back from a snapshot.
+	void restore(std::span<const Amount> balances, std::span<const Currency> currencies, uint64_t lastTransaction) {
+		mBalances.assign(balances.begin(), balances.end());
+		mCurrencies.assign(currencies.begin(), currencies.end());
+		mLastTransaction = lastTransaction;
+	}
+
+private:
+	// Legs are few (PostTransaction::maxLegs at most), so the pairwise scans
+	// below are cheaper than any auxiliary structure.
+	Status validate(std::span<const Leg> legs) const {
+		if (legs.size() < 2 || legs.size() > PostTransaction::maxLegs) {
+			return Status::invalidLeg;
+		}
+
+		for (size_t i = 0; i < legs.size(); ++i) {
+			if (!exists(legs[i].account)) {
+				return Status::unknownAccount;
+			}
+
+			if (legs[i].amount == 0) {
+				return Status::invalidLeg;
+			}
+
+			// One leg per account keeps the overflow check below exact.
+			for (size_t j = 0; j < i; ++j) {
+				if (legs[j].account == legs[i].account) {
+					return Status::invalidLeg;
+				}
+			}
+
+			Amount updated;
+			if (__builtin_add_overflow(mBalances[legs[i].account], legs[i].amount, &updated)) {
+				return Status::overflow;
+			}
+		}
+
+		return checkBalanced(legs, [&](size_t i) { return mCurrencies[legs[i].account]; });
+	}
+
+	std::vector<Amount> mBalances;
+	std::vector<Currency> mCurrencies;
+	uint64_t mLastTransaction = 0;
+};
+
+} //namespace ledger
@@ -0,0 +1,318 @@
+#pragma once
+
+#include "network/frame.hpp"
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+namespace ledger {
+
+using AccountId = uint32_t;
+using Amount = int64_t;	// minor units of the account's currency
+using Currency = uint32_t;
+
+// Packs a three letter ISO 4217 code, e.g. currencyCode("EUR").
+constexpr Currency currencyCode(std::string_view code) {
+	Currency currency = 0;
+	for (size_t i = 0; i < code.size() && i < 4; ++i) {
+		currency |= static_cast<Currency>(static_cast<uint8_t>(code[i])) << (8 * i);
+	}
+	return currency;
+}
+
+/*
+ * Request types carried in the frame header. Every reply echoes the type and
+ * request id of its request; its payload starts with a Status, followed by
+ * the type specific result fields when the status is ok.
+ *
+ *   echo             payload                   -> payload + " yourself!" (no status)
+ *   openAccount      currency u32              -> status u16, account u32
+ *   postTransaction  legCount u16, legs[]      -> status u16, transaction u64
+ *                    (account u32, amount i64)
+ *   getBalance       account u32               -> status u16, balance i64, currency u32
+ *   getHistory       account u32, cursor,      -> pages of: status u16, more u16, cursor,
+ *                    limit u32                    count u16, rows[] (transaction u64,
+ *                                                 time u64, amount i64)
+ *   getReport        account u32, from u64,    -> status u16, count u16, rows[] (currency u32,
+ *                    to u64                       postings u64, debits i64, credits i64)
+ *
+ * The writes, openAccount and postTransaction, may end with an idempotency
+ * key (16 bytes, all zero meaning none). A request repeating a key within
+ * the server's retention gets the reply of the first one instead of being
+ * executed again, or keyReused if the rest of its payload differs. While
+ * too many writes with keys are still executing to remember another one, a
+ * new key gets busy, and the request may be retried.
+ *
+ * getHistory is answered with a stream of frames, all with its type and
+ * request id, each holding a page of the account's postings; `more` is 1 on
+ * every frame but the last. The cursor (HistoryCursor) of a page is where
+ * the history continues after it, so a client that stopped after `limit`
+ * rows (0 for no limit), or that wants the postings made since, sends the
+ * last one back. Postings come in rounds, each in the order they were made,
+ * of those logged since the previous round: one logged late may have been
+ * made before postings an earlier round already returned.
+ *
+ * getReport totals the postings made in [from, to), in microseconds since
+ * the Unix epoch, per currency: of one account, or of all of them with
+ * GetReport::allAccounts. Reports only cover closed accounting periods; a
+ * range reaching into an open one gets periodOpen.
+ */
+enum class MessageType : uint16_t {
+	echo = 0,
+	openAccount = 1,
+	postTransaction = 2,
+	getBalance = 3,
+	getHistory = 4,
+	getReport = 5,
+};
+
+enum class Status : uint16_t {
+	ok = 0,
+	malformed = 1,
+	unknownType = 2,
+	unknownAccount = 3,
+	unbalanced = 4,
+	invalidLeg = 5,
+	overflow = 6,
+	keyReused = 7,
+	periodOpen = 8,
+	busy = 9,
+};
+
+constexpr std::string_view toString(Status status) {
+	switch (status) {
+		case Status::ok: return "ok";
+		case Status::malformed: return "malformed";
+		case Status::unknownType: return "unknown type";
+		case Status::unknownAccount: return "unknown account";
+		case Status::unbalanced: return "unbalanced";
+		case Status::invalidLeg: return "invalid leg";
+		case Status::overflow: return "overflow";
+		case Status::keyReused: return "idempotency key reused";
+		case Status::periodOpen: return "period not closed";
+		case Status::busy: return "busy, retry later";
+	}
+	return "unknown status";
+}
+
+// Little-endian field reader over a request or reply payload. Reads past the
+// end leave the value untouched and mark the reader as failed.
+struct PayloadReader {
+	explicit PayloadReader(std::string_view payload)
+		: mData{reinterpret_cast<const uint8_t*>(payload.data())}
+		, mSize{payload.size()}
+	{}
+
+	template <typename T>
+	PayloadReader& read(T& value) {
+		if (mSize - mOffset < sizeof(T)) {
+			mFailed = true;
+			return *this;
+		}
+
+		uint64_t raw = 0;
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			raw |= static_cast<uint64_t>(mData[mOffset + i]) << (8 * i);
+		}
+
+		mOffset += sizeof(T);
+		value = static_cast<T>(raw);
+		return *this;
+	}
+
+	// True when every read succeeded and the whole payload was consumed.
+	bool complete() const { return !mFailed && mOffset == mSize; }
+	bool failed() const { return mFailed; }
+	size_t remaining() const { return mSize - mOffset; }
+
+private:
+	const uint8_t* mData;
+	size_t mSize;
+	size_t mOffset = 0;
+	bool mFailed = false;
+};
+
+// Chosen by the client, e.g. a random UUID, and sent again with every retry
+// of the same write.
+struct IdempotencyKey {
+	static constexpr size_t size = 2 * sizeof(uint64_t);
+
+	uint64_t high = 0;
+	uint64_t low = 0;
+
+	bool empty() const { return !high && !low; }
+	bool operator==(const IdempotencyKey&) const = default;
+
+	// Reads the key if exactly its size is left of the payload.
+	void decodeTrailing(PayloadReader& reader) {
+		if (reader.remaining() == size) {
+			reader.read(high).read(low);
+		}
+	}
+
+	void encodeTrailing(network::FrameWriter& writer) const {
+		if (!empty()) {
+			writer.appendLe(high).appendLe(low);
+		}
+	}
+};
+
+struct Leg {
+	AccountId account = 0;
+	Amount amount = 0;	// positive debits the account, negative credits it
+};
+
+struct OpenAccount {
+	static constexpr auto type = MessageType::openAccount;
+
+	Currency currency = 0;
+	IdempotencyKey key;
+
+	bool decode(std::string_view payload) {
+		auto reader = PayloadReader{payload};
+		reader.read(currency);
+		key.decodeTrailing(reader);
+		return reader.complete();
+	}
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(currency);
+		key.encodeTrailing(writer);
+	}
+};
+
+struct PostTransaction {
+	static constexpr auto type = MessageType::postTransaction;
+	static constexpr size_t maxLegs = 16;
+
+	uint16_t legCount = 0;
+	std::array<Leg, maxLegs> legs;
+	IdempotencyKey key;
+
+	bool decode(std::string_view payload) {
+		auto reader = PayloadReader{payload};
+
+		if (reader.read(legCount).failed() || legCount > maxLegs) {
+			return false;
+		}
+
+		for (size_t i = 0; i < legCount; ++i) {
+			reader.read(legs[i].account).read(legs[i].amount);
+		}
+
+		key.decodeTrailing(reader);
+		return reader.complete();
+	}
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(legCount);
+		for (size_t i = 0; i < legCount; ++i) {
+			writer.appendLe(legs[i].account).appendLe(legs[i].amount);
+		}
+
+		key.encodeTrailing(writer);
+	}
+};
+
+// A position in an account's history: in the round of the postings logged
+// by the log records in (after, through], after the posting made at `time`
+// (microseconds since the Unix epoch) by the log record `sequence`. A cursor
+// with `after` equal to `through` has finished its round; the zero cursor is
+// the beginning.
+struct HistoryCursor {
+	static constexpr size_t size = 4 * sizeof(uint64_t);
+
+	uint64_t time = 0;
+	uint64_t sequence = 0;
+	uint64_t after = 0;
+	uint64_t through = 0;
+
+	void decode(PayloadReader& reader) {
+		reader.read(time).read(sequence).read(after).read(through);
+	}
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(time).appendLe(sequence).appendLe(after).appendLe(through);
+	}
+};
+
+struct HistoryRow {
+	static constexpr size_t size = sizeof(uint64_t) + sizeof(uint64_t) + sizeof(Amount);
+
+	uint64_t transaction = 0;
+	uint64_t time = 0;
+	Amount amount = 0;	// the account's leg
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(transaction).appendLe(time).appendLe(amount);
+	}
+};
+
+struct GetBalance {
+	static constexpr auto type = MessageType::getBalance;
+
+	AccountId account = 0;
+
+	bool decode(std::string_view payload) {
+		return PayloadReader{payload}.read(account).complete();
+	}
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(account);
+	}
+};
+
+struct GetHistory {
+	static constexpr auto type = MessageType::getHistory;
+
+	AccountId account = 0;
+	HistoryCursor cursor;
+	uint32_t limit = 0;
+
+	bool decode(std::string_view payload) {
+		auto reader = PayloadReader{payload};
+		reader.read(account);
+		cursor.decode(reader);
+		reader.read(limit);
+		return reader.complete();
+	}
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(account);
+		cursor.encode(writer);
+		writer.appendLe(limit);
+	}
+};
+
+struct GetReport {
+	static constexpr auto type = MessageType::getReport;
+	static constexpr AccountId allAccounts = ~AccountId{0};
+
+	AccountId account = allAccounts;
+	uint64_t from = 0;
+	uint64_t to = 0;
+
+	bool decode(std::string_view payload) {
+		return PayloadReader{payload}.read(account).read(from).read(to).complete();
+	}
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(account).appendLe(from).appendLe(to);
+	}
+};
+
+struct ReportRow {
+	static constexpr size_t size = sizeof(Currency) + sizeof(uint64_t) + 2 * sizeof(Amount);
+
+	Currency currency = 0;
+	uint64_t postings = 0;
+	Amount debits = 0;	// the sum of the positive amounts
+	Amount credits = 0;	// the sum of the negative ones, negated
+
+	void encode(network::FrameWriter& writer) const {
+		writer.appendLe(currency).appendLe(postings).appendLe(debits).appendLe(credits);
+	}
+};
+
+} //namespace ledger
@@ -0,0 +1,170 @@
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace network {
+
+struct BufferPool;
+
+/*
+ * A move-only handle to a block borrowed from a BufferPool, or from any other
+ * memory resource such as a session's arena. The block goes back to where it
+ * came from when the handle is reset or destroyed, which must happen on the
+ * thread that borrowed it.
+ */
+struct PooledBuffer {
+	PooledBuffer() = default;
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+	PooledBuffer(PooledBuffer&& other)
+		: mResource{std::exchange(other.mResource, nullptr)}
+		, mData{std::exchange(other.mData, nullptr)}
+		, mCapacity{std::exchange(other.mCapacity, 0)}
+	{}
+
+	PooledBuffer& operator=(PooledBuffer&& other) {
+		std::swap(mResource, other.mResource);
+		std::swap(mData, other.mData);
+		std::swap(mCapacity, other.mCapacity);
+		return *this;
+	}
+
+	~PooledBuffer() { reset(); }
+
+	// Borrows exactly `size` bytes from `resource`.
+	static PooledBuffer allocate(std::pmr::memory_resource& resource, size_t size) {
+		return PooledBuffer{&resource, static_cast<uint8_t*>(resource.allocate(size)), size};
+	}
+
+	uint8_t* data() const { return mData; }
+	size_t capacity() const { return mCapacity; }
+	explicit operator bool() const { return mData != nullptr; }
+
+	void reset();
+
+private:
+	friend struct BufferPool;
+
+	PooledBuffer(std::pmr::memory_resource* resource, uint8_t* data, size_t capacity)
+		: mResource{resource}
+		, mData{data}
+		, mCapacity{capacity}
+	{}
+
+	std::pmr::memory_resource* mResource = nullptr;
+	uint8_t* mData = nullptr;
+	size_t mCapacity = 0;
+};
+
+/*
+ * Per-thread pool of I/O buffers in power-of-two size classes. Channels only
+ * hold a buffer while data is actually in flight, so idle connections cost
+ * no buffer memory and busy ones reuse warm blocks without touching malloc.
+ * Requests above the largest class are served straight from the heap.
+ */
+struct BufferPool: std::pmr::memory_resource {
+	static constexpr size_t minBlockSize = 4 * 1024;
+	static constexpr size_t classCount = 9;	// 4 KiB .. 1 MiB
+	static constexpr size_t maxCachedBytesPerClass = 4 * 1024 * 1024;
+
+	BufferPool() = default;
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	~BufferPool() {
+		for (auto& freeList: mFreeLists) {
+			for (auto* block: freeList) {
+				::operator delete(block);
+			}
+		}
+	}
+
+	static BufferPool& local() {
+		thread_local BufferPool pool;
+		return pool;
+	}
+
+	// Borrows a block of at least `minSize` bytes; the handle's capacity is
+	// the whole block.
+	PooledBuffer acquire(size_t minSize) {
+		auto capacity = blockSize(minSize);
+		return PooledBuffer{this, static_cast<uint8_t*>(allocate(capacity)), capacity};
+	}
+
+	size_t cachedBlocks() const {
+		size_t count = 0;
+		for (auto& freeList: mFreeLists) {
+			count += freeList.size();
+		}
+		return count;
+	}
+
+private:
+	// Blocks are only ever aligned for max_align_t, like operator new's.
+	void* do_allocate(size_t size, size_t) override {
+		auto sizeClass = classOf(size);
+
+		if (sizeClass == classCount || mFreeLists[sizeClass].empty()) {
+			return ::operator new(blockSize(size));
+		}
+
+		auto* block = mFreeLists[sizeClass].back();
+		mFreeLists[sizeClass].pop_back();
+		return block;
+	}
+
+	void do_deallocate(void* block, size_t size, size_t) override {
+		release(static_cast<uint8_t*>(block), blockSize(size));
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+	static size_t blockSize(size_t size) {
+		auto sizeClass = classOf(size);
+		return sizeClass == classCount ? size : minBlockSize << sizeClass;
+	}
+
+	static size_t classOf(size_t size) {
+		size_t sizeClass = 0;
+		while (sizeClass < classCount && (minBlockSize << sizeClass) < size) {
+			++sizeClass;
+		}
+		return sizeClass;
+	}
+
+	void release(uint8_t* block, size_t capacity) {
+		auto sizeClass = classOf(capacity);
+
+		if (sizeClass == classCount || (minBlockSize << sizeClass) != capacity ||
+			(mFreeLists[sizeClass].size() + 1) * capacity > maxCachedBytesPerClass) {
+			::operator delete(block);
+			return;
+		}
+
+		mFreeLists[sizeClass].push_back(block);
+	}
+
+	std::array<std::vector<uint8_t*>, classCount> mFreeLists;
+};
+
+inline void PooledBuffer::reset() {
+	if (mData) {
+		mResource->deallocate(mData, mCapacity);
+	}
+
+	mResource = nullptr;
+	mData = nullptr;
+	mCapacity = 0;
+}
+
+} //namespace network
@@ -3,23 +3,30 @@
 
 #include "asio.hpp"
 
+#include "network/frame.hpp"
+#include "network/stream.hpp"
+
 #include <array>
+#include <chrono>
+#include <string_view>
 
 namespace network {
 
 template <typename Stream>
 struct Channel {
+	using Clock = std::chrono::steady_clock;
+
 	Channel() = delete;
 	Channel(const Channel&) = delete;
 	Channel& operator=(const Channel&) = delete;
 
 	Channel(Channel<Stream>&& other)
 		: mStream{std::move(other.mStream)}
+		, mReader{std::move(other.mReader)}
 	{}
 
-	Channel& operator=(Channel<Stream>&& other) {
-		std::swap(mStream, other.mStream);
-	}
+	// The streams are move-constructible only.
+	Channel& operator=(Channel<Stream>&& other) = delete;
 
 	Channel(Stream&& stream)
 		: mStream{std::move(stream)}
@@ -29,19 +36,35 @@ struct Channel {
 
 	bool isOpen() const { return mStream.isOpen(); }
 	std::string remoteEndpoint() const { return mStream.remoteEndpoint(); }
+	auto executor() { return mStream.executor(); }
 
-	asio::awaitable<std::string> getMessage() {
-		auto bytes = co_await mStream.asyncRead(asio::buffer(mBuffer));
-		co_return std::string{(const char*)mBuffer.data(), bytes};
-	}
+	// Bytes of outgoing frames waiting behind the write in flight.
+	size_t queuedBytes() const { return mStream.queuedBytes(); }
 
-	asio::awaitable<void> sendMessage(const std::string& message) {
-		co_await mStream.asyncWrite(asio::buffer(message));
-	}
+	// For deadlines on a read in progress: the bytes of the next frame
+	// received so far, and when the first of them arrived (or when reading
+	// resumed, for bytes that were already buffered). The time is only
+	// meaningful while some bytes are buffered.
+	size_t bufferedBytes() const { return mReader.buffered(); }
+	Clock::time_point frameStarted() const { return mFrameStarted; }
+	bool frameBuffered() const { return mReader.frameReady(); }
 
-	asio::awaitable<void> shutdown() {
-		co_await mStream.asyncShutdown();
-	}
+	bool writing() const { return mStream.writing(); }
+	Clock::time_point writeProgress() const { return mStream.writeProgress(); }
+
+	// The returned frame's payload is only valid until the next read.
+	asio::awaitable<Frame> getFrame();
+
+	asio::awaitable<void> sendFrame(uint16_t type, uint64_t requestId, std::string_view payload);
+
+	// Sends a frame built in place by the caller. Several coroutines may send
+	// concurrently, each with its own writer; the writer's block goes back
+	// to the pool once the frame has been written or queued.
+	asio::awaitable<void> sendFrame(FrameWriter& frame);
+
+	asio::awaitable<std::string_view> getMessage();
+	asio::awaitable<void> sendMessage(std::string_view message);
+	asio::awaitable<void> shutdown();
 
 	void close() {
 		if (mStream.isOpen()) {
@@ -52,7 +75,77 @@ struct Channel {
 
 private:
 	Stream mStream;
-	std::array<uint8_t, 1024> mBuffer;
+	FrameReader mReader;
+	Clock::time_point mFrameStarted;
 };
 
+/*
+ * The coroutines are defined out of line, so they are not implicitly inline
+ * and the extern declarations below keep every includer from instantiating
+ * them again: they are compiled once, in src/channel.cpp.
+ */
+template <typename Stream>
+asio::awaitable<Frame> Channel<Stream>::getFrame() {
+	// The clock is read at most once per call, and only when a read is needed.
+	bool stamped = false;
+
+	while (true) {
+		if (auto frame = mReader.next()) {
+			co_return *frame;
+		}
+
+		// Nothing is pending: give the buffer back while waiting for the
+		// peer and borrow one again only once there is data to read.
+		if (!mReader.buffered()) {
+			mReader.releaseIfEmpty();
+			co_await mStream.asyncWaitReadable();
+		} else if (!stamped) {
+			mFrameStarted = Clock::now();
+			stamped = true;
+		}
+
+		auto bytes = co_await mStream.asyncRead(mReader.prepare());
+		mReader.commit(bytes);
+
+		if (!stamped) {
+			mFrameStarted = Clock::now();
+			stamped = true;
+		}
+	}
+}
+
+template <typename Stream>
+asio::awaitable<void> Channel<Stream>::sendFrame(uint16_t type, uint64_t requestId, std::string_view payload) {
+	std::array<uint8_t, FrameHeader::size> header;
+	FrameHeader{static_cast<uint32_t>(payload.size()), type, requestId}.encode(header.data());
+
+	std::array<asio::const_buffer, 2> buffers{asio::buffer(header), asio::buffer(payload)};
+	co_await mStream.asyncWrite(buffers);
+}
+
+template <typename Stream>
+asio::awaitable<void> Channel<Stream>::sendFrame(FrameWriter& frame) {
+	co_await mStream.asyncWrite(frame.finish());
+	frame.release();
+}
+
+template <typename Stream>
+asio::awaitable<std::string_view> Channel<Stream>::getMessage() {
+	auto frame = co_await getFrame();
+	co_return frame.payload;
+}
+
+template <typename Stream>
+asio::awaitable<void> Channel<Stream>::sendMessage(std::string_view message) {
+	co_await sendFrame(0, 0, message);
+}
+
+template <typename Stream>
+asio::awaitable<void> Channel<Stream>::shutdown() {
+	co_await mStream.asyncShutdown();
+}
+
+extern template struct Channel<TcpStream>;
+extern template struct Channel<SslStream>;
+
 } //namespace network
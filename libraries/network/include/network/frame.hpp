@@ -0,0 +1,283 @@
+
+#pragma once
+
+#include "asio.hpp"
+
+#include "network/buffer_pool.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace network {
+
+/*
+ * Wire format of a single frame (all integers little-endian):
+ *
+ *   | length: u32 | type: u16 | requestId: u64 | payload: length bytes |
+ *
+ * `length` counts only the payload, so an empty frame is just a header.
+ */
+struct FrameHeader {
+	static constexpr size_t size = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint64_t);
+
+	uint32_t length = 0;
+	uint16_t type = 0;
+	uint64_t requestId = 0;
+
+	void encode(uint8_t* out) const {
+		storeLe(out, length);
+		storeLe(out + 4, type);
+		storeLe(out + 6, requestId);
+	}
+
+	static FrameHeader decode(const uint8_t* in) {
+		FrameHeader header;
+		header.length = loadLe<uint32_t>(in);
+		header.type = loadLe<uint16_t>(in + 4);
+		header.requestId = loadLe<uint64_t>(in + 6);
+		return header;
+	}
+
+private:
+	template <typename T>
+	static void storeLe(uint8_t* out, T value) {
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			out[i] = static_cast<uint8_t>(value >> (8 * i));
+		}
+	}
+
+	template <typename T>
+	static T loadLe(const uint8_t* in) {
+		T value = 0;
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			value |= static_cast<T>(in[i]) << (8 * i);
+		}
+		return value;
+	}
+};
+
+// `payload` points into the reader's buffer and stays valid until the next
+// read on the same channel.
+struct Frame {
+	uint16_t type = 0;
+	uint64_t requestId = 0;
+	std::string_view payload;
+};
+
+// A frame whose payload has been copied out of the reader's buffer into a
+// pooled block, for work that outlives the next read. The block comes from
+// `resource` when one is given and from the thread's BufferPool otherwise.
+struct PooledFrame {
+	uint16_t type = 0;
+	uint64_t requestId = 0;
+	PooledBuffer buffer;
+	size_t size = 0;
+
+	std::string_view payload() const {
+		return std::string_view{reinterpret_cast<const char*>(buffer.data()), size};
+	}
+
+	static PooledFrame copyOf(const Frame& frame, std::pmr::memory_resource* resource = nullptr) {
+		auto copy = PooledFrame{frame.type, frame.requestId, {}, frame.payload.size()};
+
+		if (copy.size) {
+			copy.buffer = resource ? PooledBuffer::allocate(*resource, copy.size) : BufferPool::local().acquire(copy.size);
+			std::memcpy(copy.buffer.data(), frame.payload.data(), copy.size);
+		}
+
+		return copy;
+	}
+};
+
+/*
+ * Reassembles frames from a byte stream. Bytes are read straight into the
+ * tail of a buffer borrowed from the thread's BufferPool (prepare/commit),
+ * complete frames are cut from its head, and the leftover partial frame is
+ * moved to the front, or into a larger block, only when the tail runs out of
+ * room. Once everything is consumed the block can be handed back with
+ * releaseIfEmpty(), so an idle reader holds no memory.
+ */
+struct FrameReader {
+	static constexpr size_t defaultMaxFrameSize = 16 * 1024 * 1024;
+	static constexpr size_t readChunkSize = BufferPool::minBlockSize;
+
+	explicit FrameReader(size_t maxFrameSize = defaultMaxFrameSize)
+		: mMaxFrameSize(maxFrameSize)
+	{}
+
+	FrameReader(FrameReader&& other) = default;
+	FrameReader& operator=(FrameReader&& other) = default;
+
+	// Returns writable space of at least `minSize` bytes (and enough for the
+	// whole pending frame, when its header is already known).
+	asio::mutable_buffer prepare(size_t minSize = readChunkSize) {
+		if (mBegin == mEnd) {
+			mBegin = mEnd = 0;
+		}
+
+		auto wanted = std::max(minSize, pendingFrameSize() - std::min(pendingFrameSize(), buffered()));
+
+		if (mBuffer.capacity() - mEnd < wanted && mBegin > 0 && mBuffer.capacity() - buffered() >= wanted) {
+			std::memmove(mBuffer.data(), mBuffer.data() + mBegin, buffered());
+			mEnd -= mBegin;
+			mBegin = 0;
+		}
+
+		if (mBuffer.capacity() - mEnd < wanted) {
+			auto buffer = BufferPool::local().acquire(std::max(mBuffer.capacity() * 2, buffered() + wanted));
+
+			if (buffered()) {
+				std::memcpy(buffer.data(), mBuffer.data() + mBegin, buffered());
+			}
+
+			mEnd -= mBegin;
+			mBegin = 0;
+			mBuffer = std::move(buffer);
+		}
+
+		return asio::buffer(mBuffer.data() + mEnd, mBuffer.capacity() - mEnd);
+	}
+
+	void commit(size_t bytes) {
+		mEnd += bytes;
+	}
+
+	std::optional<Frame> next() {
+		if (buffered() < FrameHeader::size) {
+			return std::nullopt;
+		}
+
+		auto header = FrameHeader::decode(mBuffer.data() + mBegin);
+
+		if (header.length > mMaxFrameSize) {
+			throw std::runtime_error("[FrameReader]: frame of " + std::to_string(header.length) +
+				" bytes exceeds the limit of " + std::to_string(mMaxFrameSize));
+		}
+
+		if (buffered() < FrameHeader::size + header.length) {
+			return std::nullopt;
+		}
+
+		auto payload = reinterpret_cast<const char*>(mBuffer.data() + mBegin + FrameHeader::size);
+		mBegin += FrameHeader::size + header.length;
+
+		return Frame{header.type, header.requestId, std::string_view{payload, header.length}};
+	}
+
+	// Gives the buffer back to the pool if no partial frame is pending.
+	// Invalidates the payload of the last returned frame.
+	void releaseIfEmpty() {
+		if (!buffered()) {
+			mBuffer.reset();
+			mBegin = mEnd = 0;
+		}
+	}
+
+	size_t buffered() const { return mEnd - mBegin; }
+
+	// Whether next() would return a frame without another read.
+	bool frameReady() const {
+		return buffered() >= FrameHeader::size && buffered() >= pendingFrameSize();
+	}
+
+private:
+	size_t pendingFrameSize() const {
+		if (buffered() < FrameHeader::size) {
+			return FrameHeader::size;
+		}
+
+		return FrameHeader::size + std::min<size_t>(FrameHeader::decode(mBuffer.data() + mBegin).length, mMaxFrameSize);
+	}
+
+	size_t mMaxFrameSize;
+	PooledBuffer mBuffer;
+	size_t mBegin = 0;
+	size_t mEnd = 0;
+};
+
+/*
+ * Builds outgoing frames in place: the header slot is reserved up front and
+ * patched with the payload length in finish(), so a reply is written with a
+ * single contiguous write. The block is borrowed on begin(), from the given
+ * memory resource or else the thread's BufferPool, and should be handed back
+ * with release() once the frame has been written.
+ */
+struct FrameWriter {
+	static constexpr size_t initialCapacity = 256;
+
+	FrameWriter() = default;
+
+	explicit FrameWriter(std::pmr::memory_resource* resource)
+		: mResource{resource}
+	{}
+
+	FrameWriter(FrameWriter&& other) = default;
+	FrameWriter& operator=(FrameWriter&& other) = default;
+
+	FrameWriter& begin(uint16_t type, uint64_t requestId) {
+		mSize = 0;
+		reserve(FrameHeader::size);
+		mSize = FrameHeader::size;
+		mHeader = FrameHeader{0, type, requestId};
+		return *this;
+	}
+
+	FrameWriter& append(std::string_view bytes) {
+		reserve(mSize + bytes.size());
+		std::memcpy(mBuffer.data() + mSize, bytes.data(), bytes.size());
+		mSize += bytes.size();
+		return *this;
+	}
+
+	template <typename T>
+	FrameWriter& appendLe(T value) {
+		reserve(mSize + sizeof(T));
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			mBuffer.data()[mSize++] = static_cast<uint8_t>(static_cast<std::make_unsigned_t<T>>(value) >> (8 * i));
+		}
+		return *this;
+	}
+
+	// The frame so far, header included.
+	size_t size() const { return mSize; }
+
+	asio::const_buffer finish() {
+		mHeader.length = static_cast<uint32_t>(mSize - FrameHeader::size);
+		mHeader.encode(mBuffer.data());
+		return asio::buffer(mBuffer.data(), mSize);
+	}
+
+	void release() {
+		mBuffer.reset();
+		mSize = 0;
+	}
+
+private:
+	void reserve(size_t size) {
+		if (size <= mBuffer.capacity()) {
+			return;
+		}
+
+		auto capacity = std::max({size, mBuffer.capacity() * 2, initialCapacity});
+		auto buffer = mResource ? PooledBuffer::allocate(*mResource, capacity) : BufferPool::local().acquire(capacity);
+
+		if (mSize) {
+			std::memcpy(buffer.data(), mBuffer.data(), mSize);
+		}
+
+		mBuffer = std::move(buffer);
+	}
+
+	std::pmr::memory_resource* mResource = nullptr;
+	FrameHeader mHeader;
+	PooledBuffer mBuffer;
+	size_t mSize = 0;
+};
+
+} //namespace network
@@ -4,20 +4,37 @@
 #include "asio.hpp"
 #include "asio/ssl.hpp"
 
+#include "network/buffer_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <span>
+#include <vector>
+
 using asio::awaitable;
 using asio::use_awaitable;
 using asio::ip::tcp;
 
 namespace network {
 
-std::string to_string(const tcp::endpoint& endpoint) {
-	std::stringstream ss;
-	ss << endpoint;
-	return ss.str();
-}
+std::string to_string(const tcp::endpoint& endpoint);
+
+// Outbound queue tuning per transport. Queued messages are packed back to
+// back into chunks of `chunkSize` bytes; `gatherDirect` says whether an idle
+// stream may hand a multi-buffer sequence straight to the transport.
+template <typename Handler>
+struct WriteTraits {
+	static constexpr size_t chunkSize = 64 * 1024;
+	static constexpr bool gatherDirect = true;
+};
 
 template <typename Handler>
 struct Stream {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr size_t defaultFlushThreshold = 256 * 1024;
+
 	Stream() = delete;
 	Stream(const Stream&) = delete;
 	Stream& operator=(const Stream&) = delete;
@@ -26,10 +43,13 @@ struct Stream {
 
 	Stream(Stream&& other)
 		: mHandler{std::move(other.mHandler)}
+		, mFlushThreshold{other.mFlushThreshold}
 	{}
 
 	Stream& operator=(Stream&& other) {
 		std::swap(mHandler, other.mHandler);
+		std::swap(mFlushThreshold, other.mFlushThreshold);
+		return *this;
 	}
 
 
@@ -37,10 +57,41 @@ struct Stream {
 		: mHandler{std::move(handler)}
 	{}
 
-	awaitable<size_t> asyncWrite(auto&& buffer) {
-		auto bytes = co_await asio::async_write(mHandler, buffer, use_awaitable);
-		co_return bytes;
+	/*
+	 * Writes the buffers, or queues a copy of them if another write is in
+	 * flight. The coroutine that owns the in-flight write keeps flushing the
+	 * queue with one gathered write per batch of up to flushThreshold() bytes
+	 * until it is empty, so a burst of small messages costs one syscall (and
+	 * for TLS one full-size record per chunk) instead of one per message.
+	 */
+	awaitable<size_t> asyncWrite(const auto& buffers) {
+		auto bytes = asio::buffer_size(buffers);
+
+		if (mWriting) {
+			enqueue(buffers);
+			co_return bytes;
+		}
 
+		mWriting = true;
+		mWriteProgress = Clock::now();
+
+		try {
+			if (WriteTraits<Handler>::gatherDirect || isSingleBuffer(buffers)) {
+				co_await asio::async_write(mHandler, buffers, use_awaitable);
+			} else {
+				enqueue(buffers);
+			}
+
+			co_await flushQueue();
+		} catch (...) {
+			mWriting = false;
+			mQueue.clear();
+			mQueuedBytes = 0;
+			throw;
+		}
+
+		mWriting = false;
+		co_return bytes;
 	}
 
 	awaitable<size_t> asyncRead(auto&& buffer) {
@@ -48,13 +99,97 @@ struct Stream {
 		co_return bytes;
 	}
 
+	auto executor() { return mHandler.get_executor(); }
+
+	size_t queuedBytes() const { return mQueuedBytes; }
+
+	// Whether a write is in flight, and when it last completed a batch or
+	// started; a peer that stops reading freezes the latter.
+	bool writing() const { return mWriting; }
+	Clock::time_point writeProgress() const { return mWriteProgress; }
+	size_t flushThreshold() const { return mFlushThreshold; }
+	void setFlushThreshold(size_t threshold) { mFlushThreshold = std::max<size_t>(threshold, 1); }
+
 
 protected:
 	Handler mHandler;
+
+private:
+	struct Chunk {
+		PooledBuffer buffer;
+		size_t size = 0;
+	};
+
+	static bool isSingleBuffer(const auto& buffers) {
+		return asio::buffer_sequence_begin(buffers) == asio::buffer_sequence_end(buffers) ||
+			std::next(asio::buffer_sequence_begin(buffers)) == asio::buffer_sequence_end(buffers);
+	}
+
+	void enqueue(const auto& buffers) {
+		constexpr auto chunkSize = WriteTraits<Handler>::chunkSize;
+
+		for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers); ++it) {
+			auto* data = static_cast<const uint8_t*>(asio::const_buffer(*it).data());
+			auto left = asio::const_buffer(*it).size();
+
+			while (left) {
+				// Chunks already handed to the transport must not grow.
+				if (mQueue.size() == mInflightChunks || mQueue.back().size == chunkSize) {
+					mQueue.push_back(Chunk{BufferPool::local().acquire(chunkSize), 0});
+				}
+
+				auto& chunk = mQueue.back();
+				auto count = std::min(left, chunkSize - chunk.size);
+				std::memcpy(chunk.buffer.data() + chunk.size, data, count);
+
+				chunk.size += count;
+				data += count;
+				left -= count;
+				mQueuedBytes += count;
+			}
+		}
+	}
+
+	awaitable<void> flushQueue();
+
+	size_t mFlushThreshold = defaultFlushThreshold;
+	bool mWriting = false;
+	Clock::time_point mWriteProgress;
+	std::vector<Chunk> mQueue;
+	size_t mInflightChunks = 0;
+	size_t mQueuedBytes = 0;
+	std::vector<asio::const_buffer> mGather;
 };
 
+template <typename Handler>
+awaitable<void> Stream<Handler>::flushQueue() {
+	while (!mQueue.empty()) {
+		size_t batchBytes = 0;
+		mGather.clear();
+
+		for (auto& chunk: mQueue) {
+			if (!mGather.empty() && batchBytes + chunk.size > mFlushThreshold) {
+				break;
+			}
+
+			mGather.push_back(asio::buffer(chunk.buffer.data(), chunk.size));
+			batchBytes += chunk.size;
+		}
+
+		mInflightChunks = mGather.size();
+		co_await asio::async_write(mHandler, std::span<const asio::const_buffer>{mGather}, use_awaitable);
+
+		mQueue.erase(mQueue.begin(), mQueue.begin() + mInflightChunks);
+		mQueuedBytes -= batchBytes;
+		mInflightChunks = 0;
+		mWriteProgress = Clock::now();
+	}
+}
+
 
+// Both transports are compiled once, in src/stream.cpp.
 using TcpSocket = tcp::socket;
+extern template struct Stream<TcpSocket>;
 
 struct TcpStream: Stream<TcpSocket> {
 	using Stream<TcpSocket>::Stream;
@@ -65,10 +200,10 @@ struct TcpStream: Stream<TcpSocket> {
 	bool isOpen() const { return mHandler.is_open(); }
 	std::string remoteEndpoint() const { return to_string(mHandler.remote_endpoint()); }
 
-	awaitable<void> asyncShutdown() {
-		mHandler.shutdown(TcpSocket::shutdown_both);
-		co_return;
-	}
+	// Zero-byte wait for readability, so no read buffer is needed until the
+	// peer has actually sent something (a no-op on io_uring).
+	awaitable<void> asyncWaitReadable();
+	awaitable<void> asyncShutdown();
 
 	void close() {
 		if (isOpen()) {
@@ -81,6 +216,17 @@ struct TcpStream: Stream<TcpSocket> {
 
 using SslSocket = asio::ssl::stream<TcpSocket>;
 
+// The SSL stream encrypts one buffer per SSL_write, so queued messages are
+// packed into chunks of the maximum TLS record payload and never gathered
+// from scattered caller buffers.
+template <>
+struct WriteTraits<SslSocket> {
+	static constexpr size_t chunkSize = 16 * 1024;
+	static constexpr bool gatherDirect = false;
+};
+
+extern template struct Stream<SslSocket>;
+
 struct SslStream: Stream<SslSocket>
 {
 	using Stream<SslSocket>::Stream;
@@ -90,9 +236,10 @@ struct SslStream: Stream<SslSocket>
 	bool isOpen() const { return mHandler.lowest_layer().is_open(); }
 	std::string remoteEndpoint() const { return to_string(mHandler.lowest_layer().remote_endpoint()); }
 
-	awaitable<void> asyncShutdown() {
-		co_await mHandler.async_shutdown(use_awaitable);
-	}
+	// The SSL engine may already hold decrypted bytes that the socket will
+	// never signal, so the read itself has to be the wait.
+	awaitable<void> asyncWaitReadable();
+	awaitable<void> asyncShutdown();
 
 	void close() {
 		if (isOpen()) {
@@ -0,0 +1,4 @@
+// The one translation unit that compiles asio and its SSL support when
+// ASIO_SEPARATE_COMPILATION is defined; everything else sees declarations.
+#include "asio/impl/src.hpp"
+#include "asio/ssl/impl/src.hpp"
@@ -0,0 +1,8 @@
+#include "network/channel.hpp"
+
+namespace network {
+
+template struct Channel<TcpStream>;
+template struct Channel<SslStream>;
+
+} //namespace network
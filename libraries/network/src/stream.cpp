@@ -0,0 +1,54 @@
+#include "network/stream.hpp"
+
+#include <array>
+#include <sstream>
+
+namespace network {
+
+std::string to_string(const tcp::endpoint& endpoint) {
+	std::stringstream ss;
+	ss << endpoint;
+	return ss.str();
+}
+
+template struct Stream<TcpSocket>;
+template struct Stream<SslSocket>;
+
+#if defined(NETWORK_IO_URING)
+// The ring completes the read itself when data arrives, so a separate
+// readiness wait would only double the submissions per message.
+awaitable<void> TcpStream::asyncWaitReadable() {
+	co_return;
+}
+#else
+awaitable<void> TcpStream::asyncWaitReadable() {
+	co_await mHandler.async_wait(TcpSocket::wait_read, use_awaitable);
+}
+#endif
+
+// Half-closes, then reads until the peer closes too: closing with unread
+// input would reset the connection, and a reset can discard replies the
+// peer has not read yet. Whatever the peer still sends is dropped.
+awaitable<void> TcpStream::asyncShutdown() {
+	mHandler.shutdown(TcpSocket::shutdown_send);
+
+	std::array<char, 4096> discarded;
+
+	while (true) {
+		auto [error, bytes] = co_await mHandler.async_read_some(asio::buffer(discarded), asio::as_tuple(use_awaitable));
+
+		if (error) {
+			break;
+		}
+	}
+}
+
+awaitable<void> SslStream::asyncWaitReadable() {
+	co_return;
+}
+
+awaitable<void> SslStream::asyncShutdown() {
+	co_await mHandler.async_shutdown(use_awaitable);
+}
+
+} //namespace network